@@ -5,12 +5,23 @@
 #include <cstdio>
 #include <cstring>
 #include <set>
+#include <unordered_map>
 #include "event.h"
 #include "god.h"
+#include "keepalive.h"
 #include "openflow.h"
 
-// Set of outstanding polls, so we don't fire more than one event per poll
-typedef std::map<uint32_t, std::pair<uint64_t, uint32_t> > outstanding_t;
+#define REFERENCE_SPEED 100000000  // kb/s; a port at least this fast costs 1
+#define MAX_PORT_COST 65535
+
+typedef struct {
+    uint64_t uid;
+    uint32_t port;
+    timer_id_t timeout;
+} poll_t;
+
+// Outstanding polls by id, so an answered poll can cancel its timeout
+typedef std::unordered_map<uint32_t, poll_t> outstanding_t;
 static outstanding_t outstanding;
 
 static void send_polls_event(void*);
@@ -21,15 +32,16 @@ void send_polls(Client* client) {
     Server* server = (Server*)client->server;
     std::set<uint32_t>::iterator it;
     for (it = client->ports.begin(); it != client->ports.end(); it++) {
-        send_poll(client, *it, 750);
+        send_poll(client, *it, poll_timeout_ms(client));
     }
-    server->schedule_event(1000, send_polls_event, (void*)client->uid);
+    client->poll_timer =
+        server->schedule_event(1000, send_polls_event, (void*)client->uid);
 }
 
 void send_polls_event(void* arg) {
-    Client* client = client_table[(uint64_t)arg];
-    if (client != nullptr) {
-        send_polls(client);
+    std::map<uint64_t, Client*>::iterator it = client_table.find((uint64_t)arg);
+    if (it != client_table.end()) {
+        send_polls(it->second);
     }
 }
 
@@ -38,18 +50,27 @@ void send_poll(Client* client, uint32_t port, uint64_t timeout) {
     Server* server = (Server*)client->server;
 
     poll_id++;
-    outstanding.insert(std::pair<uint32_t, std::pair<uint64_t, uint32_t> >(
-        (uint32_t)poll_id, std::pair<uint64_t, uint32_t>(client->uid, port)));
+    uint32_t id = (uint32_t)poll_id;
+    if (server->cluster != nullptr) {
+        // Our shard in the top byte, so whichever shard sees it knows whose
+        id = (server->cluster->shard << 24) | (id & 0xffffff);
+    }
 
     switch_poll_t beacon;
     memcpy(beacon.magic, SWITCH_POLL_MAGIC, 6);
-    beacon.poll_id = htonl((uint32_t)poll_id);
+    beacon.poll_id = htonl(id);
     beacon.uid1 = htonl(client->uid >> 32);
     beacon.uid2 = htonl((uint32_t)client->uid);
     beacon.port_id = htonl(port);
 
     send_packet_out(client, port, &beacon, sizeof(beacon));
-    server->schedule_event(timeout, poll_timeout, (void*)poll_id);
+
+    poll_t poll;
+    poll.uid = client->uid;
+    poll.port = port;
+    poll.timeout =
+        server->schedule_event(timeout, poll_timeout, (void*)(uint64_t)id);
+    outstanding[id] = poll;
 }
 
 void recv_poll(Client* client, uint32_t port, const uint8_t* data) {
@@ -62,36 +83,63 @@ void recv_poll(Client* client, uint32_t port, const uint8_t* data) {
     uint64_t from_uid =
         ((uint64_t)ntohl(beacon.uid1) << 32) | ntohl(beacon.uid2);
     uint32_t from_port = ntohl(beacon.port_id);
+    uint8_t remote = 0;
+
+    if (!poll_answered(server, poll_id)) {
+        if (server->cluster == nullptr ||
+            client_table.find(from_uid) != client_table.end()) {
+            // Poll has already been handled (timeout fired or duplicate frame)
+            return;
+        }
+        // Another shard sent it, and is waiting to hear that it arrived
+        remote = 1;
+    }
 
-    if (outstanding.erase(poll_id) == 0) {
-        // Poll has already been handled (timeout fired or duplicate frame)
-        return;
-    } else if (graph->has_edge(from_uid, from_port, client->uid, port)) {
+    if (graph->has_edge(from_uid, from_port, client->uid, port)) {
         // Edge exists, do nothing
+        if (remote) {
+            server->cluster->edge_up(from_uid, from_port, client->uid, port,
+                                     poll_id, poll_id >> 24);
+        }
         return;
     }
     graph->add_edge(from_uid, from_port, client->uid, port);
+    if (server->cluster != nullptr) {
+        server->cluster->edge_up(from_uid, from_port, client->uid, port,
+                                 poll_id, ALL_SHARDS);
+    }
 
     god_function(server);
 }
 
+/* Stop waiting for a poll; returns 0 if we were not waiting for it */
+uint8_t poll_answered(Server* server, uint32_t poll_id) {
+    outstanding_t::iterator it = outstanding.find(poll_id);
+    if (it == outstanding.end()) {
+        return 0;
+    }
+    server->cancel_event(it->second.timeout);
+    outstanding.erase(it);
+    return 1;
+}
+
 void poll_timeout(void* arg) {
     uint64_t poll_id = (uint64_t)arg;
     outstanding_t::iterator it = outstanding.find((uint32_t)poll_id);
     if (it == outstanding.end()) {
-        // Poll has already been handled (timeout fired or duplicate frame)
+        // Poll has already been handled (duplicate frame)
         return;
     }
-    uint64_t uid = it->second.first;
-    uint32_t port = it->second.second;
+    uint64_t uid = it->second.uid;
+    uint32_t port = it->second.port;
     outstanding.erase(it);
 
-    Client* client = client_table[uid];
-    if (client == nullptr) {
+    std::map<uint64_t, Client*>::iterator cit = client_table.find(uid);
+    if (cit == client_table.end()) {
         // The client may have been removed
         return;
     }
-    port_down(client, port);
+    port_down(cit->second, port);
 }
 
 void port_down(Client* client, uint32_t port) {
@@ -102,5 +150,36 @@ void port_down(Client* client, uint32_t port) {
         return;
     }
     graph->remove_edge(client->uid, port);
+    if (server->cluster != nullptr) {
+        server->cluster->edge_down(client->uid, port);
+    }
     god_function(server);
 }
+
+/*
+ * A port's speed, in kb/s, as the switch reports it. Its cost goes down as
+ * the speed goes up, unless the configuration names a cost for that port.
+ */
+void port_speed(Client* client, uint32_t port, uint32_t speed) {
+    Server* server = (Server*)client->server;
+    uint32_t cost = DEFAULT_PORT_COST;
+
+    std::map<std::pair<uint64_t, uint32_t>, uint32_t>::iterator it =
+        server->link_costs.find(std::make_pair(client->uid, port));
+    if (it != server->link_costs.end()) {
+        cost = it->second;
+    } else if (speed != 0) {
+        cost = REFERENCE_SPEED / speed;
+        cost = cost < 1 ? 1 : cost > MAX_PORT_COST ? MAX_PORT_COST : cost;
+    }
+
+    if (cost == server->graph.port_cost(client->uid, port)) {
+        return;
+    }
+    if (server->cluster != nullptr) {
+        server->cluster->port_cost(client->uid, port, cost);
+    }
+    if (server->graph.set_port_cost(client->uid, port, cost)) {
+        god_function(server);
+    }
+}
@@ -5,6 +5,8 @@
 #include <set>
 #include "client.h"
 
+class Server;
+
 const uint8_t SWITCH_POLL_MAGIC[7] = "\x50\x05\xa1\xc0\xff\xee";
 
 typedef struct {
@@ -18,6 +20,8 @@ typedef struct {
 
 void send_polls(Client*);
 void recv_poll(Client*, uint32_t, const uint8_t* data);
+uint8_t poll_answered(Server*, uint32_t);
 void port_down(Client*, uint32_t);
+void port_speed(Client*, uint32_t, uint32_t);
 
 #endif /* BEACON_H_ */
@@ -1,39 +1,90 @@
 #include "client.h"
 #include <arpa/inet.h>
 #include <errno.h>
+#include <linux/io_uring.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
+#include <utility>
 #include "beacon.h"
 #include "event.h"
+#include "god.h"
 #include "openflow.h"
 
-#define CLIENT_STATE_WAITING_HEADER 1
-#define CLIENT_STATE_WAITING_PACKET 2
+// Large enough for the biggest OpenFlow message (the length is 16 bits)
+#define RECV_BUFFER_SIZE 65536
 
-#define READ_PARTIAL 1
-#define READ_COMPLETE 2
-#define READ_EOF 3
-#define READ_STOP 4
+// Compact the receive buffer rather than read fewer bytes than this
+#define RECV_MIN_READ 4096
 
-Write::Write(uint8_t *d, uint16_t s) {
-    data = d;
+// Most queued writes gathered into one writev/sendmsg
+#define MAX_GATHER 256
+
+// Beacons beyond this are dropped; the next round of polls replaces them
+#define DISCOVERY_LANE_CAP (256 * 1024)
+
+// Route updates for a switch wait while its flow lane is above high water
+#define FLOW_HIGH_WATER (1024 * 1024)
+#define FLOW_LOW_WATER (256 * 1024)
+
+// A switch that lets this much output pile up is disconnected
+#define OUTPUT_HARD_CAP (32 * 1024 * 1024)
+
+Write::Write(MsgBuf &&b, uint8_t l) : buf(std::move(b)) {
     pos = 0;
-    size = s;
+    lane = l;
 }
 
-Client::Client(int f, void *s) {
+static void client_closed_event(void *);
+static void client_drained_event(void *);
+
+Client::Client(int f, Reactor *r) {
     fd = f;
-    server = s;
+    reactor = r;
+    server = r->server;
     uid = 0;
     canwrite = 0;
-    state = CLIENT_STATE_WAITING_HEADER;
-    bufsize = sizeof(ofp_header_t);
-    pos = 0;
+    closed = 0;
+    flush_posted = 0;
+    flush_pending = 0;
+    memset(lane_bytes, 0, sizeof(lane_bytes));
+    partial_lane = -1;
+    sends_inflight = 0;
+    send_bytes = 0;
+    send_iov = nullptr;
+    send_lanes = nullptr;
+    congested = 0;
+    routes_deferred = 0;
+    routes_epoch = 0;
+    evicted = 0;
+    in_batch = 0;
+    fence_xid = 0;
+    rhead = 0;
+    rtail = 0;
     has_mst = 0;
-    cur_packet = (ofp_header_t *)malloc(bufsize);
-    if (cur_packet == nullptr) {
+    has_bcast_rule = 0;
+    next_ecmp_group = 1;
+    reconciling = 0;
+    poll_timer = 0;
+    handshake_done = 0;
+    handshake_timer = 0;
+    packet_in_conn = this;
+    packet_ins_admitted = 0;
+    packet_ins_shed = 0;
+    packet_ins_port_shed = 0;
+    shed_reported = 0;
+    echo_timer = 0;
+    datagram_peer = 0;
+    aux_id = 0;
+    main_conn = nullptr;
+    echo_seq = 0;
+    echo_acked = 0;
+    rbuf = (uint8_t *)malloc(RECV_BUFFER_SIZE);
+    if (rbuf == nullptr) {
         perror("malloc");
         exit(-1);
     }
@@ -43,146 +94,473 @@ void Client::init() {
     init_connection(this);
 }
 
-/* Note: client will now own buf, so don't use buf after making this call */
-void Client::write_packet(void *buf, uint16_t count) {
-    write_queue.push(Write((uint8_t *)buf, count));
-    flush_write_queue();
+/*
+ * Queue buf on an output lane. The client takes ownership of buf; it goes
+ * back to the pool once sent.
+ */
+void Client::write_packet(MsgBuf buf, uint8_t lane) {
+    if (Reactor::current() != reactor) {
+        /* Only the client's own reactor may touch its socket */
+        std::lock_guard<std::mutex> guard(posted_lock);
+        posted.push_back(Write(std::move(buf), lane));
+        if (!flush_posted) {
+            flush_posted = 1;
+            reactor->post(flush_posted_event, this);
+        }
+        return;
+    }
+    enqueue(Write(std::move(buf), lane));
+}
+
+void Client::enqueue(Write &&w) {
+    size_t total = lane_bytes[LANE_CONTROL] + lane_bytes[LANE_DISCOVERY] +
+                   lane_bytes[LANE_FLOW];
+
+    if (closed || evicted) {
+        return;
+    }
+    if (w.lane == LANE_DISCOVERY &&
+        lane_bytes[LANE_DISCOVERY] + w.buf.size > DISCOVERY_LANE_CAP) {
+        return;
+    }
+    if (total + w.buf.size > OUTPUT_HARD_CAP) {
+        /* The reactor closes the connection once it sees the shutdown */
+        fprintf(stderr, "switch %016llx: output queue full, disconnecting\n",
+                (unsigned long long)uid);
+        shutdown(fd, SHUT_RDWR);
+        evicted = 1;
+        return;
+    }
+
+    lane_bytes[w.lane] += w.buf.size;
+    if (w.lane == LANE_FLOW && lane_bytes[LANE_FLOW] >= FLOW_HIGH_WATER) {
+        congested = 1;
+    }
+    lanes[w.lane].push_back(std::move(w));
+    schedule_flush();
+}
+
+/* Drop the (sent) write at the front of a lane */
+void Client::dequeue(uint8_t lane) {
+    lane_bytes[lane] -= lanes[lane].front().buf.size;
+    lanes[lane].pop_front();
+    if (lane == LANE_FLOW && congested &&
+        lane_bytes[LANE_FLOW] < FLOW_LOW_WATER) {
+        congested = 0;
+        ((Server *)server)->run_on_owner(client_drained_event, this);
+    }
+}
+
+/* Have the reactor flush this client's queue at the end of its iteration */
+void Client::schedule_flush() {
+    if (!flush_pending) {
+        flush_pending = 1;
+        reactor->dirty.push_back(this);
+    }
+}
+
+/* Runs on the client's reactor: queue everything other threads wrote */
+void Client::flush_posted_event(void *arg) {
+    Client *client = (Client *)arg;
+    std::vector<Write> writes;
+
+    {
+        std::lock_guard<std::mutex> guard(client->posted_lock);
+        writes.swap(client->posted);
+        client->flush_posted = 0;
+    }
+
+    std::vector<Write>::iterator it;
+    for (it = writes.begin(); it != writes.end(); it++) {
+        client->enqueue(std::move(*it));
+    }
+}
+
+size_t Client::lane_size(uint8_t lane) const {
+    return lane_bytes[lane];
 }
 
-/* Read some data into the buffer, and handle  */
+size_t Client::lane_writes(uint8_t lane) const {
+    return lanes[lane].size();
+}
+
+const Write *Client::partial_write() const {
+    return partial_lane >= 0 ? &lanes[partial_lane].front() : nullptr;
+}
+
+uint8_t Client::is_closed() const {
+    return closed;
+}
+
+uint8_t Client::is_evicted() const {
+    return evicted;
+}
+
+/* Take the writes other threads have handed over but the reactor has not */
+std::vector<Write> Client::take_posted() {
+    std::lock_guard<std::mutex> guard(posted_lock);
+    std::vector<Write> writes;
+
+    writes.swap(posted);
+    return writes;
+}
+
+/* Disconnect the switch; safe to call from any thread */
+void Client::evict() {
+    reactor->post(evict_event, this);
+}
+
+/* Runs on the client's reactor, which closes the connection once it sees EOF */
+void Client::evict_event(void *arg) {
+    Client *client = (Client *)arg;
+
+    if (!client->closed && !client->evicted) {
+        shutdown(client->fd, SHUT_RDWR);
+        client->evicted = 1;
+    }
+}
+
+/* Read everything the socket has, and handle every message that completes */
 void Client::handle_read_event() {
-    int status;
+    ssize_t status;
+
+    while (!closed) {
+        size_t need = pending_bytes();
+        reserve_recv(need > RECV_MIN_READ ? need : RECV_MIN_READ);
 
-    for (;;) {
-        status = read_into_buffer();
-        if (status == READ_STOP) {
+        status = read(fd, rbuf + rtail, RECV_BUFFER_SIZE - rtail);
+        if (status < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("read");
+            }
             break;
-        } else if (status == READ_EOF) {
+        } else if (status == 0 && (!datagram_peer || evicted)) {
             close_client();
             break;
-        } else if (status == READ_COMPLETE) {
-            switch (state) {
-                case CLIENT_STATE_WAITING_HEADER:
-                    handle_header();
-                    break;
-                case CLIENT_STATE_WAITING_PACKET:
-                    handle_packet();
-                    break;
-                default:
-                    fprintf(stderr, "Unexpected client state: %d\n", state);
-                    exit(-1);
+        }
+
+        rtail += (size_t)status;
+        rhead += handle_messages(rbuf + rhead, rtail - rhead);
+        if (rhead == rtail || datagram_peer) {
+            // A datagram's messages never continue in the next one
+            rhead = rtail = 0;
+        }
+    }
+}
+
+/* io_uring: data landed in a provided buffer (or the receive ended) */
+void Client::handle_recv(int32_t res, uint32_t flags) {
+    Uring *ring = reactor->ring;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        if (res > 0 && !closed) {
+            handle_data(ring->buffer(flags), (size_t)res);
+            if (datagram_peer) {
+                rhead = rtail = 0;
             }
         }
+        ring->recycle(flags);
+    }
+    if (closed) {
+        return;
+    }
+
+    if (res == 0 && (!datagram_peer || evicted)) {
+        close_client();
+    } else if (res < 0 && res != -ENOBUFS) {
+        fprintf(stderr, "recv: %s\n", strerror(-res));
+        close_client();
+    } else if (!(flags & IORING_CQE_F_MORE)) {
+        ring->prep_recv(fd, (uint64_t)(uintptr_t)this | URING_RECV);
+    }
+}
+
+/* io_uring: the sendmsg of the writes at the front of the lanes completed */
+void Client::handle_send(int32_t res) {
+    size_t ndx;
+
+    for (ndx = 0; ndx < sends_inflight; ndx++) {
+        dequeue(send_lanes[ndx]);
+    }
+    sends_inflight = 0;
+    if (closed) {
+        return;
+    }
+
+    if (res < 0 || (size_t)res != send_bytes) {
+        close_client();
+    } else {
+        schedule_flush();
+    }
+}
+
+/*
+ * Point iov at the next writes to send, highest priority lane first, and
+ * note each one's lane. A write that is already partly on the wire has to
+ * be finished before anything else. Return how many writes were gathered.
+ */
+size_t Client::gather(struct iovec *iov, uint8_t *iov_lanes) {
+    // Over UDP, each message is a datagram of its own
+    size_t limit = datagram_peer ? 1 : MAX_GATHER;
+    size_t count = 0, ndx;
+    int lane;
+
+    if (partial_lane >= 0) {
+        Write &w = lanes[partial_lane].front();
+        iov[count].iov_base = w.buf.data + w.pos;
+        iov[count].iov_len = w.buf.size - w.pos;
+        iov_lanes[count++] = (uint8_t)partial_lane;
+    }
+    for (lane = 0; lane < NUM_LANES && count < limit; lane++) {
+        ndx = (lane == partial_lane) ? 1 : 0;
+        for (; ndx < lanes[lane].size() && count < limit; ndx++) {
+            Write &w = lanes[lane][ndx];
+            iov[count].iov_base = w.buf.data;
+            iov[count].iov_len = w.buf.size;
+            iov_lanes[count++] = (uint8_t)lane;
+        }
     }
+    return count;
 }
 
+/* Write out as much of the lanes as the socket takes, in gather writes */
 void Client::flush_write_queue() {
+    struct iovec iov[MAX_GATHER];
+    uint8_t iov_lanes[MAX_GATHER];
+    size_t ndx, count, total;
     ssize_t status;
 
-    while (canwrite && !write_queue.empty()) {
-        Write w = write_queue.front();
-        status = write(fd, w.data + w.pos, w.size - w.pos);
+    if (reactor->ring != nullptr) {
+        /*
+         * One sendmsg at a time; MSG_WAITALL has the kernel finish it
+         * before completing, so the next one never overtakes it.
+         */
+        if (closed || sends_inflight > 0) {
+            return;
+        }
+        if (send_iov == nullptr) {
+            send_iov = (struct iovec *)malloc(MAX_GATHER * sizeof(*send_iov));
+            send_lanes = (uint8_t *)malloc(MAX_GATHER);
+            if (send_iov == nullptr || send_lanes == nullptr) {
+                perror("malloc");
+                exit(-1);
+            }
+        }
+        if ((count = gather(send_iov, send_lanes)) == 0) {
+            return;
+        }
+        send_bytes = 0;
+        for (ndx = 0; ndx < count; ndx++) {
+            send_bytes += send_iov[ndx].iov_len;
+        }
+        memset(&send_msg, 0, sizeof(send_msg));
+        send_msg.msg_iov = send_iov;
+        send_msg.msg_iovlen = count;
+        reactor->ring->prep_sendmsg(fd, &send_msg,
+                                    (uint64_t)(uintptr_t)this | URING_SEND);
+        sends_inflight = count;
+        return;
+    }
+
+    while (canwrite && !closed && (count = gather(iov, iov_lanes)) > 0) {
+        total = 0;
+        for (ndx = 0; ndx < count; ndx++) {
+            total += iov[ndx].iov_len;
+        }
+
+        status = writev(fd, iov, (int)count);
         if (status < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 canwrite = 0;
             } else {
                 // fprintf(stderr, "write(%d): %s\n", fd, strerror(errno));
                 close_client();
-                break;
             }
-        } else {
-            w.pos += status;
-            if (w.pos == w.size) {
-                // Complete write. Dequeue
-                free(w.data);
-                write_queue.pop();
+            break;
+        }
+
+        /* Dequeue what was written; a write may have gone out in part */
+        size_t left = (size_t)status;
+        partial_lane = -1;
+        for (ndx = 0; ndx < count && left > 0; ndx++) {
+            Write &w = lanes[iov_lanes[ndx]].front();
+            if (left < iov[ndx].iov_len) {
+                w.pos = (uint16_t)(w.pos + left);
+                partial_lane = iov_lanes[ndx];
+                break;
             }
+            left -= iov[ndx].iov_len;
+            dequeue(iov_lanes[ndx]);
+        }
+        if ((size_t)status < total) {
+            // Socket buffer is full; EPOLLOUT tells us when to go on
+            canwrite = 0;
         }
     }
 }
 
-void Client::handle_header() {
-    cur_packet->length = ntohs(cur_packet->length);
+/*
+ * Hand each complete message in data to the OpenFlow layer, without copying
+ * it. Return how many bytes were used; the rest is an incomplete message.
+ */
+size_t Client::handle_messages(uint8_t *data, size_t len) {
+    size_t used = 0;
+
+    while (!closed && len - used >= sizeof(ofp_header_t)) {
+        ofp_header_t *msg = (ofp_header_t *)(data + used);
+        uint16_t length = ntohs(msg->length);
 
-    if (cur_packet->length > sizeof(ofp_header_t)) {
-        bufsize = cur_packet->length;
-        cur_packet = (ofp_header_t *)realloc(cur_packet, bufsize);
-        if (cur_packet == nullptr) {
-            perror("realloc");
-            exit(-1);
+        if (length < sizeof(ofp_header_t)) {
+            length = sizeof(ofp_header_t);
+        }
+        if (len - used < length) {
+            break;
         }
-    } else if (cur_packet->length < sizeof(ofp_header_t)) {
-        cur_packet->length = sizeof(ofp_header_t);
+        /* Handlers see the length in host order */
+        msg->length = length;
+        handle_ofp_packet(this, msg);
+        used += length;
     }
-    state = CLIENT_STATE_WAITING_PACKET;
-    /* Do not increment pos, we want to start reading just past the header */
+    return used;
 }
 
-void Client::handle_packet() {
-    handle_ofp_packet(this);
+/* Bytes still missing from the message at the head of the receive buffer */
+size_t Client::pending_bytes() const {
+    size_t have = rtail - rhead;
+    size_t length;
 
-    state = CLIENT_STATE_WAITING_HEADER;
-    free(cur_packet);
-    bufsize = sizeof(ofp_header_t);
-    pos = 0;
-    cur_packet = (ofp_header_t *)(malloc(bufsize));
-    if (cur_packet == nullptr) {
-        perror("malloc");
-        exit(-1);
+    if (have < sizeof(ofp_header_t)) {
+        return sizeof(ofp_header_t) - have;
     }
+    length = ntohs(((const ofp_header_t *)(rbuf + rhead))->length);
+    return length > have ? length - have : 0;
 }
 
-/* Read from the client into the client's buffer.
- *
- * Return READ_COMPLETE if the buffer is now full
- * Return READ_PARTIAL if read was successful, but the buffer is not full
- * Return READ_STOP if we encountered an EAGAIN
- */
-int Client::read_into_buffer() {
-    ssize_t status;
+/* Make room for at least `want` more bytes, moving unhandled bytes down */
+void Client::reserve_recv(size_t want) {
+    size_t have = rtail - rhead;
 
-    if (pos == bufsize) {
-        /* If there is nothing to read, do nothing */
-        return READ_COMPLETE;
+    if (want > RECV_BUFFER_SIZE - have) {
+        want = RECV_BUFFER_SIZE - have;
+    }
+    if (RECV_BUFFER_SIZE - rtail >= want) {
+        return;
     }
+    memmove(rbuf, rbuf + rhead, have);
+    rhead = 0;
+    rtail = have;
+}
 
-    status = read(fd, (uint8_t *)cur_packet + pos, bufsize - pos);
-    if (status < 0) {
-        /* We should never continue past this if statement */
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            /* Do nothing */
-            return READ_STOP;
-        } else {
-            perror("read");
-            return READ_STOP;
+/*
+ * Handle bytes received by the io_uring backend. Messages are handled
+ * straight out of the kernel's buffer; only an incomplete one at the end is
+ * copied, to wait for the rest.
+ */
+void Client::handle_data(const uint8_t *data, size_t len) {
+    while (!closed && len > 0) {
+        if (rhead == rtail) {
+            size_t used = handle_messages((uint8_t *)data, len);
+            data += used;
+            len -= used;
+            if (closed || len == 0) {
+                break;
+            }
         }
-    } else if (status == 0) {
-        /* EOF */
-        return READ_EOF;
-    }
 
-    pos += status;
+        size_t count;
+        reserve_recv(len > RECV_MIN_READ ? len : RECV_MIN_READ);
+        count = RECV_BUFFER_SIZE - rtail < len ? RECV_BUFFER_SIZE - rtail : len;
+        memcpy(rbuf + rtail, data, count);
+        rtail += count;
+        data += count;
+        len -= count;
 
-    return (pos == bufsize) ? READ_COMPLETE : READ_PARTIAL;
+        rhead += handle_messages(rbuf + rhead, rtail - rhead);
+        if (rhead == rtail) {
+            rhead = rtail = 0;
+        }
+    }
 }
 
 void Client::close_client() {
-    free(cur_packet);
-    cur_packet = nullptr;
+    free(rbuf);
+    rbuf = nullptr;
 
-    /* Free any queued writes */
-    while (!write_queue.empty()) {
-        free(write_queue.front().data);
-        write_queue.pop();
+    /* Drop any queued writes the kernel is not still sending from */
+    int lane;
+    for (lane = 0; lane < NUM_LANES; lane++) {
+        size_t keep = 0, ndx;
+        for (ndx = 0; ndx < sends_inflight; ndx++) {
+            keep += send_lanes[ndx] == lane;
+        }
+        lanes[lane].erase(lanes[lane].begin() + (ptrdiff_t)keep,
+                          lanes[lane].end());
     }
 
+    if (reactor->ring != nullptr) {
+        reactor->ring->prep_cancel(fd);
+        shutdown(fd, SHUT_RDWR);
+    }
     if (close(fd) < 0) {
         perror("close");
     }
 
-    Server *s = (Server *)server;
-    s->clients.erase(fd);
-    if (uid) {
-        client_table.erase(uid);
+    closed = 1;
+    canwrite = 0;
+    reactor->clients.erase(fd);
+    ((Server *)server)->run_on_owner(client_closed_event, this);
+}
+
+/* Runs on the owner thread, which holds client_table and the timers */
+void client_closed_event(void *arg) {
+    Client *client = (Client *)arg;
+
+    Server *server = (Server *)client->server;
+
+    server->cancel_event(client->poll_timer);
+    server->cancel_event(client->echo_timer);
+    if (client->datagram_peer) {
+        server->close_datagram(client->datagram_peer);
+    }
+    if (client->aux_id) {
+        if (client->main_conn != nullptr) {
+            std::vector<Client *> *aux = &client->main_conn->aux;
+            aux->erase(std::remove(aux->begin(), aux->end(), client),
+                       aux->end());
+        }
+        server->end_handshake(client);
+        return;
+    }
+    // Auxiliary connections go with the main one
+    std::vector<Client *>::iterator ait;
+    for (ait = client->aux.begin(); ait != client->aux.end(); ait++) {
+        (*ait)->main_conn = nullptr;
+        (*ait)->evict();
+    }
+    client->aux.clear();
+    client->rtt.print(client->uid);
+    server->end_handshake(client);
+    if (client->fence_xid) {
+        fence_acked(client, client->fence_xid);
+    }
+    server->num_hosts -= client->hosts.size();
+
+    std::map<uint64_t, Client *>::iterator it = client_table.find(client->uid);
+    if (client->uid && it != client_table.end() && it->second == client) {
+        client_table.erase(it);
+        if (server->cluster != nullptr) {
+            server->cluster->switch_down(client->uid);
+        }
+    }
+}
+
+/* Runs on the owner thread: push the route updates held back for client */
+void client_drained_event(void *arg) {
+    Client *client = (Client *)arg;
+
+    if (client->routes_deferred && !client->congested) {
+        client->routes_deferred = 0;
+        god_resync(client->uid);
+        god_dijkstra((Server *)client->server);
     }
 }
@@ -2,9 +2,19 @@
 #define CLIENT_H_
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
 #include <map>
-#include <queue>
+#include <mutex>
 #include <set>
+#include <vector>
+#include "keepalive.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "timer.h"
 
 typedef struct {
     uint8_t version;
@@ -14,45 +24,143 @@ typedef struct {
     uint8_t data[];
 } __attribute__((packed)) ofp_header_t;
 
+// A queued outbound message, and how much of it has been written
 class Write {
    public:
-    uint8_t* data;
+    MsgBuf buf;
     uint16_t pos;
-    uint16_t size;
-    Write(uint8_t*, uint16_t);
+    uint8_t lane;
+    Write(MsgBuf&&, uint8_t);
+};
+
+class Reactor;
+
+// Echo requests whose send times are kept, so late replies still count
+#define ECHO_WINDOW 4
+
+// A written next hop is a port, or this bit and the id of an ECMP group
+#define ECMP_HOP (1ULL << 32)
+
+// Output lanes, highest priority first
+enum output_lane {
+    LANE_CONTROL = 0,    // handshake and keepalive
+    LANE_DISCOVERY = 1,  // link discovery beacons
+    LANE_FLOW = 2,       // flow and group programming
+    NUM_LANES = 3
 };
 
 /*
- * Clients are state machines. A client is either waiting to receive a header,
- * or it is waiting to receive a packet.
- * It is always known how many bytes a client has to receive for a given state.
+ * Each client reads into one large receive buffer, as much as the socket has,
+ * and hands every complete message in it to the OpenFlow layer in place.
+ * Bytes of a message that has not fully arrived stay in the buffer, and are
+ * only moved back to the start when the rest would not fit after them.
  */
 class Client {
    public:
-    Client(int, void*);
+    Client(int, Reactor*);
     void init();
-    void write_packet(void*, uint16_t);
+    void write_packet(MsgBuf, uint8_t);
     void handle_read_event();
+    void handle_recv(int32_t, uint32_t);
+    void handle_send(int32_t);
+    void schedule_flush();
     void flush_write_queue();
+    void evict();
+    void enqueue(Write&&);  // write_packet on the client's own reactor
+    // The output queue as it stands, for its reactor's thread to look at
+    size_t lane_size(uint8_t) const;         // bytes queued on a lane
+    size_t lane_writes(uint8_t) const;       // writes queued on a lane
+    const Write* partial_write(void) const;  // partly sent, or nullptr
+    uint8_t is_closed(void) const;
+    uint8_t is_evicted(void) const;
+    std::vector<Write> take_posted(void);  // handed over, not yet queued
     uint64_t uid;
-    ofp_header_t* cur_packet;
     void* server;
+    Reactor* reactor;  // reactor whose thread does this client's I/O
     uint8_t canwrite;
+    uint8_t flush_pending;  // on its reactor's dirty list
     std::set<uint32_t> ports;
     std::map<uint64_t, uint32_t> hosts;    // Directly-connected hosts
-    std::map<uint64_t, uint32_t> written;  // Switch's current next-hop
-    uint8_t has_mst;
+    std::map<uint64_t, uint64_t> written;  // Switch's current next-hop
+    uint8_t has_mst;                  // switch has the broadcast group
+    uint8_t has_bcast_rule;           // ... and the rule that uses it
+    // The broadcast groups' output ports, by chunk; see update_flood
+    std::map<uint32_t, std::set<uint32_t> > bcast_chunks;
+    std::set<uint32_t> bcast_chained;  // chunks the broadcast group chains to
+    // ECMP SELECT groups, each shared by the host rules with its next hops
+    std::map<std::vector<uint32_t>, uint32_t> ecmp_groups;  // ports to id
+    std::map<uint32_t, unsigned> ecmp_refs;  // host rules using each one
+    uint32_t next_ecmp_group;
+    uint8_t reconciling;  // table dumps still expected during the handshake
+    timer_id_t poll_timer;  // next send_polls_event for this switch
+    std::atomic<uint8_t> congested;  // flow lane is backed up
+    uint8_t routes_deferred;  // owner skipped route updates while congested
+    uint64_t routes_epoch;    // route table epoch its host rules are as of
+    uint8_t in_batch;    // given flow changes by the running recompute
+    uint32_t fence_xid;  // barrier we are waiting on, 0 if none
+    uint8_t handshake_done;      // holds no admission slot any more
+    timer_id_t handshake_timer;  // when the admission slot is taken back
+
+    /*
+     * OpenFlow 1.3 auxiliary connections. A switch may open more connections
+     * after its main one, over TCP or UDP; they carry PACKET_IN and
+     * PACKET_OUT so a flood of them does not hold up flow programming.
+     */
+    uint64_t datagram_peer;      // IPv4 address and port of a UDP one, else 0
+    uint8_t aux_id;              // auxiliary id, 0 on a main connection
+    Client* main_conn;           // main connection of an auxiliary one
+    std::vector<Client*> aux;    // auxiliary connections, on the owner thread
+
+    /*
+     * PACKET_IN admission, one set per switch. Its auxiliary connections are
+     * charged to the main connection's, from their own reactors, so these
+     * are only touched under packet_in_lock.
+     */
+    std::atomic<Client*> packet_in_conn;  // whose these are: this or main_conn
+    std::mutex packet_in_lock;
+    TokenBucket packet_in_limit;
+    std::map<uint32_t, TokenBucket> port_limits;
+    uint64_t packet_ins_admitted;
+    uint64_t packet_ins_shed;       // over the switch's limit
+    uint64_t packet_ins_port_shed;  // over the limit of the port they came in
+    uint64_t shed_reported;         // when shedding was last reported
+
+    // Echo keepalive, on the owner thread
+    timer_id_t echo_timer;
+    uint32_t echo_seq;    // xid of the last echo request sent
+    uint32_t echo_acked;  // xid of the last one answered
+    uint64_t echo_sent[ECHO_WINDOW];
+    RttStats rtt;
+    int fd;
 
    private:
-    void handle_header();
-    void handle_packet();
-    int read_into_buffer();
+    void handle_data(const uint8_t*, size_t);
+    size_t handle_messages(uint8_t*, size_t);
+    void reserve_recv(size_t);
+    size_t pending_bytes(void) const;
+    void dequeue(uint8_t);
+    size_t gather(struct iovec*, uint8_t*);
     void close_client();
-    int fd;
-    uint16_t bufsize;
-    uint16_t pos;
-    std::queue<Write> write_queue;
-    uint8_t state;
+    static void flush_posted_event(void*);
+    static void evict_event(void*);
+    uint8_t* rbuf;  // receive buffer; unhandled bytes are [rhead, rtail)
+    size_t rhead;
+    size_t rtail;
+    std::deque<Write> lanes[NUM_LANES];
+    size_t lane_bytes[NUM_LANES];
+    int partial_lane;       // lane whose front write is partly sent, or -1
+    size_t sends_inflight;  // io_uring: writes in the sendmsg in flight
+    size_t send_bytes;      // io_uring: bytes in the sendmsg in flight
+    struct iovec* send_iov;
+    uint8_t* send_lanes;  // io_uring: lane of each write in the sendmsg
+    struct msghdr send_msg;
+    uint8_t closed;
+    uint8_t evicted;  // shut down for letting too much output pile up
+
+    // Writes handed over by other threads, waiting to be queued by reactor
+    std::mutex posted_lock;
+    std::vector<Write> posted;
+    uint8_t flush_posted;
 };
 
 #endif /* CLIENT_H_ */
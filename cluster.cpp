@@ -0,0 +1,573 @@
+/* Clustered mode: topology replication between controller processes */
+
+#include "cluster.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include "beacon.h"
+#include "client.h"
+#include "event.h"
+#include "god.h"
+#include "openflow.h"
+
+// How often to retry connecting to a shard below us that is not up
+#define CLUSTER_RETRY_MS 500
+#define CLUSTER_READ_SIZE 65536
+
+// Messages read from the peers in one go, on their way to the owner
+typedef struct {
+    Cluster* cluster;
+    std::vector<cluster_msg_t> msgs;
+} cluster_batch_t;
+
+static std::string socket_path(const std::string&, uint32_t);
+
+std::string socket_path(const std::string& prefix, uint32_t shard) {
+    char suffix[16];
+
+    snprintf(suffix, sizeof(suffix), ".%u", shard);
+    return prefix + suffix;
+}
+
+Cluster::Cluster(Server* s, const char* p, uint32_t n) {
+    server = s;
+    prefix = p;
+    shard = n;
+    listen_fd = -1;
+    lower_connected.assign(shard, 0);
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        exit(-1);
+    }
+}
+
+/* Listen for the shards above us and start the peer thread */
+void Cluster::start() {
+    struct sockaddr_un addr;
+    std::string path = socket_path(prefix, shard);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: cluster socket path too long\n", path.c_str());
+        exit(-1);
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    unlink(path.c_str());
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) < 0) {
+        perror("bind");
+        exit(-1);
+    }
+    if (listen(listen_fd, MAX_SHARDS)) {
+        perror("listen");
+        exit(-1);
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    thread = std::thread(&Cluster::run, this);
+    thread.detach();
+}
+
+void Cluster::switch_up(uint64_t uid) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CLUSTER_SWITCH_UP;
+    msg.uid = uid;
+    send(ALL_SHARDS, msg);
+}
+
+void Cluster::switch_down(uint64_t uid) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CLUSTER_SWITCH_DOWN;
+    msg.uid = uid;
+    send(ALL_SHARDS, msg);
+}
+
+/* A link into one of our switches; poll_id is the beacon that found it */
+void Cluster::edge_up(uint64_t from, uint32_t fport, uint64_t to,
+                      uint32_t tport, uint32_t poll_id, uint32_t to_shard) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CLUSTER_EDGE_UP;
+    msg.uid = from;
+    msg.port = fport;
+    msg.other = to;
+    msg.other_port = tport;
+    msg.poll_id = poll_id;
+    send(to_shard, msg);
+}
+
+void Cluster::edge_down(uint64_t uid, uint32_t port) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CLUSTER_EDGE_DOWN;
+    msg.uid = uid;
+    msg.port = port;
+    send(ALL_SHARDS, msg);
+}
+
+void Cluster::host_up(uint64_t uid, uint64_t mac, uint32_t port) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CLUSTER_HOST_UP;
+    msg.uid = uid;
+    msg.port = port;
+    msg.other = mac;
+    send(ALL_SHARDS, msg);
+}
+
+void Cluster::host_down(uint64_t uid, uint64_t mac) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CLUSTER_HOST_DOWN;
+    msg.uid = uid;
+    msg.other = mac;
+    send(ALL_SHARDS, msg);
+}
+
+void Cluster::port_cost(uint64_t uid, uint32_t port, uint32_t cost) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = CLUSTER_PORT_COST;
+    msg.uid = uid;
+    msg.port = port;
+    msg.other = cost;
+    send(ALL_SHARDS, msg);
+}
+
+/* Runs on the owner: hand msg to the peer thread for one shard, or all */
+void Cluster::send(uint32_t to, const cluster_msg_t& msg) {
+    uint64_t one = 1;
+    uint8_t was_empty;
+
+    {
+        std::lock_guard<std::mutex> guard(outbox_lock);
+        was_empty = outbox.empty();
+        outbox.push_back(std::make_pair(to, msg));
+        outbox.back().second.shard = shard;
+    }
+    if (was_empty && write(wake_fd, &one, sizeof(one)) < 0) {
+        perror("write(eventfd)");
+    }
+}
+
+/* The peer thread */
+void Cluster::run() {
+    std::vector<struct pollfd> fds;
+    uint64_t count, now, next_retry = 0;
+    size_t ndx, npeers;
+    int timeout;
+
+    for (;;) {
+        // However busy the peers keep poll(), shards below are retried
+        now = server->now_ms();
+        if (now >= next_retry) {
+            connect_lower();
+            next_retry = now + CLUSTER_RETRY_MS;
+        }
+
+        npeers = peers.size();
+        fds.resize(2 + npeers);
+        fds[0].fd = wake_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = listen_fd;
+        fds[1].events = POLLIN;
+        for (ndx = 0; ndx < npeers; ndx++) {
+            fds[2 + ndx].fd = peers[ndx]->fd;
+            fds[2 + ndx].events =
+                (short)(POLLIN | (peers[ndx]->out.empty() ? 0 : POLLOUT));
+        }
+
+        timeout = -1;
+        for (ndx = 0; ndx < lower_connected.size(); ndx++) {
+            if (!lower_connected[ndx]) {
+                now = server->now_ms();
+                timeout = next_retry > now ? (int)(next_retry - now) : 0;
+                break;
+            }
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN &&
+            read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read(eventfd)");
+        }
+        drain_outbox();
+
+        for (ndx = 0; ndx < npeers; ndx++) {
+            peer_t* peer = peers[ndx];
+            if (fds[2 + ndx].revents & (POLLIN | POLLHUP | POLLERR) &&
+                !read_peer(peer)) {
+                peer->dead = 1;
+            } else if (!peer->out.empty() && !write_peer(peer)) {
+                peer->dead = 1;
+            }
+        }
+        for (ndx = npeers; ndx-- > 0;) {
+            if (peers[ndx]->dead) {
+                drop_peer(ndx);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_peer();
+        }
+
+        if (!inbox.empty()) {
+            cluster_batch_t* batch = new cluster_batch_t;
+            batch->cluster = this;
+            batch->msgs.swap(inbox);
+            server->run_on_owner(deliver_event, batch);
+        }
+    }
+}
+
+/* Try to reach each shard below us we have no connection to */
+void Cluster::connect_lower() {
+    struct sockaddr_un addr;
+    uint32_t lower;
+    int sock;
+
+    for (lower = 0; lower < shard; lower++) {
+        if (lower_connected[lower]) {
+            continue;
+        }
+        std::string path = socket_path(prefix, lower);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(),
+               std::min(path.size(), sizeof(addr.sun_path) - 1));
+
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror("socket");
+            return;
+        }
+        if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr),
+                    sizeof(addr)) < 0) {
+            // Not up yet; try again later
+            close(sock);
+            continue;
+        }
+        add_peer(sock, lower);
+        lower_connected[lower] = 1;
+    }
+}
+
+void Cluster::accept_peer() {
+    int sock;
+
+    while ((sock = accept(listen_fd, nullptr, nullptr)) >= 0) {
+        add_peer(sock, ALL_SHARDS);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+    }
+}
+
+/* Start talking to a peer; we learn its shard from its hello */
+void Cluster::add_peer(int sock, uint32_t peer_shard) {
+    peer_t* peer = new peer_t;
+    cluster_msg_t hello;
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    peer->fd = sock;
+    peer->shard = peer_shard;
+    peer->dead = 0;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.type = CLUSTER_HELLO;
+    hello.shard = shard;
+    peer->out.insert(peer->out.end(), (uint8_t*)&hello,
+                     (uint8_t*)&hello + sizeof(hello));
+    peers.push_back(peer);
+}
+
+/* Read what a peer sent; returns 0 if the connection is gone */
+uint8_t Cluster::read_peer(peer_t* peer) {
+    uint8_t buf[CLUSTER_READ_SIZE];
+    ssize_t status;
+    size_t off = 0;
+    uint8_t open;
+
+    while ((status = recv(peer->fd, buf, sizeof(buf), 0)) > 0) {
+        peer->in.insert(peer->in.end(), buf, buf + status);
+    }
+    // What came before the connection closed is still news
+    open = status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+    for (; off + sizeof(cluster_msg_t) <= peer->in.size();
+         off += sizeof(cluster_msg_t)) {
+        cluster_msg_t msg;
+        memcpy(&msg, peer->in.data() + off, sizeof(msg));
+        if (msg.type == CLUSTER_HELLO) {
+            if (msg.shard >= MAX_SHARDS || msg.shard == shard) {
+                fprintf(stderr, "cluster: bad shard %u\n", msg.shard);
+                return 0;
+            }
+            // A shard that reconnected takes over from its old connection
+            for (size_t ndx = 0; ndx < peers.size(); ndx++) {
+                peer_t* old = peers[ndx];
+                if (old != peer && old->shard == msg.shard) {
+                    cluster_msg_t lost;
+                    memset(&lost, 0, sizeof(lost));
+                    lost.type = CLUSTER_PEER_LOST;
+                    lost.shard = msg.shard;
+                    inbox.push_back(lost);
+                    old->shard = ALL_SHARDS;
+                    old->dead = 1;
+                }
+            }
+            peer->shard = msg.shard;
+        } else if (peer->shard == ALL_SHARDS) {
+            continue;
+        }
+        msg.shard = peer->shard;
+        inbox.push_back(msg);
+    }
+    peer->in.erase(peer->in.begin(), peer->in.begin() + (ptrdiff_t)off);
+    return open;
+}
+
+/* Write what we can of a peer's output; returns 0 if the connection is gone */
+uint8_t Cluster::write_peer(peer_t* peer) {
+    ssize_t status;
+
+    status = ::send(peer->fd, peer->out.data(), peer->out.size(),
+                    MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (status < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    peer->out.erase(peer->out.begin(), peer->out.begin() + status);
+    return 1;
+}
+
+/* Close a peer's connection, and have the owner forget its switches */
+void Cluster::drop_peer(size_t ndx) {
+    peer_t* peer = peers[ndx];
+
+    close(peer->fd);
+    if (peer->shard != ALL_SHARDS) {
+        cluster_msg_t lost;
+        memset(&lost, 0, sizeof(lost));
+        lost.type = CLUSTER_PEER_LOST;
+        lost.shard = peer->shard;
+        inbox.push_back(lost);
+        if (peer->shard < shard) {
+            lower_connected[peer->shard] = 0;
+        }
+    }
+    peers.erase(peers.begin() + (ptrdiff_t)ndx);
+    delete peer;
+}
+
+/* Queue what the owner sent on the connections it is meant for */
+void Cluster::drain_outbox() {
+    std::vector<std::pair<uint32_t, cluster_msg_t> > msgs;
+    size_t ndx;
+
+    {
+        std::lock_guard<std::mutex> guard(outbox_lock);
+        msgs.swap(outbox);
+    }
+
+    std::vector<std::pair<uint32_t, cluster_msg_t> >::iterator it;
+    for (it = msgs.begin(); it != msgs.end(); it++) {
+        const uint8_t* bytes = (const uint8_t*)&it->second;
+        for (ndx = 0; ndx < peers.size(); ndx++) {
+            peer_t* peer = peers[ndx];
+            // Peers we have no hello from get everything in our snapshot
+            if (peer->shard != ALL_SHARDS &&
+                (it->first == ALL_SHARDS || it->first == peer->shard)) {
+                peer->out.insert(peer->out.end(), bytes,
+                                 bytes + sizeof(cluster_msg_t));
+            }
+        }
+    }
+}
+
+/* Runs on the owner: apply a batch, then recompute once if anything changed */
+void Cluster::deliver_event(void* arg) {
+    cluster_batch_t* batch = (cluster_batch_t*)arg;
+    uint8_t changed = 0;
+
+    std::vector<cluster_msg_t>::iterator it;
+    for (it = batch->msgs.begin(); it != batch->msgs.end(); it++) {
+        batch->cluster->apply(*it, &changed);
+    }
+    if (changed) {
+        god_function(batch->cluster->server);
+    }
+    delete batch;
+}
+
+void Cluster::apply(const cluster_msg_t& msg, uint8_t* changed) {
+    Graph* graph = &server->graph;
+    std::map<uint64_t, uint32_t>::iterator it;
+
+    switch (msg.type) {
+        case CLUSTER_HELLO:
+            snapshot(msg.shard);
+            break;
+        case CLUSTER_SWITCH_UP:
+            if (client_table.find(msg.uid) != client_table.end()) {
+                // Connected to us as well; ours wins
+                break;
+            }
+            switches[msg.uid] = msg.shard;
+            graph->add_vertex(msg.uid);
+            break;
+        case CLUSTER_SWITCH_DOWN:
+            it = switches.find(msg.uid);
+            if (it != switches.end() && it->second == msg.shard) {
+                forget_switch(msg.uid);
+                *changed = 1;
+            }
+            break;
+        case CLUSTER_EDGE_UP:
+            if (msg.poll_id && msg.poll_id >> 24 == shard) {
+                poll_answered(server, msg.poll_id);
+            }
+            if (!graph->has_edge(msg.uid, msg.port, msg.other,
+                                 msg.other_port)) {
+                graph->add_edge(msg.uid, msg.port, msg.other, msg.other_port);
+                *changed = 1;
+            }
+            break;
+        case CLUSTER_EDGE_DOWN:
+            if (graph->has_any_edge(msg.uid, msg.port)) {
+                graph->remove_edge(msg.uid, msg.port);
+                *changed = 1;
+            }
+            break;
+        case CLUSTER_HOST_UP: {
+            std::map<uint64_t, uint32_t>* at = &hosts[msg.uid];
+            it = at->find(msg.other);
+            if (it == at->end() || it->second != msg.port) {
+                (*at)[msg.other] = msg.port;
+                god_learn_host(msg.uid, msg.other);
+                *changed = 1;
+            }
+            break;
+        }
+        case CLUSTER_HOST_DOWN:
+            if (hosts[msg.uid].erase(msg.other)) {
+                // Routed anew if it turns out to have moved
+                god_forget_host(server, msg.other);
+                *changed = 1;
+            }
+            break;
+        case CLUSTER_PORT_COST:
+            if (graph->set_port_cost(msg.uid, msg.port, (uint32_t)msg.other)) {
+                *changed = 1;
+            }
+            break;
+        case CLUSTER_PEER_LOST:
+            for (it = switches.begin(); it != switches.end();) {
+                uint64_t uid = (it++)->first;
+                if (switches[uid] != msg.shard) {
+                    continue;
+                }
+                forget_switch(uid);
+                *changed = 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "cluster: unexpected message type %u\n", msg.type);
+            break;
+    }
+}
+
+/* Tell a shard that just connected about our switches, links and hosts */
+void Cluster::snapshot(uint32_t to) {
+    Graph* graph = &server->graph;
+    cluster_msg_t msg;
+
+    std::map<uint64_t, Client*>::iterator cit;
+    for (cit = client_table.begin(); cit != client_table.end(); cit++) {
+        Client* client = cit->second;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CLUSTER_SWITCH_UP;
+        msg.uid = client->uid;
+        send(to, msg);
+
+        std::set<uint32_t>::iterator pit;
+        for (pit = client->ports.begin(); pit != client->ports.end(); pit++) {
+            memset(&msg, 0, sizeof(msg));
+            msg.type = CLUSTER_PORT_COST;
+            msg.uid = client->uid;
+            msg.port = *pit;
+            msg.other = graph->port_cost(client->uid, *pit);
+            send(to, msg);
+        }
+
+        std::map<uint64_t, uint32_t>::iterator hit;
+        for (hit = client->hosts.begin(); hit != client->hosts.end(); hit++) {
+            memset(&msg, 0, sizeof(msg));
+            msg.type = CLUSTER_HOST_UP;
+            msg.uid = client->uid;
+            msg.port = hit->second;
+            msg.other = hit->first;
+            send(to, msg);
+        }
+
+        const std::vector<edge_t>& edges = graph->edges(client->uid);
+        std::vector<edge_t>::const_iterator eit;
+        for (eit = edges.begin(); eit != edges.end(); eit++) {
+            edge_up(client->uid, eit->port, graph->dpid(eit->to),
+                    eit->to_port, 0, to);
+        }
+    }
+}
+
+/* A remote switch is gone, and so are its links and hosts */
+void Cluster::forget_switch(uint64_t uid) {
+    Graph* graph = &server->graph;
+    std::map<uint64_t, std::map<uint64_t, uint32_t> >::iterator at =
+        hosts.find(uid);
+
+    // A copy, as removing them changes the switch's edges
+    std::vector<edge_t> edges = graph->edges(uid);
+    std::vector<edge_t>::iterator eit;
+    for (eit = edges.begin(); eit != edges.end(); eit++) {
+        graph->remove_edge(uid, eit->port);
+    }
+
+    if (at != hosts.end()) {
+        // Gone from here first, so none of them is taken to have moved here
+        std::map<uint64_t, uint32_t> gone;
+        std::map<uint64_t, uint32_t>::iterator hit;
+        gone.swap(at->second);
+        hosts.erase(at);
+        for (hit = gone.begin(); hit != gone.end(); hit++) {
+            god_forget_host(server, hit->first);
+        }
+    }
+    switches.erase(uid);
+}
@@ -0,0 +1,113 @@
+#ifndef CLUSTER_H_
+#define CLUSTER_H_
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class Server;
+
+/*
+ * Clustered mode. Several controller processes on one machine each own the
+ * switches that connect to them, and keep a replica of the whole topology:
+ * every shard tells the others about its switches, their port costs, the
+ * links it discovers into them, and the hosts attached to them. Each shard
+ * computes routes over the full graph but only programs its own switches.
+ * The replicas converge on the same graph, and the path and tree walks are
+ * deterministic, so the shards agree on paths that cross them.
+ *
+ * Shard n listens on the Unix stream socket <prefix>.<n> and connects to
+ * every shard below it. Peer I/O runs on its own thread; updates are applied
+ * on the owner thread, a batch at a time.
+ */
+
+#define MAX_SHARDS 256
+#define ALL_SHARDS 0xffffffff
+
+enum cluster_msg_type {
+    CLUSTER_HELLO = 0,        // first message on a connection
+    CLUSTER_SWITCH_UP = 1,    // uid
+    CLUSTER_SWITCH_DOWN = 2,  // uid
+    CLUSTER_EDGE_UP = 3,      // uid, port, far end, poll that found it
+    CLUSTER_EDGE_DOWN = 4,    // uid, port
+    CLUSTER_HOST_UP = 5,      // uid, port, mac
+    CLUSTER_HOST_DOWN = 6,    // uid, mac
+    CLUSTER_PEER_LOST = 7,    // never sent; a shard's connection dropped
+    CLUSTER_PORT_COST = 8     // uid, port, cost
+};
+
+// Every message is one fixed-size record, in host order
+typedef struct {
+    uint8_t type;
+    uint8_t _pad[3];
+    uint32_t shard;  // sender
+    uint64_t uid;
+    uint32_t port;
+    uint32_t poll_id;
+    uint64_t other;  // far end's uid, host's mac, or port's cost
+    uint32_t other_port;
+    uint8_t _pad2[4];
+} __attribute__((packed)) cluster_msg_t;
+
+class Cluster {
+   public:
+    Cluster(Server*, const char*, uint32_t);
+    void start(void);
+    void switch_up(uint64_t);
+    void switch_down(uint64_t);
+    void edge_up(uint64_t, uint32_t, uint64_t, uint32_t, uint32_t, uint32_t);
+    void edge_down(uint64_t, uint32_t);
+    void host_up(uint64_t, uint64_t, uint32_t);
+    void host_down(uint64_t, uint64_t);
+    void port_cost(uint64_t, uint32_t, uint32_t);
+    uint32_t shard;
+
+    // Other shards' state; owner thread only
+    std::map<uint64_t, uint32_t> switches;  // shard of each remote switch
+    std::map<uint64_t, std::map<uint64_t, uint32_t> > hosts;  // by switch
+
+   private:
+    friend class ClusterTest;  // test/test_cluster.cpp
+    typedef struct {
+        int fd;
+        uint32_t shard;  // ALL_SHARDS until its hello arrives
+        uint8_t dead;    // to be dropped once the loop is done with it
+        std::vector<uint8_t> in;
+        std::vector<uint8_t> out;
+    } peer_t;
+
+    void send(uint32_t, const cluster_msg_t&);
+    void run(void);
+    void connect_lower(void);
+    void accept_peer(void);
+    void add_peer(int, uint32_t);
+    uint8_t read_peer(peer_t*);
+    uint8_t write_peer(peer_t*);
+    void drop_peer(size_t);
+    void drain_outbox(void);
+    void apply(const cluster_msg_t&, uint8_t*);
+    void snapshot(uint32_t);
+    void forget_switch(uint64_t);
+    static void deliver_event(void*);
+
+    Server* server;
+    std::string prefix;
+    int listen_fd;
+    int wake_fd;
+    std::thread thread;
+
+    // Filled by the owner, drained by the peer thread
+    std::mutex outbox_lock;
+    std::vector<std::pair<uint32_t, cluster_msg_t> > outbox;
+
+    // Peer thread only
+    std::vector<peer_t*> peers;
+    std::vector<uint8_t> lower_connected;  // have a peer for each shard below
+    std::vector<cluster_msg_t> inbox;      // read, not yet handed over
+};
+
+#endif /* CLUSTER_H_ */
@@ -1,11 +1,14 @@
 #include "event.h"
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -15,10 +18,28 @@
 #include <tuple>
 #include <vector>
 #include "client.h"
+#include "god.h"
 #include "openflow.h"
 
 static uint64_t current_time_ms(void);
 static void nonblock(int);
+static void add_client_event(void*);
+static int bind_datagram(const struct sockaddr_in*);
+
+// io_uring sizing, per reactor
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+
+// Connections accepted per listening-socket event
+#define ACCEPT_BATCH 64
+
+// A switch keeps its handshake slot for at most this long
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define MAX_RECOMPUTE_DEFER_MS 2000
+
+// The reactor whose loop is running on this thread
+static thread_local Reactor* current_reactor = nullptr;
 
 void Server::open(uint16_t port) {
     int sock, one = 1;
@@ -46,7 +67,7 @@ void Server::open(uint16_t port) {
         close(sock);
         exit(-1);
     }
-    if (listen(sock, 1)) {
+    if (listen(sock, backlog)) {
         perror("listen");
         close(sock);
         exit(-1);
@@ -54,9 +75,45 @@ void Server::open(uint16_t port) {
 
     /* Set up server */
     fd = sock;
+
+    /* UDP auxiliary connections start on the same port */
+    if (port == 0) {
+        socklen_t addr_len = sizeof(addr);
+        if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                        &addr_len) < 0) {
+            perror("getsockname");
+            exit(-1);
+        }
+    }
+    udp_fd = bind_datagram(&addr);
+}
+
+/* A UDP socket on addr that other sockets may share the port with */
+int bind_datagram(const struct sockaddr_in* addr) {
+    int sock, one = 1;
+
+    if ((sock = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) < 0) {
+        perror("setsockopt");
+        exit(-1);
+    }
+    nonblock(sock);
+    if (bind(sock, reinterpret_cast<const struct sockaddr*>(addr),
+             sizeof(*addr)) < 0) {
+        perror("bind");
+        exit(-1);
+    }
+    return sock;
+}
+
+/* Milliseconds on the clock the timers run on */
+uint64_t Server::now_ms() const {
+    return current_time_ms();
 }
 
-/* Return the number of milliseconds since EPOCH */
 uint64_t current_time_ms(void) {
     struct timeval tv;
 
@@ -64,101 +121,515 @@ uint64_t current_time_ms(void) {
     return static_cast<uint64_t>(tv.tv_sec * 1000 + tv.tv_usec / 1000);
 }
 
+Server::Server() {
+    fd = -1;
+    udp_fd = -1;
+    num_threads = 1;
+    num_route_workers = 0;
+    use_uring = 0;
+    backlog = DEFAULT_BACKLOG;
+    max_handshakes = DEFAULT_MAX_HANDSHAKES;
+    host_idle_timeout = DEFAULT_HOST_IDLE_TIMEOUT;
+    host_hard_timeout = DEFAULT_HOST_HARD_TIMEOUT;
+    max_hosts = DEFAULT_MAX_HOSTS;
+    num_hosts = 0;
+    converged_ms = 0;
+    converge_time_ms = 0;
+    cluster = nullptr;
+    handshakes_inflight = 0;
+    recompute_timer = 0;
+    recompute_forced = 0;
+    next_reactor = 0;
+}
+
 void Server::listen_and_serve() {
-#define MAX_EVENTS 10
-    struct epoll_event ev, events[MAX_EVENTS];
-    int clientfd, ep, nfds, timeout;
+    unsigned ndx;
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_route_workers < 1) {
+        num_route_workers = std::thread::hardware_concurrency();
+        if (num_route_workers < 1) {
+            num_route_workers = 1;
+        }
+    }
+    route_workers.start(num_route_workers);
+    for (ndx = 0; ndx < num_threads; ndx++) {
+        add_reactor();
+    }
+    reactors[0]->watch(fd);
+    reactors[0]->watch_datagrams(udp_fd);
+    time_events.start(current_time_ms());
+    if (cluster != nullptr) {
+        cluster->start();
+    }
+
+    for (ndx = 1; ndx < num_threads; ndx++) {
+        threads.push_back(std::thread(&Reactor::run, reactors[ndx]));
+    }
+    reactors[0]->run();
+}
+
+/* A new reactor for the server; the first one is the owner */
+Reactor* Server::add_reactor() {
+    reactors.push_back(new Reactor(this));
+    return reactors.back();
+}
+
+/* Time until next time-based event fires, as an epoll timeout */
+int Server::next_timeout() {
+    return time_events.next_timeout(current_time_ms());
+}
+
+/* Drain the accept queue, up to a batch per listening-socket event */
+void Server::accept_client() {
+    int clientfd, count;
+
+    for (count = 0; count < ACCEPT_BATCH; count++) {
+        if ((clientfd = accept(fd, nullptr, nullptr)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        nonblock(clientfd);
+        assign_client(clientfd, 0);
+    }
+}
+
+/*
+ * A datagram on the shared UDP socket is a switch opening a UDP auxiliary
+ * connection. Give the switch a socket of its own, connected to it, which
+ * the kernel prefers for its datagrams from then on; the connection is a
+ * client like any other. The datagram itself, the switch's HELLO, is dropped;
+ * the client asks for its features without waiting for it.
+ *
+ * Takes up to a batch; returns 1 if the socket may still have more.
+ */
+uint8_t Server::accept_datagram() {
+    struct sockaddr_in local, peer;
+    socklen_t addr_len;
+    uint8_t buf[sizeof(ofp_header_t)];
+    int sock, count;
+
+    for (count = 0; count < ACCEPT_BATCH; count++) {
+        addr_len = sizeof(peer);
+        if (recvfrom(udp_fd, buf, sizeof(buf), 0,
+                     reinterpret_cast<struct sockaddr*>(&peer),
+                     &addr_len) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvfrom");
+            }
+            return 0;
+        }
+        uint64_t key = ((uint64_t)ntohl(peer.sin_addr.s_addr) << 16) |
+                       ntohs(peer.sin_port);
+        if (!datagram_peers.insert(key).second) {
+            // Sent before its connection took over
+            continue;
+        }
+
+        addr_len = sizeof(local);
+        if (getsockname(udp_fd, reinterpret_cast<struct sockaddr*>(&local),
+                        &addr_len) < 0) {
+            perror("getsockname");
+            exit(-1);
+        }
+        sock = bind_datagram(&local);
+        if (connect(sock, reinterpret_cast<struct sockaddr*>(&peer),
+                    sizeof(peer)) < 0) {
+            perror("connect");
+            close(sock);
+            datagram_peers.erase(key);
+            continue;
+        }
+        assign_client(sock, key);
+    }
+    return 1;
+}
+
+/* A UDP auxiliary connection closed; its peer may open another */
+void Server::close_datagram(uint64_t key) {
+    datagram_peers.erase(key);
+}
+
+/*
+ * Give a new connection a reactor, round-robin, and let it start its
+ * handshake if there is room; otherwise it waits its turn in the admission
+ * queue, unread.
+ */
+void Server::assign_client(int clientfd, uint64_t datagram_peer) {
+    Reactor* reactor = reactors[next_reactor++ % reactors.size()];
+    Client* c = new Client(clientfd, reactor);
+
+    c->datagram_peer = datagram_peer;
+    if (max_handshakes && handshakes_inflight >= max_handshakes) {
+        admission_queue.push_back(c);
+    } else {
+        admit_client(c);
+    }
+}
+
+void Server::admit_client(Client* c) {
+    handshakes_inflight++;
+    c->handshake_timer =
+        schedule_event(HANDSHAKE_TIMEOUT_MS, handshake_timeout_event, c);
+
+    if (c->reactor == reactors[0]) {
+        c->reactor->add_client(c);
+    } else {
+        c->reactor->post(add_client_event, c);
+    }
+}
+
+void add_client_event(void* arg) {
+    current_reactor->add_client((Client*)arg);
+}
+
+/*
+ * The client finished its handshake, went away, or took too long: give its
+ * admission slot to the next switch in line. Once the last admitted switch
+ * is done, run the recompute that was held back for them.
+ */
+void Server::end_handshake(Client* c) {
+    if (c->handshake_done) {
+        return;
+    }
+    c->handshake_done = 1;
+    cancel_event(c->handshake_timer);
+    handshakes_inflight--;
+
+    while (!admission_queue.empty() &&
+           (!max_handshakes || handshakes_inflight < max_handshakes)) {
+        Client* next = admission_queue.front();
+        admission_queue.pop_front();
+        admit_client(next);
+    }
+
+    if (handshakes_inflight == 0 && recompute_timer) {
+        cancel_event(recompute_timer);
+        recompute_timer = 0;
+        god_function(this);
+    }
+}
+
+void Server::handshake_timeout_event(void* arg) {
+    Client* c = (Client*)arg;
+    ((Server*)c->server)->end_handshake(c);
+}
+
+/* Return 1 if a topology recompute should wait for handshakes to finish */
+uint8_t Server::defer_recompute() {
+    if (!max_handshakes || handshakes_inflight == 0 || recompute_forced) {
+        return 0;
+    }
+    if (!recompute_timer) {
+        // Never hold the fabric's routes back for longer than this
+        recompute_timer =
+            schedule_event(MAX_RECOMPUTE_DEFER_MS, recompute_event, this);
+    }
+    return 1;
+}
+
+void Server::recompute_event(void* arg) {
+    Server* server = (Server*)arg;
+
+    server->recompute_timer = 0;
+    server->recompute_forced = 1;
+    god_function(server);
+    server->recompute_forced = 0;
+}
+
+/* Must be called from the owner thread */
+timer_id_t Server::schedule_event(uint64_t when_ms, event_handler_t handler,
+                                  void* arg) {
+    return time_events.schedule(current_time_ms() + when_ms, handler, arg);
+}
+
+/* Must be called from the owner thread. Returns 1 if the event was pending. */
+uint8_t Server::cancel_event(timer_id_t id) {
+    return time_events.cancel(id);
+}
+
+/* Run handler(arg) on the owner thread: now if we are on it, otherwise soon */
+void Server::run_on_owner(event_handler_t handler, void* arg) {
+    if (is_owner()) {
+        handler(arg);
+    } else {
+        reactors[0]->post(handler, arg);
+    }
+}
+
+uint8_t Server::is_owner() const {
+    return current_reactor != nullptr && current_reactor == reactors[0];
+}
+
+Reactor::Reactor(Server* s) {
+    struct epoll_event ev;
 
+    server = s;
     if ((ep = epoll_create1(0)) < 0) {
         perror("epoll_create1");
         exit(-1);
     }
+    if ((wakefd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        exit(-1);
+    }
 
     /* Silence valgrind */
     memset(&ev.data, 0, sizeof(ev.data));
 
     ev.events = EPOLLIN;
-    ev.data.fd = fd;
-    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    ev.data.fd = wakefd;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+        perror("epoll_ctl: eventfd");
+        exit(-1);
+    }
+
+    ring = nullptr;
+    if (s->use_uring) {
+        int err;
+        ring = new Uring();
+        if ((err = ring->setup(URING_ENTRIES, URING_BUFFERS,
+                               URING_BUFFER_SIZE)) < 0) {
+            fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+                    strerror(-err));
+            delete ring;
+            ring = nullptr;
+        } else {
+            ring->prep_poll(wakefd, URING_WAKE);
+        }
+    }
+}
+
+Reactor* Reactor::current() {
+    return current_reactor;
+}
+
+/* Level-triggered watch (or multishot accept) for a listening socket */
+void Reactor::watch(int sock) {
+    struct epoll_event ev;
+
+    if (ring != nullptr) {
+        ring->prep_accept(sock, URING_ACCEPT);
+        return;
+    }
+
+    memset(&ev.data, 0, sizeof(ev.data));
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) < 0) {
         perror("epoll_ctl: listen");
         exit(-1);
     }
+}
+
+/* Level-triggered watch for the shared UDP socket */
+void Reactor::watch_datagrams(int sock) {
+    struct epoll_event ev;
+
+    if (ring != nullptr) {
+        ring->prep_poll(sock, URING_DATAGRAM);
+        return;
+    }
+
+    memset(&ev.data, 0, sizeof(ev.data));
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        perror("epoll_ctl: udp");
+        exit(-1);
+    }
+}
+
+void Reactor::run() {
+    current_reactor = this;
+    if (ring != nullptr) {
+        run_uring();
+    } else {
+        run_epoll();
+    }
+}
+
+void Reactor::run_epoll() {
+#define MAX_EVENTS 10
+    struct epoll_event events[MAX_EVENTS];
+    int nfds, timeout;
+    uint8_t owner = (this == server->reactors[0]);
 
     for (;;) {
-        // Time until next time-based event fires
-        timeout = -1;
-        if (!time_events.empty()) {
-            uint64_t now = current_time_ms();
-            Event next_event = time_events.top();
-            if (now < next_event.when) {
-                timeout = static_cast<int>(next_event.when - now);
-            } else {
-                timeout = 0;
-            }
-        }
+        timeout = owner ? server->next_timeout() : -1;
 
         if ((nfds = epoll_wait(ep, events, MAX_EVENTS, timeout)) < 0) {
             perror("epoll_wait");
             exit(-1);
         }
-        handle_time_events();
+        if (owner) {
+            server->handle_time_events();
+        }
         int ndx;
         for (ndx = 0; ndx < nfds; ndx++) {
-            if (events[ndx].data.fd == fd) {
-                if ((clientfd = accept(fd, nullptr, nullptr)) < 0) {
-                    perror("accept");
-                }
-                nonblock(clientfd);
-                ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-                ev.data.fd = clientfd;
-
-                if (epoll_ctl(ep, EPOLL_CTL_ADD, clientfd, &ev) < 0) {
-                    perror("epoll_ctl: accept");
-                    exit(-1);
-                }
-
-                Client* c = new Client(clientfd, this);
-                clients.insert(std::pair<int, Client*>(clientfd, c));
-                c->init();
+            int evfd = events[ndx].data.fd;
+            if (owner && evfd == server->fd) {
+                server->accept_client();
+            } else if (owner && evfd == server->udp_fd) {
+                server->accept_datagram();
+            } else if (evfd == wakefd) {
+                handle_mailbox();
             } else {
-                Client* c = clients.find(events[ndx].data.fd)->second;
+                Client* c = clients.find(evfd)->second;
                 if (events[ndx].events & EPOLLIN) {
                     c->handle_read_event();
                 }
                 if (events[ndx].events & EPOLLOUT) {
                     c->canwrite = 1;
+                    c->schedule_flush();
                 }
-                c->flush_write_queue();
             }
         }
+        flush_clients();
     }
 }
 
-Event::Event(event_handler_t h, void* a, uint64_t w) {
-    handler = h;
-    arg = a;
-    when = w;
+/*
+ * Same loop on io_uring: completions replace readiness events, and all the
+ * sends queued while handling one batch go to the kernel in one submission.
+ */
+void Reactor::run_uring() {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+    uint8_t owner = (this == server->reactors[0]);
+
+    for (;;) {
+        ring->wait(owner ? server->next_timeout() : -1);
+        if (owner) {
+            server->handle_time_events();
+        }
+        while (ring->next_completion(&user_data, &res, &flags)) {
+            handle_completion(user_data, res, flags);
+        }
+        flush_clients();
+    }
 }
 
-void Server::schedule_event(uint64_t when_ms, event_handler_t handler,
-                            void* arg) {
-    time_events.push(Event(handler, arg, current_time_ms() + when_ms));
+/*
+ * Output is corked while a loop iteration handles its events: clients only
+ * queue what they write, and each one's queue goes out here, in one gather
+ * write, once the iteration is done.
+ */
+void Reactor::flush_clients() {
+    std::vector<Client*> flushing;
+
+    // Flushing can make more output (a drained switch gets its routes)
+    while (!dirty.empty()) {
+        flushing.clear();
+        flushing.swap(dirty);
+        std::vector<Client*>::iterator it;
+        for (it = flushing.begin(); it != flushing.end(); it++) {
+            (*it)->flush_pending = 0;
+            (*it)->flush_write_queue();
+        }
+    }
 }
 
-void Server::handle_time_events() {
-    uint64_t now = current_time_ms();
-    while (!time_events.empty()) {
-        Event event = time_events.top();
-        if (event.when > now) {
+void Reactor::handle_completion(uint64_t user_data, int32_t res,
+                                uint32_t flags) {
+    Client* c = (Client*)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (user_data & URING_OP_MASK) {
+        case URING_WAKE:
+            handle_mailbox();
+            if (!(flags & IORING_CQE_F_MORE)) {
+                ring->prep_poll(wakefd, URING_WAKE);
+            }
+            break;
+        case URING_ACCEPT:
+            if (res >= 0) {
+                server->assign_client(res, 0);
+            } else {
+                fprintf(stderr, "accept: %s\n", strerror(-res));
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                ring->prep_accept(server->fd, URING_ACCEPT);
+            }
+            break;
+        case URING_DATAGRAM:
+            // The poll only fires again for new datagrams, so take them all
+            while (server->accept_datagram()) {
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                ring->prep_poll(server->udp_fd, URING_DATAGRAM);
+            }
+            break;
+        case URING_RECV:
+            c->handle_recv(res, flags);
             break;
+        case URING_SEND:
+            c->handle_send(res);
+            break;
+        default:
+            break;
+    }
+}
+
+void Reactor::add_client(Client* c) {
+    struct epoll_event ev;
+    int clientfd = c->fd;
+
+    if (ring != nullptr) {
+        ring->prep_recv(clientfd, (uint64_t)(uintptr_t)c | URING_RECV);
+    } else {
+        memset(&ev.data, 0, sizeof(ev.data));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.fd = clientfd;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, clientfd, &ev) < 0) {
+            perror("epoll_ctl: accept");
+            exit(-1);
         }
-        time_events.pop();
+    }
 
-        event_handler_t handler = event.handler;
-        void* arg = event.arg;
+    clients.insert(std::pair<int, Client*>(clientfd, c));
+    c->init();
+}
 
-        handler(arg);
+/* Queue handler(arg) to run on this reactor's thread. Safe from any thread. */
+void Reactor::post(event_handler_t handler, void* arg) {
+    uint64_t one = 1;
+    uint8_t was_empty;
+
+    {
+        std::lock_guard<std::mutex> guard(mailbox_lock);
+        was_empty = mailbox.empty();
+        mailbox.push_back(Event(handler, arg, 0));
     }
+    if (was_empty && write(wakefd, &one, sizeof(one)) < 0) {
+        perror("write(eventfd)");
+    }
+}
+
+void Reactor::handle_mailbox() {
+    std::vector<Event> events;
+    uint64_t count;
+
+    if (read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read(eventfd)");
+    }
+    {
+        std::lock_guard<std::mutex> guard(mailbox_lock);
+        events.swap(mailbox);
+    }
+
+    std::vector<Event>::iterator it;
+    for (it = events.begin(); it != events.end(); it++) {
+        it->handler(it->arg);
+    }
+}
+
+void Server::handle_time_events() {
+    time_events.advance(current_time_ms());
 }
 
 void Server::close_server() {
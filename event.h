@@ -3,41 +3,119 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <deque>
 #include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "client.h"
+#include "cluster.h"
 #include "graph.h"
+#include "routes.h"
+#include "timer.h"
+#include "tree.h"
+#include "uring.h"
+#include "workers.h"
 
-typedef void (*event_handler_t)(void* arg);
+class Server;
 
-// Time-based event
-class Event {
-   public:
-    event_handler_t handler;
-    void* arg;
-    uint64_t when;
-    Event(event_handler_t, void*, uint64_t);
-};
+#define DEFAULT_BACKLOG 128
+#define DEFAULT_MAX_HANDSHAKES 64
+#define DEFAULT_HOST_IDLE_TIMEOUT 300  // seconds
+#define DEFAULT_HOST_HARD_TIMEOUT 0
+#define DEFAULT_MAX_HOSTS 65536
 
-class CompareEvents {
+/*
+ * A reactor is one event loop (epoll, or io_uring if the server asked for it
+ * and the kernel supports it) running on its own thread, owning a subset of
+ * the switch connections. Reactor 0 is the owner: it runs on the main thread,
+ * accepts connections, fires timers, and is the only thread allowed to touch
+ * the graph, client_table and per-switch topology state. Other threads hand
+ * work to a reactor with post().
+ */
+class Reactor {
    public:
-    bool operator()(const Event a, const Event b) {
-        return a.when > b.when;
-    }
+    Reactor(Server*);
+    static Reactor* current(void);
+    void run(void);
+    void post(event_handler_t, void*);
+    void watch(int);
+    void watch_datagrams(int);
+    void add_client(Client*);
+    Server* server;
+    std::map<int, Client*> clients;
+    std::vector<Client*> dirty;  // clients with output to flush this iteration
+    Uring* ring;                 // nullptr when running on epoll
+
+   private:
+    void run_epoll(void);
+    void run_uring(void);
+    void handle_completion(uint64_t, int32_t, uint32_t);
+    void handle_mailbox(void);
+    void flush_clients(void);
+    int ep;
+    int wakefd;
+    std::mutex mailbox_lock;
+    std::vector<Event> mailbox;
 };
 
 class Server {
    public:
+    Server();
     void open(uint16_t);
     void listen_and_serve(void);
-    void schedule_event(uint64_t, event_handler_t, void*);
+    Reactor* add_reactor(void);
+    timer_id_t schedule_event(uint64_t, event_handler_t, void*);
+    uint8_t cancel_event(timer_id_t);
+    uint64_t now_ms(void) const;
+    void run_on_owner(event_handler_t, void*);
+    uint8_t is_owner(void) const;
+    void end_handshake(Client*);
+    void close_datagram(uint64_t);
+    uint8_t defer_recompute(void);
     void close_server();
     Graph graph;  // network graph
+    RouteTable routes;  // shortest paths to the switches with hosts
+    BroadcastTree bcast_tree;  // the spanning tree broadcasts go down
+    WorkerPool route_workers;  // computes the route table off the owner
     int fd;
-    std::map<int, Client*> clients;
+    int udp_fd;  // where UDP auxiliary connections start
+    unsigned num_threads;  // number of I/O reactors, including the owner
+    unsigned num_route_workers;  // route table threads, 0 = one per CPU
+    uint8_t use_uring;     // prefer io_uring over epoll for reactor I/O
+    int backlog;           // listen(2) backlog
+    unsigned max_handshakes;  // concurrent switch handshakes, 0 = unlimited
+    uint16_t host_idle_timeout;  // seconds a MAC rule may go unused, 0 = never
+    uint16_t host_hard_timeout;  // seconds a MAC rule may live, 0 = forever
+    size_t max_hosts;            // hosts learned at once, across all switches
+    size_t num_hosts;
+    uint64_t converged_ms;      // when every switch last acked its fence
+    uint64_t converge_time_ms;  // from the first fence sent until then
+    // Port costs from the configuration, by switch and port (-l)
+    std::map<std::pair<uint64_t, uint32_t>, uint32_t> link_costs;
+    Cluster* cluster;  // nullptr unless running as one shard of several
 
    private:
-    std::priority_queue<Event, std::vector<Event>, CompareEvents> time_events;
+    friend class Reactor;
+    TimerWheel time_events;
+    std::vector<Reactor*> reactors;
+    std::vector<std::thread> threads;
+    size_t next_reactor;
+    std::deque<Client*> admission_queue;  // accepted, waiting to handshake
+    unsigned handshakes_inflight;
+    std::set<uint64_t> datagram_peers;  // UDP peers that have a connection
+    timer_id_t recompute_timer;  // set while a recompute is being held back
+    uint8_t recompute_forced;
+    int next_timeout(void);
     void handle_time_events(void);
+    void accept_client(void);
+    uint8_t accept_datagram(void);
+    void assign_client(int, uint64_t);
+    void admit_client(Client*);
+    static void handshake_timeout_event(void*);
+    static void recompute_event(void*);
 };
 
 #endif /* EVENT_H_ */
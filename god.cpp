@@ -1,78 +1,633 @@
 #include "god.h"
+#include <atomic>
 #include <cstdio>
 #include <set>
+#include <vector>
 #include "client.h"
 #include "event.h"
 #include "graph.h"
 #include "openflow.h"
+#include "routes.h"
 
 void god_mst(Server* server);
-void update_host_sp(uint64_t, uint32_t, void*);
+static void update_flood(Client*, const std::set<uint32_t>&);
+void update_host_sp(uint64_t, const std::vector<uint32_t>&, uint64_t);
+static uint64_t ecmp_hop(Client*, const std::vector<uint32_t>&);
+static void hold_hop(Client*, uint64_t);
+static void release_hop(Client*, uint64_t);
+static void mac_rule_addr(uint64_t, uint8_t*);
+static const std::map<uint64_t, uint32_t>* hosts_at(Server*, uint64_t);
+static uint8_t host_switch(Server*, uint64_t, uint64_t*);
 void add_non_switch_ports(Client*, Graph*, std::set<uint32_t>*);
+static void route_host(Server*, const Graph&, uint32_t, uint64_t);
+static void sync_switch(Server*, const Graph&, uint64_t);
+static void route_task(void*);
+static void routes_computed(void*);
+static void batch_add(Client*);
+static void fence_batch(void);
+
+/*
+ * Every recompute's flow and group changes to a switch form one batch, fenced
+ * with a barrier. The fabric has converged once every switch has acked its
+ * latest fence.
+ */
+static std::vector<Client*> batch;
+static uint32_t fence_epoch = 0;
+static unsigned fences_outstanding = 0;  // switches yet to ack their fence
+static uint64_t converge_start;  // when the first of them was sent
+
+/*
+ * Route changes that are not link changes: hosts learned, and switches that
+ * need every route checked because they missed some.
+ */
+static std::set<std::pair<uint64_t, uint64_t> > learned;  // switch, mac
+static std::set<uint64_t> unsynced;
+
+// Switches whose broadcast groups need checking that the tree did not move
+static std::set<uint64_t> unflooded;
+
+// A route table update out on the worker pool
+typedef struct {
+    Server* server;
+    Graph snapshot;                  // the graph as of when it started
+    std::vector<uint32_t> touched;   // switches whose links changed
+    std::set<uint32_t> fresh;        // destinations computed from scratch
+    unsigned parts;                  // 0 if nothing needed computing
+    std::vector<std::vector<route_change_t> > changes;  // one list per part
+    std::atomic<unsigned> remaining;  // parts still running
+} route_job_t;
+
+typedef struct {
+    route_job_t* job;
+    unsigned part;
+} route_task_t;
+
+static route_job_t* routing = nullptr;  // in flight, if any
+static uint8_t reroute = 0;             // go again once it is back
+
+static void finish_routes(route_job_t*);
 
 // This runs on every dynamic link event
 void god_function(Server* server) {
+    if (server->defer_recompute()) {
+        // Switches are still handshaking; recompute once they are done
+        return;
+    }
     god_mst(server);
     god_dijkstra(server);
 }
 
+/*
+ * Bring the broadcast groups up to date. The tree is repaired around the
+ * links changed since the last time, and only the switches whose tree ports
+ * or links changed, or whose ports came or went, are looked at again.
+ */
 void god_mst(Server* server) {
     Graph* graph = &server->graph;
+    std::vector<uint32_t> changed;
+    std::vector<uint32_t>::const_iterator vit;
 
-    static MST* old_mst = nullptr;
-    MST* mst = graph->make_mst();
-    MST::iterator vit;
-    for (vit = mst->begin(); vit != mst->end(); vit++) {
-        std::set<uint32_t>::const_iterator pit;
-        if (old_mst == nullptr || (*old_mst)[vit->first] != vit->second) {
-            Client* client = client_table[vit->first];
-            add_non_switch_ports(client, graph, &vit->second);
-            if (!client->has_mst) {
-                if (vit->second.size() > 0) {
-                    client->has_mst = 1;
-                    update_broadcast_group(client, &vit->second, OFPGC_ADD);
-                    add_broadcast_rule(client);
-                }
-            } else {
-                update_broadcast_group(client, &vit->second, OFPGC_MODIFY);
-            }
+    server->bcast_tree.update(graph, &changed);
+    for (vit = changed.begin(); vit != changed.end(); vit++) {
+        unflooded.insert(graph->dpid(*vit));
+    }
+
+    std::set<uint64_t>::const_iterator uit;
+    for (uit = unflooded.begin(); uit != unflooded.end(); uit++) {
+        std::map<uint64_t, Client*>::iterator cit = client_table.find(*uit);
+        if (cit == client_table.end() || cit->second->reconciling) {
+            // Gone, or another shard's to program; one still reconciling
+            // is looked at once it is done
+            continue;
         }
+        Client* client = cit->second;
+        std::set<uint32_t> flood =
+            server->bcast_tree.ports(graph->vertex(*uit));
+        add_non_switch_ports(client, graph, &flood);
+        update_flood(client, flood);
     }
-    if (old_mst != nullptr) {
-        delete old_mst;
+    unflooded.clear();
+}
+
+/*
+ * Give a switch's broadcast groups the ports it floods to. They go by port
+ * number in chunks of BCAST_CHUNK_PORTS: the broadcast group has the first
+ * and chains to a group for each other one that has any. Only the chunks
+ * that changed are rewritten, and no group mod outgrows its length.
+ */
+void update_flood(Client* client, const std::set<uint32_t>& flood) {
+    std::map<uint32_t, std::set<uint32_t> > chunks;
+    std::map<uint32_t, std::set<uint32_t> >::iterator it, had;
+    std::set<uint32_t> chained;
+    std::set<uint32_t>::const_iterator pit;
+
+    for (pit = flood.begin(); pit != flood.end(); pit++) {
+        chunks[*pit / BCAST_CHUNK_PORTS].insert(*pit);
+    }
+    const std::set<uint32_t>& own = chunks[0];
+
+    // The groups chained to first, so the broadcast group never points at
+    // one the switch does not have
+    for (it = chunks.begin(); it != chunks.end(); it++) {
+        if (it->first == 0) {
+            continue;
+        }
+        chained.insert(it->first);
+        had = client->bcast_chunks.find(it->first);
+        if (had == client->bcast_chunks.end() || had->second != it->second) {
+            batch_add(client);
+            update_broadcast_group(
+                client, it->first, &it->second, nullptr,
+                had == client->bcast_chunks.end() ? OFPGC_ADD : OFPGC_MODIFY);
+            client->bcast_chunks[it->first] = it->second;
+        }
+    }
+
+    // Compare against what the switch has, which it may have kept from
+    // before it reconnected
+    if (!client->has_mst) {
+        if (!flood.empty()) {
+            client->has_mst = 1;
+            batch_add(client);
+            update_broadcast_group(client, 0, &own, &chained, OFPGC_ADD);
+            client->bcast_chunks[0] = own;
+            client->bcast_chained = chained;
+        }
+    } else if (client->bcast_chunks[0] != own ||
+               client->bcast_chained != chained) {
+        batch_add(client);
+        update_broadcast_group(client, 0, &own, &chained, OFPGC_MODIFY);
+        client->bcast_chunks[0] = own;
+        client->bcast_chained = chained;
+    }
+
+    // Then the ones it no longer chains to
+    for (it = client->bcast_chunks.begin(); it != client->bcast_chunks.end();) {
+        if (it->first != 0 && !chained.count(it->first)) {
+            batch_add(client);
+            update_broadcast_group(client, it->first, &it->second, nullptr,
+                                   OFPGC_DELETE);
+            client->bcast_chunks.erase(it++);
+        } else {
+            it++;
+        }
+    }
+
+    if (client->has_mst && !client->has_bcast_rule) {
+        batch_add(client);
+        add_broadcast_rule(client);
+        client->has_bcast_rule = 1;
     }
-    old_mst = mst;
 }
 
-void update_host_sp(uint64_t vertex, uint32_t port, void* ptr) {
-    uint64_t mac = *(uint64_t*)ptr;
-    uint8_t addr[6];
+// A switch's ports changed, or it needs its broadcast groups checked
+void god_reflood(uint64_t uid) {
+    unflooded.insert(uid);
+}
+
+/* The bytes a MAC rule matches on for host mac */
+void mac_rule_addr(uint64_t mac, uint8_t* addr) {
     addr[0] = mac & 0xff;
     addr[1] = (mac >> 8) & 0xff;
     addr[2] = (mac >> 16) & 0xff;
     addr[3] = (mac >> 24) & 0xff;
     addr[4] = (mac >> 32) & 0xff;
     addr[5] = (mac >> 40) & 0xff;
+}
 
-    Client* client = client_table[vertex];
-    if (client->written.find(mac) == client->written.end()) {
-        add_dest_mac_rule(client, addr, port, FM_CMD_ADD, 1);
-    } else if (client->written[mac] != port) {
-        add_dest_mac_rule(client, addr, port, FM_CMD_MODIFY, 1);
+/*
+ * Point a switch's rule for host mac at ports: the one port, or the ECMP
+ * group over all of them
+ */
+void update_host_sp(uint64_t vertex, const std::vector<uint32_t>& ports,
+                    uint64_t mac) {
+    uint8_t addr[6];
+    uint64_t hop;
+    mac_rule_addr(mac, addr);
+
+    std::map<uint64_t, Client*>::iterator cit = client_table.find(vertex);
+    if (cit == client_table.end()) {
+        return;
+    }
+    Client* client = cit->second;
+    if (client->reconciling) {
+        return;
+    }
+    if (client->congested) {
+        // Sent once its queue drains, merged with whatever changes by then
+        client->routes_deferred = 1;
+        return;
+    }
+    hop = ports.size() == 1 ? ports[0] : ecmp_hop(client, ports);
+    std::map<uint64_t, uint64_t>::iterator it = client->written.find(mac);
+    if (it != client->written.end() && it->second == hop) {
+        return;
+    }
+    batch_add(client);
+    uint8_t cmd = it == client->written.end() ? FM_CMD_ADD : FM_CMD_MODIFY;
+    if (hop & ECMP_HOP) {
+        add_dest_mac_group_rule(client, addr, (uint32_t)hop, cmd);
+    } else if (client->hosts.count(mac)) {
+        // A modify would keep the rule's old timeouts, if any
+        add_attached_host_rule(client, addr, (uint32_t)hop, FM_CMD_ADD);
+    } else {
+        add_dest_mac_rule(client, addr, (uint32_t)hop, cmd, 1);
+    }
+    hold_hop(client, hop);
+    if (it != client->written.end()) {
+        release_hop(client, it->second);
     }
+    client->written[mac] = hop;
 }
 
+/* The switch's group over ports, added if it has none yet, as a next hop */
+uint64_t ecmp_hop(Client* client, const std::vector<uint32_t>& ports) {
+    std::map<std::vector<uint32_t>, uint32_t>::iterator it =
+        client->ecmp_groups.find(ports);
+    uint32_t group_id;
+
+    if (it != client->ecmp_groups.end()) {
+        return ECMP_HOP | it->second;
+    }
+    batch_add(client);
+    group_id = add_ecmp_group(client, &ports);
+    client->ecmp_groups[ports] = group_id;
+    client->ecmp_refs[group_id] = 0;
+    return ECMP_HOP | group_id;
+}
+
+void hold_hop(Client* client, uint64_t hop) {
+    if (hop & ECMP_HOP) {
+        client->ecmp_refs[(uint32_t)hop]++;
+    }
+}
+
+// A group no rule uses any more is deleted once the switch has acked that
+void release_hop(Client* client, uint64_t hop) {
+    if (hop & ECMP_HOP) {
+        client->ecmp_refs[(uint32_t)hop]--;
+    }
+}
+
+/* Once a fence is acked, no rule the switch has points at an unused group */
+void drop_unused_groups(Client* client) {
+    std::map<std::vector<uint32_t>, uint32_t>::iterator it;
+
+    for (it = client->ecmp_groups.begin(); it != client->ecmp_groups.end();) {
+        if (client->ecmp_refs[it->second] == 0) {
+            delete_group(client, it->second);
+            client->ecmp_refs.erase(it->second);
+            client->ecmp_groups.erase(it++);
+        } else {
+            it++;
+        }
+    }
+}
+
+// The switch took its rule for mac out, or we did
+void forget_written(Client* client, uint64_t mac) {
+    std::map<uint64_t, uint64_t>::iterator it = client->written.find(mac);
+
+    if (it != client->written.end()) {
+        release_hop(client, it->second);
+        client->written.erase(it);
+    }
+}
+
+/*
+ * Take an aged-out host's rules off every switch that still has one, fenced
+ * like any other batch. A host that has moved to another switch meanwhile
+ * is not gone: its rules are routed to where it is now instead.
+ */
+void god_forget_host(Server* server, uint64_t mac) {
+    uint8_t addr[6];
+    uint64_t uid;
+    mac_rule_addr(mac, addr);
+
+    if (host_switch(server, mac, &uid)) {
+        god_learn_host(uid, mac);
+        return;
+    }
+    std::map<uint64_t, Client*>::iterator cit;
+    for (cit = client_table.begin(); cit != client_table.end(); cit++) {
+        Client* client = cit->second;
+        if (client->written.count(mac)) {
+            batch_add(client);
+            forget_written(client, mac);
+            add_dest_mac_rule(client, addr, 0, FM_CMD_DELETE_STRICT, 1);
+        }
+    }
+    fence_batch();
+}
+
+/* The switch a host is attached to, whichever shard it is connected to */
+uint8_t host_switch(Server* server, uint64_t mac, uint64_t* uid) {
+    std::map<uint64_t, Client*>::iterator cit;
+    for (cit = client_table.begin(); cit != client_table.end(); cit++) {
+        if (cit->second->hosts.count(mac)) {
+            *uid = cit->first;
+            return 1;
+        }
+    }
+    if (server->cluster != nullptr) {
+        std::map<uint64_t, std::map<uint64_t, uint32_t> >::iterator at;
+        for (at = server->cluster->hosts.begin();
+             at != server->cluster->hosts.end(); at++) {
+            if (at->second.count(mac)) {
+                *uid = at->first;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* The hosts attached to a switch, whichever shard it is connected to */
+const std::map<uint64_t, uint32_t>* hosts_at(Server* server, uint64_t uid) {
+    std::map<uint64_t, Client*>::iterator cit = client_table.find(uid);
+    if (cit != client_table.end()) {
+        return &cit->second->hosts;
+    }
+    if (server->cluster != nullptr) {
+        std::map<uint64_t, std::map<uint64_t, uint32_t> >::iterator at =
+            server->cluster->hosts.find(uid);
+        if (at != server->cluster->hosts.end()) {
+            return &at->second;
+        }
+    }
+    return nullptr;
+}
+
+// Route to mac, attached to switch uid, on the next recompute
+void god_learn_host(uint64_t uid, uint64_t mac) {
+    learned.insert(std::make_pair(uid, mac));
+}
+
+// Check every route on switch uid on the next recompute
+void god_resync(uint64_t uid) {
+    unsynced.insert(uid);
+}
+
+/*
+ * Bring the host rules up to date. The route table repairs its trees around
+ * the links changed since the last time, and only the next hops that moved
+ * are written, for every host behind the switch they lead to.
+ *
+ * The table is computed on the worker pool, over a copy of the graph, with
+ * the destinations split between the workers; the owner goes on with switch
+ * I/O, and writes the rules once every part is back. Anything that comes up
+ * meanwhile waits for the next round.
+ */
 void god_dijkstra(Server* server) {
     Graph* graph = &server->graph;
+    RouteTable* routes = &server->routes;
+    route_job_t* job;
+    unsigned part;
+
+    if (routing != nullptr) {
+        reroute = 1;
+        return;
+    }
+
+    job = new route_job_t;
+    job->server = server;
+    job->parts = 0;
+    job->touched.swap(graph->touched);
+    routes->begin_update(*graph, &job->touched);
+    std::set<std::pair<uint64_t, uint64_t> >::iterator lit;
+    for (lit = learned.begin(); lit != learned.end(); lit++) {
+        uint32_t dest = graph->vertex(lit->first);
+        if (dest != NO_VERTEX && !routes->tracking(dest)) {
+            // Its first host; every switch's next hop is a change
+            routes->track(dest);
+            job->fresh.insert(dest);
+        }
+    }
+    if (job->touched.empty() && job->fresh.empty()) {
+        // Only hosts to add to paths already known
+        finish_routes(job);
+        return;
+    }
+
+    routing = job;
+    job->snapshot = *graph;
+    job->parts = server->route_workers.size;
+    job->changes.resize(job->parts);
+    job->remaining = job->parts;
+    for (part = 0; part < job->parts; part++) {
+        route_task_t* task = new route_task_t;
+        task->job = job;
+        task->part = part;
+        server->route_workers.run(route_task, task);
+    }
+}
+
+/* On a worker: compute one part of the table, and hand the last one back */
+void route_task(void* arg) {
+    route_task_t* task = (route_task_t*)arg;
+    route_job_t* job = task->job;
+
+    job->server->routes.update_part(job->snapshot, job->touched, task->part,
+                                    job->parts, &job->changes[task->part]);
+    delete task;
+    if (--job->remaining == 0) {
+        job->server->run_on_owner(routes_computed, job);
+    }
+}
+
+void routes_computed(void* arg) {
+    route_job_t* job = (route_job_t*)arg;
+    Server* server = job->server;
+
+    routing = nullptr;
+    finish_routes(job);
+    if (reroute) {
+        reroute = 0;
+        god_dijkstra(server);
+    }
+}
+
+/*
+ * On the owner: write what changed, then what the table was not needed for.
+ * Next hops are read against the graph they were computed over.
+ */
+void finish_routes(route_job_t* job) {
+    Server* server = job->server;
+    Graph* graph = &server->graph;
+    const Graph* basis = job->parts ? &job->snapshot : graph;
+    RouteTable* routes = &server->routes;
+    std::set<uint32_t> idle;
+    std::vector<uint32_t> ports;
+
+    std::vector<std::vector<route_change_t> >::iterator pit;
+    std::vector<route_change_t>::iterator cit;
+    for (pit = job->changes.begin(); pit != job->changes.end(); pit++) {
+        for (cit = pit->begin(); cit != pit->end(); cit++) {
+            const std::map<uint64_t, uint32_t>* hosts =
+                hosts_at(server, graph->dpid(cit->dest));
+            if (hosts == nullptr || hosts->empty()) {
+                idle.insert(cit->dest);
+                continue;
+            }
+            if (cit->port == NO_ROUTE) {
+                // Cut off; its rules stay until a path comes back
+                continue;
+            }
+            RouteTable::hop_ports(*basis, cit->vertex, cit->port, cit->ways,
+                                  &ports);
+            std::map<uint64_t, uint32_t>::const_iterator hit;
+            for (hit = hosts->begin(); hit != hosts->end(); hit++) {
+                update_host_sp(graph->dpid(cit->vertex), ports, hit->first);
+            }
+        }
+    }
+
+    std::set<std::pair<uint64_t, uint64_t> >::iterator lit;
+    for (lit = learned.begin(); lit != learned.end();) {
+        uint32_t dest = graph->vertex(lit->first);
+        if (dest != NO_VERTEX && !routes->tracking(dest)) {
+            // Its switch's first host, learned while computing
+            reroute = 1;
+            lit++;
+            continue;
+        }
+        if (dest != NO_VERTEX && !job->fresh.count(dest)) {
+            routes->mark(dest);
+            route_host(server, *basis, dest, lit->second);
+        }
+        const std::map<uint64_t, uint32_t>* hosts = hosts_at(server,
+                                                             lit->first);
+        std::map<uint64_t, uint32_t>::const_iterator hit;
+        if (hosts != nullptr &&
+            (hit = hosts->find(lit->second)) != hosts->end()) {
+            update_host_sp(lit->first, std::vector<uint32_t>(1, hit->second),
+                           lit->second);
+        }
+        learned.erase(lit++);
+    }
+
+    std::set<uint32_t>::iterator iit;
+    for (iit = idle.begin(); iit != idle.end(); iit++) {
+        // No hosts left there to route to
+        routes->untrack(*iit);
+    }
+
+    std::set<uint64_t>::iterator uit;
+    for (uit = unsynced.begin(); uit != unsynced.end(); uit++) {
+        sync_switch(server, *basis, *uit);
+    }
+    unsynced.clear();
+
+    // Switches that were not skipped have everything up to now
+    std::map<uint64_t, Client*>::iterator clit;
+    for (clit = client_table.begin(); clit != client_table.end(); clit++) {
+        Client* client = clit->second;
+        if (!client->reconciling && !client->routes_deferred) {
+            client->routes_epoch = routes->epoch;
+        }
+    }
+
+    fence_batch();
+    delete job;
+}
+
+// Every switch's next hops toward a newly learned host: one row of the table
+void route_host(Server* server, const Graph& basis, uint32_t dest,
+                uint64_t mac) {
+    Graph* graph = &server->graph;
+    std::vector<uint32_t> ports;
+    uint32_t vertex;
+
+    for (vertex = 0; vertex < graph->num_vertices(); vertex++) {
+        server->routes.next_hops(basis, vertex, dest, &ports);
+        if (!ports.empty()) {
+            update_host_sp(graph->dpid(vertex), ports, mac);
+        }
+    }
+}
+
+/*
+ * The host routes on one switch that changed since it last had them all: a
+ * new switch has none, and a congested one missed some
+ */
+void sync_switch(Server* server, const Graph& basis, uint64_t uid) {
+    Graph* graph = &server->graph;
+    uint32_t vertex = graph->vertex(uid);
+    std::map<uint64_t, Client*>::iterator cit = client_table.find(uid);
+    std::vector<uint32_t> dests, ports;
+
+    if (vertex == NO_VERTEX || cit == client_table.end()) {
+        return;
+    }
+    uint64_t since = cit->second->routes_epoch;
+    server->routes.destinations(&dests);
+    std::vector<uint32_t>::iterator dit;
+    for (dit = dests.begin(); dit != dests.end(); dit++) {
+        const std::map<uint64_t, uint32_t>* hosts =
+            hosts_at(server, graph->dpid(*dit));
+        server->routes.next_hops(basis, vertex, *dit, &ports);
+        if (hosts == nullptr || (*dit != vertex && ports.empty()) ||
+            !server->routes.changed_since(vertex, *dit, since)) {
+            continue;
+        }
+        std::map<uint64_t, uint32_t>::const_iterator hit;
+        for (hit = hosts->begin(); hit != hosts->end(); hit++) {
+            // At the host's own switch, the port it is on
+            if (*dit == vertex) {
+                ports.assign(1, hit->second);
+            }
+            update_host_sp(uid, ports, hit->first);
+        }
+    }
+}
+
+void batch_add(Client* client) {
+    if (!client->in_batch) {
+        client->in_batch = 1;
+        batch.push_back(client);
+    }
+}
 
-    std::map<uint64_t, edges_t>::iterator vit;
-    for (vit = graph->vertices.begin(); vit != graph->vertices.end(); vit++) {
-        Client* client = client_table[vit->first];
-        std::map<uint64_t, uint32_t>::iterator hit;
-        for (hit = client->hosts.begin(); hit != client->hosts.end(); hit++) {
-            graph->walk_shortest_path(vit->first, hit->second,
-                                      (void*)&hit->first, 0, update_host_sp);
+/* Close this recompute's batches with one barrier per switch */
+void fence_batch() {
+    std::vector<Client*>::iterator it;
+
+    if (batch.empty()) {
+        return;
+    }
+    if (++fence_epoch == 0) {
+        fence_epoch = 1;
+    }
+    if (fences_outstanding == 0) {
+        converge_start = ((Server*)batch[0]->server)->now_ms();
+    }
+    for (it = batch.begin(); it != batch.end(); it++) {
+        Client* client = *it;
+        client->in_batch = 0;
+        // A newer fence supersedes any still outstanding on this switch
+        if (!client->fence_xid) {
+            fences_outstanding++;
         }
+        client->fence_xid = fence_epoch;
+        send_barrier(client, fence_epoch);
+    }
+    batch.clear();
+}
+
+/*
+ * A switch acked a fence (or went away while we waited on one). Once the
+ * last is in, the fabric has converged.
+ */
+void fence_acked(Client* client, uint32_t xid) {
+    Server* server = (Server*)client->server;
+
+    if (!client->fence_xid || client->fence_xid != xid) {
+        return;
+    }
+    client->fence_xid = 0;
+    if (--fences_outstanding == 0) {
+        server->converged_ms = server->now_ms();
+        server->converge_time_ms = server->converged_ms - converge_start;
     }
 }
 
@@ -8,5 +8,12 @@
 
 void god_function(Server*);
 void god_dijkstra(Server*);
+void god_learn_host(uint64_t, uint64_t);
+void god_resync(uint64_t);
+void god_reflood(uint64_t);
+void god_forget_host(Server*, uint64_t);
+void fence_acked(Client*, uint32_t);
+void forget_written(Client*, uint64_t);
+void drop_unused_groups(Client*);
 
 #endif /* GOD_H_ */
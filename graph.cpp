@@ -1,131 +1,256 @@
 #include "graph.h"
 #include <stdint.h>
 #include <map>
-#include <queue>
 #include <set>
+#include <vector>
 
-typedef std::pair<uint32_t, std::pair<uint64_t, uint32_t> > edge_t;
-typedef std::map<uint64_t, edges_t> vertices_t;
+#define IGNORE_EDGE 0xffffffff
+
+// Collects the ports each switch reaches new switches through
+typedef struct MstCollector {
+    MST* mst;
+    void operator()(uint64_t vertex, uint32_t port) {
+        if (port == IGNORE_EDGE) {
+            // The "start port" for an MST is meaningless to us
+            return;
+        }
+        (*mst)[vertex].insert(port);
+    }
+} MstCollector;
+
+static std::vector<edge_t>::iterator find_port(std::vector<edge_t>*,
+                                               uint32_t);
+
+Graph::Graph() {
+    stale = 1;
+}
+
+uint32_t Graph::intern(uint64_t id) {
+    std::map<uint64_t, uint32_t>::iterator it = ids.find(id);
+    if (it != ids.end()) {
+        return it->second;
+    }
+
+    uint32_t vertex = (uint32_t)dpids.size();
+    ids[id] = vertex;
+    dpids.push_back(id);
+    adjacency.push_back(std::vector<edge_t>());
+    stale = 1;
+    return vertex;
+}
 
-static void add_mst_edge(uint64_t, uint32_t, void*);
+void Graph::touch(uint32_t vertex) {
+    touched.push_back(vertex);
+    tree_touched.push_back(vertex);
+}
 
-void Graph::add_single_edge(uint64_t from, uint32_t fport, uint64_t to,
-                            uint32_t tport) {
-    edges_t* from_e = &vertices[from];
-    edges_t::iterator from_search = from_e->find(fport);
-    std::pair<uint64_t, uint32_t> topair =
-        std::pair<uint64_t, uint32_t>(to, tport);
+// First edge at or after port, in a vertex's port-sorted edges
+std::vector<edge_t>::iterator find_port(std::vector<edge_t>* edges,
+                                        uint32_t port) {
+    std::vector<edge_t>::iterator it = edges->begin();
+    while (it != edges->end() && it->port < port) {
+        it++;
+    }
+    return it;
+}
 
-    if (from_search != from_e->end()) {
-        std::pair<uint64_t, uint32_t> existing_to = from_search->second;
+void Graph::add_single_edge(uint32_t from, uint32_t fport, uint32_t to,
+                            uint32_t tport, uint32_t cost) {
+    std::vector<edge_t>* from_e = &adjacency[from];
+    std::vector<edge_t>::iterator from_search = find_port(from_e, fport);
+    edge_t edge;
 
-        if (existing_to != topair) {
-            // Remove the existing to-vertex's edge back to from
-            vertices[existing_to.first].erase(existing_to.second);
-            from_e->erase(from_search);
-            from_e->insert(edge_t(fport, topair));
+    if (from_search != from_e->end() && from_search->port == fport) {
+        if (from_search->to == to && from_search->to_port == tport) {
+            if (from_search->cost != cost) {
+                if (--link_costs[from_search->cost] == 0) {
+                    link_costs.erase(from_search->cost);
+                }
+                link_costs[cost]++;
+                from_search->cost = cost;
+                touch(from);
+                stale = 1;
+            }
+            return;
         }
-    } else {
-        from_e->insert(edge_t(fport, topair));
+        // Remove the existing to-vertex's edge back to from, then ours
+        remove_single_edge(from_search->to, from_search->to_port);
+        remove_single_edge(from, fport);
     }
+
+    edge.port = fport;
+    edge.to = to;
+    edge.to_port = tport;
+    edge.cost = cost;
+    link_costs[cost]++;
+    from_e->insert(find_port(from_e, fport), edge);
+    touch(from);
+    stale = 1;
 }
 
-void Graph::remove_edge(uint64_t from, uint32_t fport) {
-    edges_t* from_e = &vertices[from];
-    edges_t::iterator from_search = from_e->find(fport);
+void Graph::remove_single_edge(uint32_t from, uint32_t fport) {
+    std::vector<edge_t>* from_e = &adjacency[from];
+    std::vector<edge_t>::iterator from_search = find_port(from_e, fport);
 
-    if (from_search != from_e->end()) {
-        std::pair<uint64_t, uint32_t> existing_to = from_search->second;
-        vertices[existing_to.first].erase(existing_to.second);
+    if (from_search != from_e->end() && from_search->port == fport) {
+        if (--link_costs[from_search->cost] == 0) {
+            link_costs.erase(from_search->cost);
+        }
         from_e->erase(from_search);
+        touch(from);
+        stale = 1;
+    }
+}
+
+void Graph::remove_edge(uint64_t from, uint32_t fport) {
+    std::map<uint64_t, uint32_t>::const_iterator vsearch = ids.find(from);
+    if (vsearch == ids.end()) {
+        return;
+    }
+    std::vector<edge_t>* from_e = &adjacency[vsearch->second];
+    std::vector<edge_t>::iterator from_search = find_port(from_e, fport);
+
+    if (from_search != from_e->end() && from_search->port == fport) {
+        remove_single_edge(from_search->to, from_search->to_port);
+        remove_single_edge(vsearch->second, fport);
     }
 }
 
 void Graph::add_vertex(uint64_t id) {
-    vertices[id];
+    intern(id);
 }
 
 void Graph::add_edge(uint64_t from, uint32_t fport, uint64_t to,
                      uint32_t tport) {
-    add_single_edge(from, fport, to, tport);
-    add_single_edge(to, tport, from, fport);
+    uint32_t from_v = intern(from), to_v = intern(to);
+    uint32_t cost = port_cost(from, fport), to_cost = port_cost(to, tport);
+
+    if (to_cost > cost) {
+        cost = to_cost;
+    }
+    add_single_edge(from_v, fport, to_v, tport, cost);
+    add_single_edge(to_v, tport, from_v, fport, cost);
 }
 
-// Does this vertex have a specific switch & port connected to this port?
-uint8_t Graph::has_edge(uint64_t from, uint32_t fport, uint64_t to,
-                        uint32_t tport) const {
-    vertices_t::const_iterator vsearch = vertices.find(from);
-    if (vsearch == vertices.end()) {
+/* Set a port's cost; returns 1 if that changed the cost of its link */
+uint8_t Graph::set_port_cost(uint64_t id, uint32_t port, uint32_t cost) {
+    uint32_t old_cost = port_cost(id, port);
+
+    port_costs[std::make_pair(id, port)] = cost;
+    if (cost == old_cost) {
         return 0;
     }
-    edges_t::const_iterator esearch = vsearch->second.find(fport);
-    if (esearch == vsearch->second.end()) {
+
+    std::map<uint64_t, uint32_t>::const_iterator vsearch = ids.find(id);
+    if (vsearch == ids.end()) {
         return 0;
     }
-    return esearch->second.first == to && esearch->second.second == tport;
-}
-
-// Does this vertex have any switch connected to this port?
-uint8_t Graph::has_any_edge(uint64_t from, uint32_t fport) const {
-    vertices_t::const_iterator vsearch = vertices.find(from);
-    if (vsearch == vertices.end()) {
+    std::vector<edge_t>* from_e = &adjacency[vsearch->second];
+    std::vector<edge_t>::iterator from_search = find_port(from_e, port);
+    if (from_search == from_e->end() || from_search->port != port) {
         return 0;
     }
+    // Re-adding the same link only updates its cost, in place
+    uint32_t old_link = from_search->cost;
+    add_edge(id, port, dpids[from_search->to], from_search->to_port);
+    return from_search->cost != old_link;
+}
+
+// A port's cost, DEFAULT_PORT_COST if it was never set
+uint32_t Graph::port_cost(uint64_t id, uint32_t port) const {
+    std::map<std::pair<uint64_t, uint32_t>, uint32_t>::const_iterator it =
+        port_costs.find(std::make_pair(id, port));
 
-    edges_t edges = vsearch->second;
-    return edges.find(fport) != edges.end();
+    return it == port_costs.end() ? DEFAULT_PORT_COST : it->second;
 }
 
-void Graph::walk_shortest_path(uint64_t start, uint32_t start_port, void* data,
-                               uint8_t bidirectional,
-                               shortest_path_cb cb) const {
-    std::queue<std::pair<uint64_t, uint32_t> > queue;
-    std::set<uint64_t> visited;
+// The cost every link has, if they all have the same one; 0 if they differ
+uint32_t Graph::uniform_cost() const {
+    if (link_costs.empty()) {
+        return DEFAULT_PORT_COST;
+    }
+    return link_costs.size() == 1 ? link_costs.begin()->first : 0;
+}
 
-    queue.push(std::pair<uint64_t, uint32_t>(start, start_port));
-    visited.insert(start);
+// Does this vertex have a specific switch & port connected to this port?
+uint8_t Graph::has_edge(uint64_t from, uint32_t fport, uint64_t to,
+                        uint32_t tport) const {
+    const std::vector<edge_t>& from_e = edges(from);
+    std::vector<edge_t>::const_iterator it;
 
-    while (!queue.empty()) {
-        std::pair<uint64_t, uint32_t> vertex = queue.front();
-        queue.pop();
-        cb(vertex.first, vertex.second, data);
+    for (it = from_e.begin(); it != from_e.end(); it++) {
+        if (it->port == fport) {
+            return dpids[it->to] == to && it->to_port == tport;
+        }
+    }
+    return 0;
+}
 
-        edges_t edges = vertices.find(vertex.first)->second;
-        for (edges_t::iterator it = edges.begin(); it != edges.end(); it++) {
-            uint32_t my_port = it->first;
-            uint64_t them = it->second.first;
-            uint32_t their_port = it->second.second;
-            if (visited.find(them) == visited.end()) {
-                visited.insert(them);
-                if (bidirectional) {
-                    cb(vertex.first, my_port, data);
-                }
-                queue.push(std::pair<uint64_t, uint32_t>(them, their_port));
-            }
+// Does this vertex have any switch connected to this port?
+uint8_t Graph::has_any_edge(uint64_t from, uint32_t fport) const {
+    const std::vector<edge_t>& from_e = edges(from);
+    std::vector<edge_t>::const_iterator it;
+
+    for (it = from_e.begin(); it != from_e.end(); it++) {
+        if (it->port == fport) {
+            return 1;
         }
     }
+    return 0;
 }
 
-#define IGNORE_EDGE 0xffffffff
+// Index of a switch, or NO_VERTEX for one never added
+uint32_t Graph::vertex(uint64_t id) const {
+    std::map<uint64_t, uint32_t>::const_iterator vsearch = ids.find(id);
 
-void add_mst_edge(uint64_t vertex, uint32_t port, void* mst) {
-    MST* m = reinterpret_cast<MST*>(mst);
+    return vsearch == ids.end() ? NO_VERTEX : vsearch->second;
+}
 
-    if (port == IGNORE_EDGE) {
-        // The "start port" for an MST is meaningless to us
+// The vertex of the lowest dpid, NO_VERTEX if there are none
+uint32_t Graph::lowest_vertex() const {
+    return ids.empty() ? NO_VERTEX : ids.begin()->second;
+}
+
+// A vertex's edges in port order; none for a switch never added
+const std::vector<edge_t>& Graph::edges(uint64_t id) const {
+    static const std::vector<edge_t> none;
+    std::map<uint64_t, uint32_t>::const_iterator vsearch = ids.find(id);
+
+    if (vsearch == ids.end()) {
+        return none;
+    }
+    return adjacency[vsearch->second];
+}
+
+/* Lay every vertex's edges out back to back, if they changed since */
+void Graph::compact() const {
+    uint32_t vertex;
+
+    if (!stale) {
         return;
     }
-    (*m)[vertex].insert(port);
+    csr_start.resize(dpids.size() + 1);
+    csr_edges.clear();
+    for (vertex = 0; vertex < dpids.size(); vertex++) {
+        csr_start[vertex] = (uint32_t)csr_edges.size();
+        csr_edges.insert(csr_edges.end(), adjacency[vertex].begin(),
+                         adjacency[vertex].end());
+    }
+    csr_start[vertex] = (uint32_t)csr_edges.size();
+    stale = 0;
 }
 
 MST* Graph::make_mst() const {
     MST* mst = new MST;
+    MstCollector visit;
 
-    vertices_t::const_iterator it = vertices.begin();
-    if (it == vertices.end()) {
+    std::map<uint64_t, uint32_t>::const_iterator it = ids.begin();
+    if (it == ids.end()) {
         return mst;
     }
 
-    walk_shortest_path(it->first, IGNORE_EDGE, (void*)mst, 1, add_mst_edge);
+    // Rooted at the lowest dpid, so it is the same tree on every shard
+    visit.mst = mst;
+    walk_shortest_path(it->first, IGNORE_EDGE, 1, visit);
     return mst;
 }
@@ -1,29 +1,127 @@
 #ifndef GRAPH_H_
 #define GRAPH_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <map>
 #include <set>
+#include <utility>
+#include <vector>
 
-typedef void(shortest_path_cb)(uint64_t, uint32_t, void *);
-typedef std::map<uint32_t, std::pair<uint64_t, uint32_t> > edges_t;
 typedef std::map<uint64_t, std::set<uint32_t> > MST;
 
+#define NO_VERTEX 0xffffffff
+#define DEFAULT_PORT_COST 10  // for a port whose cost was never set
+
+// One direction of a link, kept by the vertex it leaves from
+typedef struct {
+    uint32_t port;     // our port
+    uint32_t to;       // index of the far end
+    uint32_t to_port;  // its port
+    uint32_t cost;     // of crossing the link, the same either way
+} edge_t;
+
+/*
+ * Switches are interned to dense indices in the order they are added. Each
+ * vertex's links are kept in a small vector sorted by port, which is what
+ * updates change. Walks run over a compacted copy of all of them (CSR: one
+ * array of edges, and where each vertex's start), rebuilt on the first walk
+ * after a change, with a flat bitset for the vertices seen.
+ *
+ * Edges are always visited in port order, so a walk does not depend on the
+ * order switches were added in, and every shard takes the same paths.
+ *
+ * Every port has a cost, set from its speed; a link costs what its dearer
+ * end does, so both directions cost the same. Walks ignore costs; the route
+ * table uses them.
+ */
 class Graph {
    public:
+    Graph();
     void add_vertex(uint64_t);
     void add_edge(uint64_t, uint32_t, uint64_t, uint32_t);
     void remove_edge(uint64_t, uint32_t);
     uint8_t has_edge(uint64_t, uint32_t, uint64_t, uint32_t) const;
     uint8_t has_any_edge(uint64_t, uint32_t) const;
-    void walk_shortest_path(uint64_t, uint32_t, void *, uint8_t,
-                            shortest_path_cb) const;
+    uint8_t set_port_cost(uint64_t, uint32_t, uint32_t);
+    uint32_t port_cost(uint64_t, uint32_t) const;
+    uint32_t uniform_cost() const;
+    template <typename Visitor>
+    void walk_shortest_path(uint64_t, uint32_t, uint8_t, Visitor&) const;
     MST *make_mst() const;
-    std::map<uint64_t, edges_t> vertices;
+    const std::vector<edge_t> &edges(uint64_t) const;
+    uint32_t num_vertices() const { return (uint32_t)dpids.size(); }
+    uint64_t dpid(uint32_t vertex) const { return dpids[vertex]; }
+    uint32_t vertex(uint64_t) const;
+    uint32_t lowest_vertex() const;
+    const std::vector<edge_t> &neighbors(uint32_t vertex) const {
+        return adjacency[vertex];
+    }
+
+    // Ends of every link added or removed since the routes last caught up
+    std::vector<uint32_t> touched;
+    // ... and since the broadcast tree last did
+    std::vector<uint32_t> tree_touched;
 
    private:
-    void add_single_edge(uint64_t, uint32_t, uint64_t, uint32_t);
-    edges_t *get_or_add_vertex(uint64_t);
+    uint32_t intern(uint64_t);
+    void touch(uint32_t);
+    void add_single_edge(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+    void remove_single_edge(uint32_t, uint32_t);
+    void compact() const;
+
+    std::map<uint64_t, uint32_t> ids;  // dpid to index
+    std::vector<uint64_t> dpids;       // index to dpid
+    std::vector<std::vector<edge_t> > adjacency;
+    std::map<std::pair<uint64_t, uint32_t>, uint32_t> port_costs;
+    std::map<uint32_t, size_t> link_costs;  // edges at each cost
+
+    // Compacted adjacency, valid unless stale
+    mutable std::vector<uint32_t> csr_start;  // num_vertices() + 1 offsets
+    mutable std::vector<edge_t> csr_edges;
+    mutable uint8_t stale;
 };
 
+/*
+ * Breadth-first from start, calling visit(dpid, port) with the port each
+ * switch is first reached on (start_port for the start). If bidirectional,
+ * also visit(dpid, port) with the port it reaches each new switch through.
+ */
+template <typename Visitor>
+void Graph::walk_shortest_path(uint64_t start, uint32_t start_port,
+                               uint8_t bidirectional, Visitor &visit) const {
+    std::map<uint64_t, uint32_t>::const_iterator sit = ids.find(start);
+    if (sit == ids.end()) {
+        return;
+    }
+    compact();
+
+    std::vector<uint64_t> visited((dpids.size() + 63) / 64, 0);
+    std::vector<std::pair<uint32_t, uint32_t> > queue;
+    size_t head;
+
+    queue.reserve(dpids.size());
+    queue.push_back(std::make_pair(sit->second, start_port));
+    visited[sit->second / 64] |= 1ULL << (sit->second % 64);
+
+    for (head = 0; head < queue.size(); head++) {
+        uint32_t vertex = queue[head].first;
+        uint32_t ndx, end = csr_start[vertex + 1];
+
+        visit(dpids[vertex], queue[head].second);
+        for (ndx = csr_start[vertex]; ndx < end; ndx++) {
+            const edge_t &edge = csr_edges[ndx];
+            uint64_t bit = 1ULL << (edge.to % 64);
+            if (visited[edge.to / 64] & bit) {
+                continue;
+            }
+            visited[edge.to / 64] |= bit;
+            if (bidirectional) {
+                visit(dpids[vertex], edge.port);
+            }
+            queue.push_back(std::make_pair(edge.to, edge.to_port));
+        }
+    }
+}
+
 #endif /* GRAPH_H_ */
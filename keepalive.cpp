@@ -0,0 +1,133 @@
+/* Controller-initiated echo keepalive and control channel RTT */
+
+#include "keepalive.h"
+#include <cstdio>
+#include <map>
+#include "client.h"
+#include "event.h"
+#include "openflow.h"
+
+#define ECHO_INTERVAL_MS 1000
+// A switch that leaves this many echoes in a row unanswered is disconnected
+#define ECHO_MAX_MISSES 3
+
+/*
+ * Beacon timeouts. Fast control channels keep the minimum, which leaves room
+ * for the owner being busy with a recompute; slow ones get longer.
+ */
+#define MIN_POLL_TIMEOUT_MS 750
+#define MAX_POLL_TIMEOUT_MS 10000
+
+static void send_echo_event(void*);
+static void send_echo(Client*);
+
+RttStats::RttStats() {
+    samples = 0;
+    srtt = 0;
+    rttvar = 0;
+    for (int ndx = 0; ndx < RTT_BUCKETS; ndx++) {
+        histogram[ndx] = 0;
+    }
+}
+
+void RttStats::add(uint64_t rtt) {
+    unsigned bucket = 0;
+
+    while (bucket < RTT_BUCKETS - 1 && rtt >= ((uint64_t)1 << bucket)) {
+        bucket++;
+    }
+    histogram[bucket]++;
+
+    if (samples++ == 0) {
+        srtt = rtt;
+        rttvar = rtt / 2;
+        return;
+    }
+    uint64_t delta = rtt > srtt ? rtt - srtt : srtt - rtt;
+    rttvar = (3 * rttvar + delta) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+}
+
+/* How long a reply can reasonably take */
+uint64_t RttStats::rto() const {
+    return srtt + 4 * rttvar;
+}
+
+void RttStats::print(uint64_t uid) const {
+    int ndx;
+
+    if (!samples) {
+        return;
+    }
+    fprintf(stderr, "switch %016llx: echo RTT srtt=%llums rttvar=%llums:",
+            (unsigned long long)uid, (unsigned long long)srtt,
+            (unsigned long long)rttvar);
+    for (ndx = 0; ndx < RTT_BUCKETS; ndx++) {
+        if (histogram[ndx]) {
+            fprintf(stderr, " <%llums:%u",
+                    (unsigned long long)((uint64_t)1 << ndx), histogram[ndx]);
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+/* Start probing a switch that has finished its handshake */
+void start_keepalive(Client* client) {
+    Server* server = (Server*)client->server;
+
+    client->echo_timer = server->schedule_event(
+        ECHO_INTERVAL_MS, send_echo_event, (void*)client->uid);
+}
+
+void send_echo_event(void* arg) {
+    std::map<uint64_t, Client*>::iterator it = client_table.find((uint64_t)arg);
+    if (it != client_table.end()) {
+        send_echo(it->second);
+    }
+}
+
+void send_echo(Client* client) {
+    Server* server = (Server*)client->server;
+
+    if (client->echo_seq - client->echo_acked >= ECHO_MAX_MISSES) {
+        fprintf(stderr, "switch %016llx: %u echoes unanswered, disconnecting\n",
+                (unsigned long long)client->uid, ECHO_MAX_MISSES);
+        client->echo_timer = 0;
+        client->evict();
+        return;
+    }
+
+    client->echo_seq++;
+    client->echo_sent[client->echo_seq % ECHO_WINDOW] = server->now_ms();
+    send_echo_request(client, client->echo_seq);
+    client->echo_timer = server->schedule_event(
+        ECHO_INTERVAL_MS, send_echo_event, (void*)client->uid);
+}
+
+/* A reply to one of the last few echoes: the switch is alive */
+void echo_replied(Client* client, uint32_t xid) {
+    Server* server = (Server*)client->server;
+
+    if (xid <= client->echo_acked || xid > client->echo_seq ||
+        client->echo_seq - xid >= ECHO_WINDOW) {
+        return;
+    }
+    client->echo_acked = xid;
+    client->rtt.add(server->now_ms() - client->echo_sent[xid % ECHO_WINDOW]);
+}
+
+/*
+ * How long to wait for a beacon sent out of one of client's ports. It crosses
+ * two control channels, the sender's and the receiver's; we only know the
+ * sender, so its RTO counts for both.
+ */
+uint64_t poll_timeout_ms(const Client* client) {
+    uint64_t timeout = 2 * client->rtt.rto();
+
+    if (timeout < MIN_POLL_TIMEOUT_MS) {
+        timeout = MIN_POLL_TIMEOUT_MS;
+    } else if (timeout > MAX_POLL_TIMEOUT_MS) {
+        timeout = MAX_POLL_TIMEOUT_MS;
+    }
+    return timeout;
+}
@@ -0,0 +1,32 @@
+#ifndef KEEPALIVE_H_
+#define KEEPALIVE_H_
+
+#include <stdint.h>
+
+class Client;
+
+#define RTT_BUCKETS 16
+
+/*
+ * Round-trip times of one switch's control channel. The histogram has
+ * power-of-two buckets of milliseconds: bucket 0 is under 1ms, bucket n is
+ * [2^(n-1), 2^n) ms, and the last one takes everything above. The smoothed
+ * RTT and its variance are kept as TCP does (RFC 6298).
+ */
+class RttStats {
+   public:
+    RttStats();
+    void add(uint64_t);
+    uint64_t rto(void) const;
+    void print(uint64_t) const;
+    uint64_t samples;
+    uint64_t srtt;    // ms
+    uint64_t rttvar;  // ms
+    uint32_t histogram[RTT_BUCKETS];
+};
+
+void start_keepalive(Client*);
+void echo_replied(Client*, uint32_t);
+uint64_t poll_timeout_ms(const Client*);
+
+#endif /* KEEPALIVE_H_ */
@@ -1,10 +1,14 @@
 #include "openflow.h"
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstdio>
 #include <set>
+#include <utility>
+#include <vector>
 #include "beacon.h"
 #include "event.h"
 #include "god.h"
@@ -20,12 +24,16 @@ enum ofp_type {
     OFPT_FEATURE_REQ = 5,
     OFPT_FEATURE_RES = 6,
     OFPT_PACKET_IN = 10,
+    OFPT_FLOW_REMOVED = 11,
     OFPT_PORT_STATUS = 12,
     OFPT_PACKET_OUT = 13,
     OFPT_FLOW_MOD = 14,
     OFPT_GROUP_MOD = 15,
     OFPT_MULTIPART_REQ = 18,
-    OFPT_MULTIPART_RES = 19
+    OFPT_MULTIPART_RES = 19,
+    OFPT_BARRIER_REQ = 20,
+    OFPT_BARRIER_RES = 21,
+    OFPT_METER_MOD = 29
 };
 
 enum port_reason { PORT_ADD = 0, PORT_DEL = 1, PORT_MOD = 2 };
@@ -40,6 +48,9 @@ enum oxm_ofb_match_fields {
 
 /* Can't make values larger than a signed int in ISO C */
 #define BCAST_GROUP_ID 0x7f5d8dda
+/* Chunk n of the flood ports is group BCAST_GROUP_ID + n; chunk 0 is its own */
+#define BCAST_CHUNKS (OFPP_MAX / BCAST_CHUNK_PORTS + 1)
+#define IS_BCAST_GROUP(id) ((uint32_t)((id) - BCAST_GROUP_ID) < BCAST_CHUNKS)
 
 #define OFPP_MAX 0xffffff00
 //#define OFPP_ALL 0xfffffffc
@@ -48,13 +59,71 @@ enum oxm_ofb_match_fields {
 
 #define OFP_NO_BUFFER 0xffffffff
 
+/* How much of a missed packet the switch sends us; it buffers the whole */
+#define PACKET_IN_MAX_LEN 128
+
 enum match_type { OFPMT_OXM = 1 };
 
-enum instr_write_type { OFPIT_GOTO_TABLE = 1, OFPIT_WRITE_ACTIONS = 3 };
+enum instr_write_type {
+    OFPIT_GOTO_TABLE = 1,
+    OFPIT_WRITE_ACTIONS = 3,
+    OFPIT_METER = 6
+};
 
 enum action_type { OFPAT_OUTPUT = 0, OFPAT_GROUP = 22 };
 
-enum multipart_type { OFPMP_PORT_DESC = 13 };
+enum group_type { OFPGT_ALL = 0, OFPGT_SELECT = 1 };
+
+enum multipart_type {
+    OFPMP_FLOW = 1,
+    OFPMP_GROUP_DESC = 7,
+    OFPMP_PORT_DESC = 13
+};
+
+#define OFPMPF_REPLY_MORE 1
+#define OFPTT_ALL 0xff
+
+// What a reconnecting switch still has to tell us before routes are pushed
+#define RECONCILE_FLOWS 1
+#define RECONCILE_GROUPS 2
+#define RECONCILE_FLOWS_XID 889
+#define RECONCILE_GROUPS_XID 890
+
+/*
+ * PACKET_IN admission. Each switch, and each port on it, gets a token bucket;
+ * a PACKET_IN that finds either empty is dropped by the reactor before it
+ * reaches the owner, so a storm from one host cannot keep the topology thread
+ * recomputing. Switches with meters also cap the rate themselves, on the
+ * table miss only: the beacons we poll switches with must never be dropped.
+ */
+#define PACKET_IN_RATE 1000  // per second, per switch
+#define PACKET_IN_BURST 500
+#define PORT_PACKET_IN_RATE 200  // per second, per port
+#define PORT_PACKET_IN_BURST 100
+#define SHED_REPORT_MS 10000  // how often to report shedding, at most
+
+// The meter the table miss goes through on its way to us
+#define PACKET_IN_METER 1
+#define PACKET_IN_METER_XID 891
+#define METERED_MISS_XID 892
+
+enum meter_mod_command { OFPMC_ADD = 0 };
+enum meter_flags { OFPMF_PKTPS = 2, OFPMF_BURST = 4 };
+enum meter_band_type { OFPMBT_DROP = 1 };
+
+typedef struct {
+    uint16_t command;
+    uint16_t flags;
+    uint32_t meter_id;
+} __attribute__((packed)) meter_mod_t;
+
+typedef struct {
+    uint16_t type;
+    uint16_t len;
+    uint32_t rate;
+    uint32_t burst_size;
+    uint8_t _pad[4];
+} __attribute__((packed)) meter_band_drop_t;
 
 typedef struct {
     uint16_t type;
@@ -138,6 +207,12 @@ typedef struct {
     uint8_t _pad[3];
 } __attribute__((packed)) instr_goto_t;
 
+typedef struct {
+    uint16_t type;
+    uint16_t length;
+    uint32_t meter_id;
+} __attribute__((packed)) instr_meter_t;
+
 typedef struct {
     uint32_t buffer_id;
     uint16_t total_len;
@@ -147,6 +222,28 @@ typedef struct {
     match_t match;
 } __attribute__((packed)) packet_in_t;
 
+typedef struct {
+    uint64_t cookie;
+    uint16_t priority;
+    uint8_t reason;
+    uint8_t table_id;
+    uint32_t duration_sec;
+    uint32_t duration_nsec;
+    uint16_t idle_timeout;
+    uint16_t hard_timeout;
+    uint64_t packet_count;
+    uint64_t byte_count;
+    match_t match;
+} __attribute__((packed)) flow_removed_t;
+
+enum flow_removed_reason {
+    OFPRR_IDLE_TIMEOUT = 0,
+    OFPRR_HARD_TIMEOUT = 1,
+    OFPRR_DELETE = 2
+};
+
+#define OFPFF_SEND_FLOW_REM 1
+
 typedef struct {
     uint32_t buffer_id;
     uint32_t in_port;
@@ -162,6 +259,42 @@ typedef struct {
     uint8_t body[];
 } __attribute__((packed)) multipart_t;
 
+typedef struct {
+    uint8_t table_id;
+    uint8_t _pad[3];
+    uint32_t out_port;
+    uint32_t out_group;
+    uint8_t _pad2[4];
+    uint64_t cookie;
+    uint64_t cookie_mask;
+    match_t match;
+} __attribute__((packed)) flow_stats_req_t;
+
+typedef struct {
+    uint16_t length;
+    uint8_t table_id;
+    uint8_t _pad;
+    uint32_t duration_sec;
+    uint32_t duration_nsec;
+    uint16_t priority;
+    uint16_t idle_timeout;
+    uint16_t hard_timeout;
+    uint16_t flags;
+    uint8_t _pad2[4];
+    uint64_t cookie;
+    uint64_t packet_count;
+    uint64_t byte_count;
+    match_t match;
+} __attribute__((packed)) flow_stats_t;
+
+typedef struct {
+    uint16_t length;
+    uint8_t type;
+    uint8_t _pad;
+    uint32_t group_id;
+    bucket_t buckets[];
+} __attribute__((packed)) group_desc_t;
+
 typedef struct {
     uint32_t port_id;
     uint8_t _pad[4];
@@ -184,30 +317,148 @@ typedef struct {
     port_t port;
 } __attribute__((packed)) port_status_t;
 
-static ofp_header_t *make_packet(uint8_t, uint16_t, uint32_t);
-static void setup_table_miss(Client *);
-static void handle_hello(Client *);
-static void handle_error(Client *);
-static void handle_feature_res(Client *);
-static void handle_multipart_res(Client *);
-static void handle_echo_req(Client *);
-static void handle_packet_in(Client *);
-static void handle_port_status(Client *);
+typedef void (*packet_handler_t)(Client *, const ofp_header_t *);
+
+// A packet copied off an I/O thread, to be handled by the owner thread
+typedef struct {
+    Client *client;
+    packet_handler_t handler;
+    ofp_header_t *packet;
+} owned_packet_t;
+
+/*
+ * Messages that are sent over and over are encoded once into a template.
+ * Sending one copies the template and patches the fields below.
+ */
+#define FLOW_MOD_TABLE_OFFSET \
+    (sizeof(ofp_header_t) + offsetof(flow_mod_t, table_id))
+#define FLOW_MOD_COMMAND_OFFSET \
+    (sizeof(ofp_header_t) + offsetof(flow_mod_t, command))
+#define FLOW_MOD_IDLE_OFFSET \
+    (sizeof(ofp_header_t) + offsetof(flow_mod_t, idle_timeout))
+#define FLOW_MOD_HARD_OFFSET \
+    (sizeof(ofp_header_t) + offsetof(flow_mod_t, hard_timeout))
+#define FLOW_MOD_FLAGS_OFFSET \
+    (sizeof(ofp_header_t) + offsetof(flow_mod_t, flags))
+#define DEST_MAC_OFFSET \
+    (sizeof(ofp_header_t) + sizeof(flow_mod_t) + sizeof(match_t))
+#define DEST_MAC_RULE_LENGTH                                   \
+    (uint16_t)(DEST_MAC_OFFSET + 8 + sizeof(instr_write_t) + \
+               sizeof(action_output_t))
+#define DEST_PORT_OFFSET                                     \
+    (DEST_MAC_RULE_LENGTH - sizeof(action_output_t) + \
+     offsetof(action_output_t, port))
+#define DEST_MAC_GROUP_RULE_LENGTH                             \
+    (uint16_t)(DEST_MAC_OFFSET + 8 + sizeof(instr_write_t) + \
+               sizeof(action_group_t))
+#define DEST_GROUP_OFFSET                                          \
+    (DEST_MAC_GROUP_RULE_LENGTH - sizeof(action_group_t) + \
+     offsetof(action_group_t, group_id))
+#define BUCKET_PORT_OFFSET (sizeof(bucket_t) + offsetof(action_output_t, port))
+#define BUCKET_GROUP_OFFSET \
+    (sizeof(bucket_t) + offsetof(action_group_t, group_id))
+#define PACKET_OUT_HEADER_LENGTH                              \
+    (uint16_t)(sizeof(ofp_header_t) + sizeof(packet_out_t) + \
+               sizeof(action_output_t))
+#define PACKET_OUT_PORT_OFFSET                          \
+    (sizeof(ofp_header_t) + sizeof(packet_out_t) + \
+     offsetof(action_output_t, port))
+
+static MsgBuf make_packet(uint8_t, uint16_t, uint32_t);
+static MsgBuf encode_table_miss(uint8_t);
+static MsgBuf encode_bucket(void);
+static MsgBuf encode_group_bucket(void);
+template <typename Ports>
+static MsgBuf encode_group_mod(uint16_t, uint8_t, uint32_t, const Ports *,
+                               const std::set<uint32_t> *);
+static MsgBuf encode_broadcast_rule(void);
+static MsgBuf encode_dest_mac_rule(void);
+static MsgBuf encode_dest_mac_group_rule(void);
+static void host_rule_timeouts(Client *, MsgBuf *);
+static MsgBuf encode_packet_out(void);
+static void put16(uint8_t *, uint16_t);
+static void put32(uint8_t *, uint32_t);
+static void setup_table_miss(Client *, uint8_t);
+static void setup_packet_in_meter(Client *);
+static uint8_t admit_packet_in(Client *, const ofp_header_t *);
+static void handle_hello(Client *, const ofp_header_t *);
+static void handle_error(Client *, const ofp_header_t *);
+static void handle_feature_res(Client *, const ofp_header_t *);
+static void handle_multipart_res(Client *, const ofp_header_t *);
+static void handle_echo_req(Client *, const ofp_header_t *);
+static void handle_echo_res(Client *, const ofp_header_t *);
+static void handle_packet_in(Client *, const ofp_header_t *);
+static void forward_packet_in(Client *, const packet_in_t *, uint32_t,
+                              const uint8_t *, size_t);
+static void send_packet_in_out(Client *, uint32_t, uint32_t, uint16_t,
+                               uint32_t, const uint8_t *, uint16_t);
+static void release_buffer(Client *, uint32_t, uint32_t);
+static void handle_port_status(Client *, const ofp_header_t *);
+static void handle_flow_removed(Client *, const ofp_header_t *);
+static void handle_barrier_res(Client *, const ofp_header_t *);
+static void request_tables(Client *);
+static void reconcile_flows(Client *, const uint8_t *, size_t);
+static void reconcile_groups(Client *, const uint8_t *, size_t);
+static uint8_t match_eth_dst(const match_t *, uint64_t *);
+static void count_group_refs(Client *);
+static void reconciled(Client *, uint8_t);
+static void run_on_owner(Client *, const ofp_header_t *, packet_handler_t);
+static void handle_owned_packet(void *);
+static void dispatch_owned(Client *, const ofp_header_t *, packet_handler_t);
+static void bind_auxiliary(Client *, uint8_t);
+static Client *packet_channel(Client *);
 
 void init_connection(Client *client) {
-    ofp_header_t *hello;
+    client->packet_in_limit = TokenBucket(PACKET_IN_RATE, PACKET_IN_BURST);
+    client->write_packet(make_packet(OFPT_HELLO, sizeof(ofp_header_t), 666),
+                         LANE_CONTROL);
+    if (client->datagram_peer) {
+        // The switch's HELLO opened the connection; nothing else will come
+        handle_hello(client, nullptr);
+    }
+}
 
-    hello = make_packet(OFPT_HELLO, sizeof(ofp_header_t), 666);
-    client->write_packet(hello, sizeof(ofp_header_t));
-    add_dest_mac_rule(client, SWITCH_POLL_MAGIC, OFPP_CONTROLLER, FM_CMD_ADD,
-                      0);
-    setup_table_miss(client);
+/*
+ * Have the switch drop missed packets beyond our rate before they are sent.
+ * Only the table miss goes through the meter, not the poll rule.
+ */
+void setup_packet_in_meter(Client *client) {
+    uint16_t length = sizeof(ofp_header_t) + sizeof(meter_mod_t) +
+                      sizeof(meter_band_drop_t);
+    MsgBuf buf = make_packet(OFPT_METER_MOD, length, PACKET_IN_METER_XID);
+    ofp_header_t *pack = (ofp_header_t *)buf.data;
+    meter_mod_t *meter_mod = (meter_mod_t *)pack->data;
+    meter_band_drop_t *band = (meter_band_drop_t *)(meter_mod + 1);
+
+    meter_mod->command = htons(OFPMC_ADD);
+    meter_mod->flags = htons(OFPMF_PKTPS | OFPMF_BURST);
+    meter_mod->meter_id = htonl(PACKET_IN_METER);
+
+    band->type = htons(OFPMBT_DROP);
+    band->len = htons(sizeof(meter_band_drop_t));
+    band->rate = htonl(PACKET_IN_RATE);
+    band->burst_size = htonl(PACKET_IN_BURST);
+
+    client->write_packet(std::move(buf), LANE_FLOW);
+}
+
+/*
+ * Send the table miss, through the PACKET_IN meter if metered. A switch that
+ * has no such meter errors the metered one, and gets it again without.
+ */
+void setup_table_miss(Client *client, uint8_t metered) {
+    static const MsgBuf tmpl = encode_table_miss(0);
+    static const MsgBuf metered_tmpl = encode_table_miss(1);
+    const MsgBuf &miss = metered ? metered_tmpl : tmpl;
+
+    client->write_packet(MsgBuf(miss.data, miss.size), LANE_FLOW);
 }
 
-void setup_table_miss(Client *client) {
+MsgBuf encode_table_miss(uint8_t metered) {
     ofp_header_t *pack;
     flow_mod_t *flow_mod;
     match_t *match;
+    instr_meter_t *meter;
     instr_write_t *instr1;
     instr_goto_t *instr2;
     action_output_t *action;
@@ -215,10 +466,22 @@ void setup_table_miss(Client *client) {
                       sizeof(match_t) + sizeof(instr_write_t) +
                       sizeof(action_output_t) + sizeof(instr_goto_t);
 
-    pack = make_packet(OFPT_FLOW_MOD, length, 0x1234321);
+    if (metered) {
+        length = (uint16_t)(length + sizeof(instr_meter_t));
+    }
+    MsgBuf buf = make_packet(OFPT_FLOW_MOD, length,
+                             metered ? METERED_MISS_XID : 0x1234321);
+    pack = (ofp_header_t *)buf.data;
     flow_mod = (flow_mod_t *)pack->data;
     match = flow_mod->match;
-    instr2 = (instr_goto_t *)((uint8_t *)match + sizeof(match_t));
+    meter = (instr_meter_t *)((uint8_t *)match + sizeof(match_t));
+    if (metered) {
+        meter->type = htons(OFPIT_METER);
+        meter->length = htons(sizeof(instr_meter_t));
+        meter->meter_id = htonl(PACKET_IN_METER);
+        meter++;
+    }
+    instr2 = (instr_goto_t *)meter;
     instr1 = (instr_write_t *)(instr2 + 1);
     action = instr1->actions;
 
@@ -238,50 +501,143 @@ void setup_table_miss(Client *client) {
     action->type = htons(OFPAT_OUTPUT);
     action->length = htons(sizeof(action_output_t));
     action->port = htonl(OFPP_CONTROLLER);
-    action->max_len = htons(0xffff);
+    action->max_len = htons(PACKET_IN_MAX_LEN);
 
     instr2->type = htons(OFPIT_GOTO_TABLE);
     instr2->length = htons(sizeof(instr_goto_t));
     instr2->table_id = 1;
 
-    client->write_packet(pack, length);
+    return buf;
 }
 
-void update_broadcast_group(Client *client, const std::set<uint32_t> *ports,
-                            uint16_t cmd) {
+/*
+ * Set one chunk's broadcast group to output to ports. The broadcast group
+ * itself, chunk 0, also chains to the groups of the chunks in chained.
+ */
+void update_broadcast_group(Client *client, uint32_t chunk,
+                            const std::set<uint32_t> *ports,
+                            const std::set<uint32_t> *chained, uint16_t cmd) {
+    client->write_packet(encode_group_mod(cmd, OFPGT_ALL,
+                                          BCAST_GROUP_ID + chunk, ports,
+                                          chained),
+                         LANE_FLOW);
+}
+
+/*
+ * A SELECT group that spreads flows over ports, for ECMP; returns its id.
+ * A group's ports never change: other ports are another group.
+ */
+uint32_t add_ecmp_group(Client *client, const std::vector<uint32_t> *ports) {
+    uint32_t group_id = client->next_ecmp_group++;
+
+    if (IS_BCAST_GROUP(group_id)) {
+        client->next_ecmp_group = BCAST_GROUP_ID + BCAST_CHUNKS;
+        group_id = client->next_ecmp_group++;
+    }
+    client->write_packet(encode_group_mod(OFPGC_ADD, OFPGT_SELECT, group_id,
+                                          ports, nullptr),
+                         LANE_FLOW);
+    return group_id;
+}
+
+void delete_group(Client *client, uint32_t group_id) {
+    std::vector<uint32_t> none;
+
+    client->write_packet(encode_group_mod(OFPGC_DELETE, OFPGT_ALL, group_id,
+                                          &none, nullptr),
+                         LANE_FLOW);
+}
+
+/*
+ * A group mod with one output bucket per port, each weighing the same, and
+ * one bucket per chunk of the broadcast groups it chains to, if any. Callers
+ * keep it well short of 64k: a chunk's worth of ports at most.
+ */
+template <typename Ports>
+MsgBuf encode_group_mod(uint16_t cmd, uint8_t type, uint32_t group_id,
+                        const Ports *ports,
+                        const std::set<uint32_t> *chained) {
+    static const MsgBuf tmpl = encode_bucket();
+    static const MsgBuf group_tmpl = encode_group_bucket();
+    size_t num_chained = chained == nullptr ? 0 : chained->size();
     uint16_t packet_length =
-        sizeof(ofp_header_t) + sizeof(group_mod_t) +
-        (uint16_t)ports->size() * (sizeof(bucket_t) + sizeof(action_output_t));
-    ofp_header_t *pack = make_packet(OFPT_GROUP_MOD, packet_length, 0);
+        (uint16_t)(sizeof(ofp_header_t) + sizeof(group_mod_t) +
+                   ports->size() * tmpl.size + num_chained * group_tmpl.size);
+    MsgBuf buf = make_packet(OFPT_GROUP_MOD, packet_length, 0);
+    ofp_header_t *pack = (ofp_header_t *)buf.data;
     group_mod_t *group_mod = (group_mod_t *)pack->data;
 
     group_mod->command = htons(cmd);
-    group_mod->group_id = htonl(BCAST_GROUP_ID);
+    group_mod->type = type;
+    group_mod->group_id = htonl(group_id);
 
-    bucket_t *bucket = group_mod->buckets;
-    std::set<uint32_t>::const_iterator it;
+    uint8_t *bucket = (uint8_t *)group_mod->buckets;
+    typename Ports::const_iterator it;
     for (it = ports->begin(); it != ports->end(); it++) {
-        bucket->len = htons(sizeof(bucket_t) + sizeof(action_output_t));
-        bucket->watch_port = htonl(OFPP_ANY);
-        bucket->watch_group = htonl(OFPP_ANY);
+        memcpy(bucket, tmpl.data, tmpl.size);
+        put32(bucket + BUCKET_PORT_OFFSET, *it);
+        if (type == OFPGT_SELECT) {
+            put16(bucket + offsetof(bucket_t, weight), 1);
+        }
+        bucket += tmpl.size;
+    }
+    if (chained != nullptr) {
+        std::set<uint32_t>::const_iterator cit;
+        for (cit = chained->begin(); cit != chained->end(); cit++) {
+            memcpy(bucket, group_tmpl.data, group_tmpl.size);
+            put32(bucket + BUCKET_GROUP_OFFSET, BCAST_GROUP_ID + *cit);
+            bucket += group_tmpl.size;
+        }
+    }
 
-        action_output_t *action = (action_output_t *)(bucket + 1);
-        action->type = htons(OFPAT_OUTPUT);
-        action->length = htons(sizeof(action_output_t));
-        action->port = htonl(*it);
-        action->max_len = htons(0xffff);
+    return buf;
+}
 
-        bucket = (bucket_t *)(action + 1);
-    }
+/* One output bucket of the broadcast group, with the port left to patch */
+MsgBuf encode_bucket() {
+    MsgBuf buf((uint16_t)(sizeof(bucket_t) + sizeof(action_output_t)));
+    bucket_t *bucket = (bucket_t *)buf.data;
+    action_output_t *action = (action_output_t *)(bucket + 1);
+
+    bucket->len = htons(sizeof(bucket_t) + sizeof(action_output_t));
+    bucket->watch_port = htonl(OFPP_ANY);
+    bucket->watch_group = htonl(OFPP_ANY);
+
+    action->type = htons(OFPAT_OUTPUT);
+    action->length = htons(sizeof(action_output_t));
+    action->max_len = htons(0xffff);
+
+    return buf;
+}
+
+/* A bucket that passes packets on to another group, left to patch */
+MsgBuf encode_group_bucket() {
+    MsgBuf buf((uint16_t)(sizeof(bucket_t) + sizeof(action_group_t)));
+    bucket_t *bucket = (bucket_t *)buf.data;
+    action_group_t *action = (action_group_t *)(bucket + 1);
+
+    bucket->len = htons(sizeof(bucket_t) + sizeof(action_group_t));
+    bucket->watch_port = htonl(OFPP_ANY);
+    bucket->watch_group = htonl(OFPP_ANY);
 
-    client->write_packet(pack, packet_length);
+    action->type = htons(OFPAT_GROUP);
+    action->length = htons(sizeof(action_group_t));
+
+    return buf;
 }
 
 void add_broadcast_rule(Client *client) {
+    static const MsgBuf tmpl = encode_broadcast_rule();
+
+    client->write_packet(MsgBuf(tmpl.data, tmpl.size), LANE_FLOW);
+}
+
+MsgBuf encode_broadcast_rule() {
     uint16_t packet_length = sizeof(ofp_header_t) + sizeof(flow_mod_t) +
                              sizeof(match_t) + sizeof(instr_write_t) +
                              sizeof(action_group_t);
-    ofp_header_t *pack = make_packet(OFPT_FLOW_MOD, packet_length, 7);
+    MsgBuf buf = make_packet(OFPT_FLOW_MOD, packet_length, 7);
+    ofp_header_t *pack = (ofp_header_t *)buf.data;
 
     flow_mod_t *flow_mod = (flow_mod_t *)pack->data;
     flow_mod->table_id = 1;
@@ -304,7 +660,7 @@ void add_broadcast_rule(Client *client) {
     action_g->length = htons(sizeof(action_group_t));
     action_g->group_id = htonl(BCAST_GROUP_ID);
 
-    client->write_packet(pack, packet_length);
+    return buf;
 }
 
 /*
@@ -318,7 +674,8 @@ void add_source_mac_rule(Client *client, const void *mac, uint32_t port_id,
     uint16_t length = sizeof(ofp_header_t) + sizeof(flow_mod_t) +
                       sizeof(match_t) + 8 + sizeof(instr_goto_t);
 
-    pack = make_packet(OFPT_FLOW_MOD, length, 0);
+    MsgBuf buf = make_packet(OFPT_FLOW_MOD, length, 0);
+    pack = (ofp_header_t *)buf.data;
     flow_mod = (flow_mod_t *)(pack->data);
     match = flow_mod->match;
     instr = (instr_goto_t *)((uint8_t *)match + sizeof(match_t) + 8);
@@ -341,31 +698,81 @@ void add_source_mac_rule(Client *client, const void *mac, uint32_t port_id,
     instr->length = htons(sizeof(instr_goto_t));
     instr->table_id = 1;
 
-    client->write_packet(pack, length);
+    client->write_packet(std::move(buf), LANE_FLOW);
 }
 */
 
+/* Producing a rule is a copy of the template plus the four patched fields */
 void add_dest_mac_rule(Client *client, const void *mac, uint32_t port_id,
                        uint8_t cmd, uint8_t table_id) {
+    static const MsgBuf tmpl = encode_dest_mac_rule();
+    MsgBuf buf(tmpl.data, tmpl.size);
+
+    buf.data[FLOW_MOD_TABLE_OFFSET] = table_id;
+    buf.data[FLOW_MOD_COMMAND_OFFSET] = cmd;
+    memcpy(buf.data + DEST_MAC_OFFSET, mac, 6);
+    put32(buf.data + DEST_PORT_OFFSET, port_id);
+
+    client->write_packet(std::move(buf), LANE_FLOW);
+}
+
+/*
+ * The host rule at the switch the host is attached to. Only it ages out:
+ * the rules through other switches go when it does.
+ */
+void add_attached_host_rule(Client *client, const void *mac,
+                            uint32_t port_id, uint8_t cmd) {
+    static const MsgBuf tmpl = encode_dest_mac_rule();
+    MsgBuf buf(tmpl.data, tmpl.size);
+
+    buf.data[FLOW_MOD_TABLE_OFFSET] = 1;
+    buf.data[FLOW_MOD_COMMAND_OFFSET] = cmd;
+    memcpy(buf.data + DEST_MAC_OFFSET, mac, 6);
+    put32(buf.data + DEST_PORT_OFFSET, port_id);
+    host_rule_timeouts(client, &buf);
+
+    client->write_packet(std::move(buf), LANE_FLOW);
+}
+
+/* A host rule that hands its packets to an ECMP group instead */
+void add_dest_mac_group_rule(Client *client, const void *mac,
+                             uint32_t group_id, uint8_t cmd) {
+    static const MsgBuf tmpl = encode_dest_mac_group_rule();
+    MsgBuf buf(tmpl.data, tmpl.size);
+
+    buf.data[FLOW_MOD_TABLE_OFFSET] = 1;
+    buf.data[FLOW_MOD_COMMAND_OFFSET] = cmd;
+    memcpy(buf.data + DEST_MAC_OFFSET, mac, 6);
+    put32(buf.data + DEST_GROUP_OFFSET, group_id);
+
+    client->write_packet(std::move(buf), LANE_FLOW);
+}
+
+/* The attached host's rule ages out, and tells us when it does */
+void host_rule_timeouts(Client *client, MsgBuf *buf) {
+    Server *server = (Server *)client->server;
+
+    put16(buf->data + FLOW_MOD_IDLE_OFFSET, server->host_idle_timeout);
+    put16(buf->data + FLOW_MOD_HARD_OFFSET, server->host_hard_timeout);
+    put16(buf->data + FLOW_MOD_FLAGS_OFFSET, OFPFF_SEND_FLOW_REM);
+}
+
+MsgBuf encode_dest_mac_rule() {
     ofp_header_t *pack;
     flow_mod_t *flow_mod;
     match_t *match;
     instr_write_t *instr;
     action_output_t *action;
     uint32_t *fields;
-    uint16_t length = sizeof(ofp_header_t) + sizeof(flow_mod_t) +
-                      sizeof(match_t) + 8 + sizeof(instr_write_t) +
-                      sizeof(action_output_t);
 
-    pack = make_packet(OFPT_FLOW_MOD, length, 0);
+    MsgBuf buf = make_packet(OFPT_FLOW_MOD, DEST_MAC_RULE_LENGTH, 0);
+    pack = (ofp_header_t *)buf.data;
     flow_mod = (flow_mod_t *)pack->data;
     match = flow_mod->match;
     instr = (instr_write_t *)((uint8_t *)match + sizeof(match_t) + 8);
     action = instr->actions;
 
     /* Add a rule */
-    flow_mod->table_id = table_id;
-    flow_mod->command = cmd;
     flow_mod->buffer_id = htonl(OFP_NO_BUFFER);
     flow_mod->priority = htons(11);
     flow_mod->out_port = OFPP_ANY;
@@ -376,77 +783,258 @@ void add_dest_mac_rule(Client *client, const void *mac, uint32_t port_id,
     fields = (uint32_t *)match->oxm_fields;
     fields[0] = htonl(((uint32_t)OFPXMC_OPENFLOW_BASIC << 16) |
                       (OFPXMT_OFB_ETH_DST << 9) | 6);
-    memcpy(fields + 1, mac, 6);
 
     instr->type = htons(OFPIT_WRITE_ACTIONS);
     instr->length = htons(sizeof(instr_write_t) + sizeof(action_output_t));
 
     action->type = htons(OFPAT_OUTPUT);
     action->length = htons(sizeof(action_output_t));
-    action->port = htonl(port_id);
     action->max_len = htons(0xffff);
 
-    client->write_packet(pack, length);
+    return buf;
 }
 
-void handle_ofp_packet(Client *client) {
-    switch (client->cur_packet->type) {
+MsgBuf encode_dest_mac_group_rule() {
+    MsgBuf buf = make_packet(OFPT_FLOW_MOD, DEST_MAC_GROUP_RULE_LENGTH, 0);
+    ofp_header_t *pack = (ofp_header_t *)buf.data;
+    flow_mod_t *flow_mod = (flow_mod_t *)pack->data;
+    match_t *match = flow_mod->match;
+    instr_write_t *instr =
+        (instr_write_t *)((uint8_t *)match + sizeof(match_t) + 8);
+    action_group_t *action = (action_group_t *)instr->actions;
+    uint32_t *fields;
+
+    flow_mod->buffer_id = htonl(OFP_NO_BUFFER);
+    flow_mod->priority = htons(11);
+    flow_mod->out_port = OFPP_ANY;
+    flow_mod->out_group = OFPP_ANY;
+
+    match->type = htons(OFPMT_OXM);
+    match->length = htons(14);
+    fields = (uint32_t *)match->oxm_fields;
+    fields[0] = htonl(((uint32_t)OFPXMC_OPENFLOW_BASIC << 16) |
+                      (OFPXMT_OFB_ETH_DST << 9) | 6);
+
+    instr->type = htons(OFPIT_WRITE_ACTIONS);
+    instr->length = htons(sizeof(instr_write_t) + sizeof(action_group_t));
+
+    action->type = htons(OFPAT_GROUP);
+    action->length = htons(sizeof(action_group_t));
+
+    return buf;
+}
+
+/* Fence the flow programming queued so far; the reply carries xid back */
+void send_barrier(Client *client, uint32_t xid) {
+    client->write_packet(
+        make_packet(OFPT_BARRIER_REQ, sizeof(ofp_header_t), xid), LANE_FLOW);
+}
+
+/*
+ * Runs on the client's reactor. Packets that only need a reply are handled in
+ * place; anything that touches topology goes through the owner thread.
+ */
+void handle_ofp_packet(Client *client, const ofp_header_t *packet) {
+    switch (packet->type) {
         case OFPT_HELLO:
-            handle_hello(client);
+            handle_hello(client, packet);
             break;
         case OFPT_ERROR:
-            handle_error(client);
+            run_on_owner(client, packet, handle_error);
             break;
         case OFPT_FEATURE_RES:
-            handle_feature_res(client);
+            run_on_owner(client, packet, handle_feature_res);
             break;
         case OFPT_MULTIPART_RES:
-            handle_multipart_res(client);
+            run_on_owner(client, packet, handle_multipart_res);
             break;
         case OFPT_ECHO_REQ:
-            handle_echo_req(client);
+            handle_echo_req(client, packet);
+            break;
+        case OFPT_ECHO_RES:
+            run_on_owner(client, packet, handle_echo_res);
             break;
         case OFPT_PACKET_IN:
-            handle_packet_in(client);
+            if (admit_packet_in(client, packet)) {
+                run_on_owner(client, packet, handle_packet_in);
+            }
             break;
         case OFPT_PORT_STATUS:
-            handle_port_status(client);
+            run_on_owner(client, packet, handle_port_status);
+            break;
+        case OFPT_FLOW_REMOVED:
+            run_on_owner(client, packet, handle_flow_removed);
+            break;
+        case OFPT_BARRIER_RES:
+            run_on_owner(client, packet, handle_barrier_res);
             break;
         default:
             fprintf(stderr, "Got unexpected packet type 0x%02x\n",
-                    client->cur_packet->type);
+                    packet->type);
             break;
     }
 }
 
-/* Caller is responsible for freeing this pointer */
-ofp_header_t *make_packet(uint8_t type, uint16_t length, uint32_t xid) {
-    ofp_header_t *hdr;
+/*
+ * Take a token from the PACKET_IN's port and from its switch, on the reactor
+ * thread. Beacons are always let through, so a storm does not take links down.
+ * A switch's auxiliary connections draw on its main connection's buckets, so
+ * spreading a storm over them gets it no further.
+ */
+uint8_t admit_packet_in(Client *client, const ofp_header_t *packet) {
+    const packet_in_t *pack = (const packet_in_t *)packet->data;
+    const uint8_t *end = (const uint8_t *)packet + packet->length;
+    const uint8_t *data;
+    uint32_t oxm_header, port_id;
+    uint64_t now;
+    uint8_t admit = 1;
+
+    if (packet->length < sizeof(ofp_header_t) + sizeof(packet_in_t) + 8) {
+        return 1;  // handle_packet_in reports it
+    }
+    data = (const uint8_t *)&pack->match +
+           (ntohs(pack->match.length) + 7) / 8 * 8 + 2;
+    if (data + 6 <= end && !memcmp(data, SWITCH_POLL_MAGIC, 6)) {
+        return 1;
+    }
+
+    now = ((Server *)client->server)->now_ms();
+    client = client->packet_in_conn;
+    std::lock_guard<std::mutex> guard(client->packet_in_lock);
+    memcpy(&oxm_header, pack->match.oxm_fields, 4);
+    if (((ntohl(oxm_header) >> 9) & 0x7f) == OFPXMT_OFB_IN_PORT) {
+        memcpy(&port_id, pack->match.oxm_fields + 4, 4);
+        std::map<uint32_t, TokenBucket>::iterator limit =
+            client->port_limits.find(port_id);
+        if (limit == client->port_limits.end()) {
+            limit = client->port_limits
+                        .insert(std::make_pair(
+                            port_id, TokenBucket(PORT_PACKET_IN_RATE,
+                                                 PORT_PACKET_IN_BURST)))
+                        .first;
+        }
+        if (!limit->second.take(now)) {
+            client->packet_ins_port_shed++;
+            admit = 0;
+        }
+    }
+    if (admit && !client->packet_in_limit.take(now)) {
+        client->packet_ins_shed++;
+        admit = 0;
+    }
+
+    if (admit) {
+        client->packet_ins_admitted++;
+    } else if (now - client->shed_reported >= SHED_REPORT_MS) {
+        client->shed_reported = now;
+        fprintf(stderr,
+                "switch %016llx: shed %llu packet-ins (%llu over a port's "
+                "limit), admitted %llu\n",
+                (unsigned long long)client->uid,
+                (unsigned long long)(client->packet_ins_shed +
+                                     client->packet_ins_port_shed),
+                (unsigned long long)client->packet_ins_port_shed,
+                (unsigned long long)client->packet_ins_admitted);
+    }
+    return admit;
+}
+
+/* Call handler on the owner thread, copying the packet if we are not on it */
+void run_on_owner(Client *client, const ofp_header_t *packet,
+                  packet_handler_t handler) {
+    Server *server = (Server *)client->server;
+    owned_packet_t *owned;
+
+    if (server->is_owner()) {
+        dispatch_owned(client, packet, handler);
+        return;
+    }
 
-    if ((hdr = (ofp_header_t *)calloc(1, length)) == nullptr) {
-        perror("calloc");
-        exit(-1);
+    owned = new owned_packet_t;
+    owned->client = client;
+    owned->handler = handler;
+    owned->packet = (ofp_header_t *)pool_alloc(packet->length);
+    memcpy(owned->packet, packet, packet->length);
+    server->run_on_owner(handle_owned_packet, owned);
+}
+
+void handle_owned_packet(void *arg) {
+    owned_packet_t *owned = (owned_packet_t *)arg;
+
+    dispatch_owned(owned->client, owned->packet, owned->handler);
+    pool_free(owned->packet);
+    delete owned;
+}
+
+/*
+ * On the owner thread. What arrives on an auxiliary connection is handled as
+ * if it came on the main one; once the main one is gone, it is dropped.
+ */
+void dispatch_owned(Client *client, const ofp_header_t *packet,
+                    packet_handler_t handler) {
+    if (client->aux_id) {
+        if (client->main_conn == nullptr) {
+            return;
+        }
+        client = client->main_conn;
     }
+    handler(client, packet);
+}
+
+/* Store a field in network order; patched fields need not be aligned */
+void put16(uint8_t *dst, uint16_t value) {
+    value = htons(value);
+    memcpy(dst, &value, sizeof(value));
+}
+
+void put32(uint8_t *dst, uint32_t value) {
+    value = htonl(value);
+    memcpy(dst, &value, sizeof(value));
+}
+
+/* A zeroed message from the pool, with its header filled in */
+MsgBuf make_packet(uint8_t type, uint16_t length, uint32_t xid) {
+    MsgBuf buf(length);
+    ofp_header_t *hdr = (ofp_header_t *)buf.data;
 
     hdr->version = 0x04;
     hdr->type = type;
     hdr->length = htons(length);
     hdr->xid = xid;
 
-    return hdr;
+    return buf;
 }
 
-void handle_hello(Client *client) {
-    ofp_header_t *res;
-
-    res = make_packet(OFPT_FEATURE_REQ, sizeof(ofp_header_t), 777);
-    client->write_packet(res, sizeof(ofp_header_t));
+void handle_hello(Client *client, const ofp_header_t *packet) {
+    client->write_packet(
+        make_packet(OFPT_FEATURE_REQ, sizeof(ofp_header_t), 777),
+        LANE_CONTROL);
 }
 
-void handle_error(Client *client) {
+void handle_error(Client *client, const ofp_header_t *packet) {
     const ofp_error_t *err;
 
-    err = (ofp_error_t *)client->cur_packet->data;
+    err = (ofp_error_t *)packet->data;
+
+    /*
+     * A switch without meters gets the table miss unmetered; the
+     * controller-side limit still holds for it
+     */
+    if (packet->xid == PACKET_IN_METER_XID) {
+        return;
+    } else if (packet->xid == METERED_MISS_XID) {
+        setup_table_miss(client, 0);
+        return;
+    }
+
+    /* A switch that cannot dump its tables is simply programmed in full */
+    if (packet->xid == RECONCILE_FLOWS_XID) {
+        reconciled(client, RECONCILE_FLOWS);
+        return;
+    } else if (packet->xid == RECONCILE_GROUPS_XID) {
+        reconciled(client, RECONCILE_GROUPS);
+        return;
+    }
 
     if (ntohs(err->type) == 1) {
         switch (ntohs(err->code)) {
@@ -465,86 +1053,399 @@ void handle_error(Client *client) {
     }
 }
 
-void handle_feature_res(Client *client) {
+void handle_feature_res(Client *client, const ofp_header_t *packet) {
     const switch_features_t *features;
     ofp_header_t *mp_pack;
     multipart_t *req;
 
-    if (client->cur_packet->length < sizeof(switch_features_t)) {
+    if (packet->length < sizeof(switch_features_t)) {
         fprintf(stderr, "Feature packet too short\n");
         return;
     }
-    features = (switch_features_t *)client->cur_packet->data;
+    features = (switch_features_t *)packet->data;
 
     client->uid = ((uint64_t)ntohl(features->datapath_id1) << 32) |
                   ntohl(features->datapath_id2);
+    if (features->auxiliary_id != 0 || client->datagram_peer) {
+        bind_auxiliary(client, features->auxiliary_id);
+        return;
+    }
+
+    add_dest_mac_rule(client, SWITCH_POLL_MAGIC, OFPP_CONTROLLER, FM_CMD_ADD,
+                      0);
+    setup_packet_in_meter(client);
+    setup_table_miss(client, 1);
+
     // Now that we have a client UID, add the client to the graph
-    Graph *graph = &((Server *)client->server)->graph;
+    Server *server = (Server *)client->server;
+    Graph *graph = &server->graph;
     graph->add_vertex(client->uid);
     client_table[client->uid] = client;
+    if (server->cluster != nullptr) {
+        server->cluster->switch_up(client->uid);
+    }
 
     // Send a multipart port stats request
-    mp_pack = make_packet(OFPT_MULTIPART_REQ,
-                          sizeof(ofp_header_t) + sizeof(multipart_t), 888);
+    MsgBuf buf = make_packet(OFPT_MULTIPART_REQ,
+                             sizeof(ofp_header_t) + sizeof(multipart_t), 888);
+    mp_pack = (ofp_header_t *)buf.data;
     req = (multipart_t *)mp_pack->data;
     memset(req, 0, sizeof(multipart_t));
     req->type = htons(OFPMP_PORT_DESC);
-    client->write_packet(mp_pack, sizeof(ofp_header_t) + sizeof(multipart_t));
+    client->write_packet(std::move(buf), LANE_CONTROL);
+}
+
+/*
+ * An auxiliary connection joins the main connection with the same datapath
+ * id. One that shows up before its main connection is closed; the switch
+ * opens it again.
+ */
+void bind_auxiliary(Client *client, uint8_t aux_id) {
+    Server *server = (Server *)client->server;
+    std::map<uint64_t, Client *>::iterator it = client_table.find(client->uid);
+
+    client->aux_id = aux_id ? aux_id : 0xff;
+    server->end_handshake(client);
+    if (it == client_table.end()) {
+        fprintf(stderr, "switch %016llx: auxiliary connection %u before its "
+                        "main connection\n",
+                (unsigned long long)client->uid, aux_id);
+        client->evict();
+        return;
+    }
+    client->main_conn = it->second;
+    client->packet_in_conn = it->second;
+    it->second->aux.push_back(client);
+}
+
+/* Where PACKET_OUTs for a switch go: its first auxiliary connection, if any */
+Client *packet_channel(Client *client) {
+    return client->aux.empty() ? client : client->aux.front();
 }
 
-void handle_multipart_res(Client *client) {
+void handle_multipart_res(Client *client, const ofp_header_t *packet) {
     multipart_t *mp;
     port_t *ports;
-    size_t ndx, num_ports;
+    size_t ndx, num_ports, length;
     char port_name[16];
     uint32_t port_id;
 
-    mp = (multipart_t *)client->cur_packet->data;
-    if (ntohs(mp->type) != OFPMP_PORT_DESC) {
+    if (packet->length < sizeof(ofp_header_t) + sizeof(multipart_t)) {
         return;
     }
+    mp = (multipart_t *)packet->data;
+    length = packet->length - sizeof(ofp_header_t) - sizeof(multipart_t);
+    switch (ntohs(mp->type)) {
+        case OFPMP_PORT_DESC:
+            break;
+        case OFPMP_FLOW:
+            reconcile_flows(client, mp->body, length);
+            if (!(ntohs(mp->flags) & OFPMPF_REPLY_MORE)) {
+                reconciled(client, RECONCILE_FLOWS);
+            }
+            return;
+        case OFPMP_GROUP_DESC:
+            reconcile_groups(client, mp->body, length);
+            if (!(ntohs(mp->flags) & OFPMPF_REPLY_MORE)) {
+                reconciled(client, RECONCILE_GROUPS);
+            }
+            return;
+        default:
+            return;
+    }
 
     ports = (port_t *)mp->body;
-    num_ports = (client->cur_packet->length - sizeof(ofp_header_t) -
-                 sizeof(multipart_t)) /
-                sizeof(port_t);
+    num_ports = length / sizeof(port_t);
     for (ndx = 0; ndx < num_ports; ndx++) {
         snprintf(port_name, sizeof(port_name), "%s", ports[ndx].name);
         port_id = ntohl(ports[ndx].port_id);
         if (port_id <= OFPP_MAX) {
             client->ports.insert(port_id);
+            port_speed(client, port_id, ntohl(ports[ndx].cur_speed));
+        }
+    }
+    // A switch with more ports than fit in one reply sends several
+    if (!(ntohs(mp->flags) & OFPMPF_REPLY_MORE)) {
+        request_tables(client);
+    }
+}
+
+/*
+ * Ask a new switch for the rules and groups it already has, so that only
+ * what differs gets programmed; a switch that reconnects (or outlives a
+ * controller restart) usually still holds nearly all of them.
+ */
+void request_tables(Client *client) {
+    flow_stats_req_t *req;
+
+    client->reconciling = RECONCILE_FLOWS | RECONCILE_GROUPS;
+
+    MsgBuf buf = make_packet(
+        OFPT_MULTIPART_REQ,
+        sizeof(ofp_header_t) + sizeof(multipart_t) + sizeof(flow_stats_req_t),
+        RECONCILE_FLOWS_XID);
+    multipart_t *mp = (multipart_t *)((ofp_header_t *)buf.data)->data;
+    mp->type = htons(OFPMP_FLOW);
+    req = (flow_stats_req_t *)mp->body;
+    req->table_id = OFPTT_ALL;
+    req->out_port = htonl(OFPP_ANY);
+    req->out_group = htonl(OFPP_ANY);
+    req->match.type = htons(OFPMT_OXM);
+    req->match.length = htons(4);
+    client->write_packet(std::move(buf), LANE_CONTROL);
+
+    buf = make_packet(OFPT_MULTIPART_REQ,
+                      sizeof(ofp_header_t) + sizeof(multipart_t),
+                      RECONCILE_GROUPS_XID);
+    mp = (multipart_t *)((ofp_header_t *)buf.data)->data;
+    mp->type = htons(OFPMP_GROUP_DESC);
+    client->write_packet(std::move(buf), LANE_CONTROL);
+}
+
+/* Learn which of our table 1 rules the switch already has */
+void reconcile_flows(Client *client, const uint8_t *data, size_t length) {
+    while (length >= sizeof(flow_stats_t)) {
+        const flow_stats_t *stats = (const flow_stats_t *)data;
+        size_t stats_len = ntohs(stats->length);
+        size_t match_len = ntohs(stats->match.length);
+        size_t instr_off = offsetof(flow_stats_t, match) +
+                           (match_len + 7) / 8 * 8;
+        uint64_t mac;
+        uint8_t has_mac;
+        uint32_t out_port = 0, out_group = 0;
+
+        if (stats_len < sizeof(flow_stats_t) || stats_len > length ||
+            instr_off > stats_len) {
+            break;
+        }
+
+        has_mac = match_eth_dst(&stats->match, &mac);
+
+        /* The actions of its write/apply instructions */
+        size_t off = instr_off;
+        while (off + sizeof(instr_write_t) <= stats_len) {
+            const instr_write_t *instr = (const instr_write_t *)(data + off);
+            size_t instr_len = ntohs(instr->length);
+            if (instr_len < sizeof(instr_write_t) ||
+                off + instr_len > stats_len) {
+                break;
+            }
+            size_t act = off + sizeof(instr_write_t);
+            while (act + sizeof(action_group_t) <= off + instr_len) {
+                const action_output_t *action =
+                    (const action_output_t *)(data + act);
+                size_t act_len = ntohs(action->length);
+                if (act_len < sizeof(action_group_t)) {
+                    break;
+                }
+                if (ntohs(action->type) == OFPAT_OUTPUT &&
+                    act_len >= sizeof(action_output_t)) {
+                    out_port = ntohl(action->port);
+                } else if (ntohs(action->type) == OFPAT_GROUP) {
+                    const action_group_t *group =
+                        (const action_group_t *)action;
+                    out_group = ntohl(group->group_id);
+                }
+                act += act_len;
+            }
+            off += instr_len;
         }
+
+        if (stats->table_id == 1 && has_mac && out_port) {
+            client->written[mac] = out_port;
+        } else if (stats->table_id == 1 && has_mac && out_group) {
+            client->written[mac] = ECMP_HOP | out_group;
+        } else if (stats->table_id == 1 && out_group == BCAST_GROUP_ID) {
+            client->has_bcast_rule = 1;
+        }
+
+        data += stats_len;
+        length -= stats_len;
+    }
+}
+
+/*
+ * The ETH_DST a match is on, if any, keyed the way update_host_sp lays the
+ * address out. All we ever match on in table 1 is ETH_DST.
+ */
+uint8_t match_eth_dst(const match_t *match, uint64_t *mac) {
+    const uint8_t *oxm = match->oxm_fields;
+    const uint8_t *oxm_end = (const uint8_t *)match + ntohs(match->length);
+    int ndx;
+
+    while (oxm + 4 <= oxm_end) {
+        uint32_t oxm_header;
+        memcpy(&oxm_header, oxm, 4);
+        oxm_header = ntohl(oxm_header);
+        if (((oxm_header >> 9) & 0x7f) == OFPXMT_OFB_ETH_DST &&
+            (oxm_header & 0xff) == 6 && oxm + 10 <= oxm_end) {
+            *mac = 0;
+            for (ndx = 5; ndx >= 0; ndx--) {
+                *mac = (*mac << 8) | oxm[4 + ndx];
+            }
+            return 1;
+        }
+        oxm += 4 + (oxm_header & 0xff);
     }
-    god_function((Server *)client->server);
+    return 0;
+}
+
+/*
+ * Learn the broadcast groups' buckets, if the switch has kept them, and the
+ * ECMP groups it has kept
+ */
+void reconcile_groups(Client *client, const uint8_t *data, size_t length) {
+    while (length >= sizeof(group_desc_t)) {
+        const group_desc_t *desc = (const group_desc_t *)data;
+        size_t desc_len = ntohs(desc->length);
+        size_t off = sizeof(group_desc_t);
+        uint32_t group_id = ntohl(desc->group_id);
+        std::vector<uint32_t> ports;
+        std::set<uint32_t> chained;
+
+        if (desc_len < sizeof(group_desc_t) || desc_len > length) {
+            break;
+        }
+        while (off + sizeof(bucket_t) + sizeof(action_group_t) <= desc_len) {
+            const bucket_t *bucket = (const bucket_t *)(data + off);
+            const action_output_t *action =
+                (const action_output_t *)(bucket + 1);
+            size_t bucket_len = ntohs(bucket->len);
+            if (bucket_len < sizeof(bucket_t) + sizeof(action_group_t) ||
+                off + bucket_len > desc_len) {
+                break;
+            }
+            if (ntohs(action->type) == OFPAT_OUTPUT &&
+                bucket_len >= sizeof(bucket_t) + sizeof(action_output_t)) {
+                ports.push_back(ntohl(action->port));
+            } else if (ntohs(action->type) == OFPAT_GROUP) {
+                uint32_t chain_id =
+                    ntohl(((const action_group_t *)action)->group_id);
+                if (IS_BCAST_GROUP(chain_id)) {
+                    chained.insert(chain_id - BCAST_GROUP_ID);
+                }
+            }
+            off += bucket_len;
+        }
+
+        if (group_id == BCAST_GROUP_ID) {
+            client->has_mst = 1;
+            client->bcast_chunks[0].insert(ports.begin(), ports.end());
+            client->bcast_chained = chained;
+        } else if (IS_BCAST_GROUP(group_id)) {
+            client->bcast_chunks[group_id - BCAST_GROUP_ID].insert(
+                ports.begin(), ports.end());
+        } else if (desc->type == OFPGT_SELECT) {
+            std::sort(ports.begin(), ports.end());
+            if (off != desc_len || ports.empty()) {
+                // Not buckets we could have written; don't trust its rules
+                delete_group(client, group_id);
+            } else if (client->ecmp_groups.count(ports)) {
+                // Only one group per set of ports; its rules go with it
+                delete_group(client, group_id);
+            } else {
+                client->ecmp_groups[ports] = group_id;
+                client->ecmp_refs[group_id] = 0;
+            }
+            if (group_id >= client->next_ecmp_group) {
+                client->next_ecmp_group = group_id + 1;
+            }
+        }
+
+        data += desc_len;
+        length -= desc_len;
+    }
+}
+
+/*
+ * Count the host rules using each ECMP group the switch kept. A rule whose
+ * group is gone is as good as gone itself.
+ */
+void count_group_refs(Client *client) {
+    std::map<uint64_t, uint64_t>::iterator it;
+    std::map<uint32_t, unsigned>::iterator rit;
+
+    for (it = client->written.begin(); it != client->written.end();) {
+        if (!(it->second & ECMP_HOP)) {
+            it++;
+        } else if ((rit = client->ecmp_refs.find((uint32_t)it->second)) !=
+                   client->ecmp_refs.end()) {
+            rit->second++;
+            it++;
+        } else {
+            client->written.erase(it++);
+        }
+    }
+}
+
+/* One of the table dumps is complete; once both are, join the topology */
+void reconciled(Client *client, uint8_t which) {
+    if (!(client->reconciling & which)) {
+        return;
+    }
+    client->reconciling &= (uint8_t)~which;
+    if (client->reconciling) {
+        return;
+    }
+
+    Server *server = (Server *)client->server;
+    count_group_refs(client);
+    god_resync(client->uid);
+    god_reflood(client->uid);
+    god_function(server);
+    server->end_handshake(client);
     send_polls(client);
+    start_keepalive(client);
 }
 
-void handle_echo_req(Client *client) {
+void handle_echo_req(Client *client, const ofp_header_t *packet) {
     const ofp_header_t *req;
     ofp_header_t *res;
     uint16_t length;
 
-    req = client->cur_packet;
+    req = packet;
     /* We guarantee that a processed packet will never have
      * length < sizeof(ofp_header_t) */
     length = req->length;
 
-    res = make_packet(OFPT_ECHO_RES, length, client->cur_packet->xid);
+    MsgBuf buf = make_packet(OFPT_ECHO_RES, length, packet->xid);
+    res = (ofp_header_t *)buf.data;
     memcpy(res->data, req->data, length - sizeof(ofp_header_t));
 
-    client->write_packet(res, length);
+    client->write_packet(std::move(buf), LANE_CONTROL);
+}
+
+void send_echo_request(Client *client, uint32_t xid) {
+    client->write_packet(
+        make_packet(OFPT_ECHO_REQ, sizeof(ofp_header_t), xid), LANE_CONTROL);
+}
+
+void handle_echo_res(Client *client, const ofp_header_t *packet) {
+    echo_replied(client, packet->xid);
 }
 
-void handle_packet_in(Client *client) {
-    if (client->cur_packet->length <
+void handle_packet_in(Client *client, const ofp_header_t *packet) {
+    if (packet->length <
         sizeof(ofp_header_t) + sizeof(packet_in_t)) {
         fprintf(stderr, "packet_in too short\n");
         return;
     }
-    packet_in_t *pack = (packet_in_t *)client->cur_packet->data;
+    std::map<uint64_t, Client *>::iterator cit = client_table.find(client->uid);
+    if (cit == client_table.end() || cit->second != client) {
+        // Sent before the switch told us who it is; a beacon taken now would
+        // put a switch that is not there into the graph
+        return;
+    }
+    packet_in_t *pack = (packet_in_t *)packet->data;
     match_t *match = &pack->match;
     uint8_t *data =
         (uint8_t *)&pack->match + (ntohs(pack->match.length) + 7) / 8 * 8 + 2;
+    uint8_t *end = (uint8_t *)packet + packet->length;
+
+    /* Need at least the destination and source MACs */
+    if (data + 12 > end) {
+        return;
+    }
 
     uint32_t *fields = (uint32_t *)match->oxm_fields;
     /* We only care about PACKET_IN's that have the in port */
@@ -570,22 +1471,141 @@ void handle_packet_in(Client *client) {
                    ((uint64_t)data[8] << 24) | ((uint64_t)data[9] << 16) |
                    ((uint64_t)data[10] << 8) | data[11];
 
-    if (client->hosts[mac] != port_id) {
+    std::map<uint64_t, uint32_t>::iterator host = client->hosts.find(mac);
+    if (host == client->hosts.end()) {
+        if (server->num_hosts >= server->max_hosts) {
+            // Host table is full; still deliver the packet
+            forward_packet_in(client, pack, port_id, data,
+                              (size_t)(end - data));
+            return;
+        }
         client->hosts[mac] = port_id;
+        server->num_hosts++;
+        if (server->cluster != nullptr) {
+            server->cluster->host_up(client->uid, mac, port_id);
+        }
+        god_learn_host(client->uid, mac);
+        god_function(server);
+    } else if (host->second != port_id) {
+        host->second = port_id;
+        if (server->cluster != nullptr) {
+            server->cluster->host_up(client->uid, mac, port_id);
+        }
+        god_learn_host(client->uid, mac);
         god_function(server);
     }
+
+    forward_packet_in(client, pack, port_id, data, (size_t)(end - data));
+}
+
+/*
+ * Send the packet that missed on toward its destination, so the first packet
+ * of a flow is not lost while its rules are being written. It goes out of the
+ * port we route its destination MAC to, or down the broadcast tree if we have
+ * no route for it. A packet the switch buffered is released by its buffer_id.
+ */
+void forward_packet_in(Client *client, const packet_in_t *pack,
+                       uint32_t in_port, const uint8_t *data, size_t length) {
+    uint32_t buffer_id = ntohl(pack->buffer_id);
+    uint64_t dst = ((uint64_t)data[0] << 40) | ((uint64_t)data[1] << 32) |
+                   ((uint64_t)data[2] << 24) | ((uint64_t)data[3] << 16) |
+                   ((uint64_t)data[4] << 8) | data[5];
+    std::map<uint64_t, uint64_t>::const_iterator route;
+
+    if (buffer_id != OFP_NO_BUFFER) {
+        length = 0;
+    } else if (length < ntohs(pack->total_len)) {
+        // Cut short and not held by the switch, so there is nothing to send
+        return;
+    }
+
+    route = client->written.find(dst);
+    if (route != client->written.end() && (route->second & ECMP_HOP)) {
+        send_packet_in_out(client, buffer_id, in_port, OFPAT_GROUP,
+                           (uint32_t)route->second, data, (uint16_t)length);
+    } else if (route != client->written.end() && route->second != in_port) {
+        send_packet_in_out(client, buffer_id, in_port, OFPAT_OUTPUT,
+                           (uint32_t)route->second, data, (uint16_t)length);
+    } else if (route == client->written.end() && client->has_mst) {
+        send_packet_in_out(client, buffer_id, in_port, OFPAT_GROUP,
+                           BCAST_GROUP_ID, data, (uint16_t)length);
+    } else if (buffer_id != OFP_NO_BUFFER) {
+        // Back out the port it came in on, or nowhere: drop it, but the
+        // switch holds the buffer until told to
+        release_buffer(client, buffer_id, in_port);
+    }
+}
+
+/* A PACKET_OUT with no actions frees a buffered packet without sending it */
+void release_buffer(Client *client, uint32_t buffer_id, uint32_t in_port) {
+    MsgBuf buf = make_packet(OFPT_PACKET_OUT,
+                             sizeof(ofp_header_t) + sizeof(packet_out_t), 0);
+    packet_out_t *pack = (packet_out_t *)((ofp_header_t *)buf.data)->data;
+
+    pack->buffer_id = htonl(buffer_id);
+    pack->in_port = htonl(in_port);
+    packet_channel(client)->write_packet(std::move(buf), LANE_FLOW);
+}
+
+/* A PACKET_OUT of a missed packet, with one output or group action */
+void send_packet_in_out(Client *client, uint32_t buffer_id, uint32_t in_port,
+                        uint16_t action_type, uint32_t target,
+                        const uint8_t *data, uint16_t length) {
+    uint16_t action_len = action_type == OFPAT_OUTPUT
+                              ? (uint16_t)sizeof(action_output_t)
+                              : (uint16_t)sizeof(action_group_t);
+    uint16_t header_len =
+        (uint16_t)(sizeof(ofp_header_t) + sizeof(packet_out_t) + action_len);
+    MsgBuf buf = make_packet(OFPT_PACKET_OUT, header_len + length, 0);
+    ofp_header_t *hdr = (ofp_header_t *)buf.data;
+    packet_out_t *pack = (packet_out_t *)hdr->data;
+
+    pack->buffer_id = htonl(buffer_id);
+    pack->in_port = htonl(in_port);
+    pack->actions_len = htons(action_len);
+    if (action_type == OFPAT_OUTPUT) {
+        action_output_t *action = pack->actions;
+        action->type = htons(OFPAT_OUTPUT);
+        action->length = htons(action_len);
+        action->port = htonl(target);
+        action->max_len = htons(0xffff);
+    } else {
+        action_group_t *action = (action_group_t *)pack->actions;
+        action->type = htons(OFPAT_GROUP);
+        action->length = htons(action_len);
+        action->group_id = htonl(target);
+    }
+    memcpy(buf.data + header_len, data, length);
+
+    /*
+     * On the main connection, behind the flow mods for this switch, so they
+     * are in place first. An auxiliary connection is not ordered with them;
+     * a packet that beats its group is dropped, as if it had been shed.
+     */
+    packet_channel(client)->write_packet(std::move(buf), LANE_FLOW);
 }
 
 void send_packet_out(Client *client, uint32_t port, const void *data,
                      uint16_t length) {
+    static const MsgBuf tmpl = encode_packet_out();
+    uint16_t total_length = (uint16_t)(tmpl.size + length);
+    MsgBuf buf(tmpl.data, tmpl.size, total_length);
+
+    put16(buf.data + offsetof(ofp_header_t, length), total_length);
+    put32(buf.data + PACKET_OUT_PORT_OFFSET, port);
+    memcpy(buf.data + tmpl.size, data, length);
+
+    packet_channel(client)->write_packet(std::move(buf), LANE_DISCOVERY);
+}
+
+/* Everything of a PACKET_OUT before its payload, with the port to patch */
+MsgBuf encode_packet_out() {
     ofp_header_t *hdr;
     packet_out_t *pack;
     action_output_t *action;
-    uint16_t total_length;
 
-    total_length = sizeof(ofp_header_t) + sizeof(packet_out_t) +
-                   sizeof(action_output_t) + length;
-    hdr = make_packet(OFPT_PACKET_OUT, total_length, 0);
+    MsgBuf buf = make_packet(OFPT_PACKET_OUT, PACKET_OUT_HEADER_LENGTH, 0);
+    hdr = (ofp_header_t *)buf.data;
     pack = (packet_out_t *)hdr->data;
     action = pack->actions;
 
@@ -595,25 +1615,61 @@ void send_packet_out(Client *client, uint32_t port, const void *data,
 
     action->type = htons(OFPAT_OUTPUT);
     action->length = htons(sizeof(action_output_t));
-    action->port = htonl(port);
     action->max_len = htons(0xffff);
 
-    memcpy((uint8_t *)action + sizeof(action_output_t), data, length);
+    return buf;
+}
+
+/*
+ * A host's rule timed out where it is attached: nothing has been sent to it
+ * for a while, so it is forgotten everywhere. It is learned again from its
+ * next packet. Only that rule has timeouts.
+ */
+void handle_flow_removed(Client *client, const ofp_header_t *packet) {
+    const flow_removed_t *pack;
+    uint64_t mac;
+
+    if (packet->length < sizeof(ofp_header_t) + sizeof(flow_removed_t)) {
+        fprintf(stderr, "flow_removed too short\n");
+        return;
+    }
+    pack = (flow_removed_t *)packet->data;
+    if (packet->length < sizeof(ofp_header_t) +
+                             offsetof(flow_removed_t, match) +
+                             ntohs(pack->match.length)) {
+        fprintf(stderr, "flow_removed too short\n");
+        return;
+    }
 
-    client->write_packet(hdr, total_length);
+    // Deletes are our own doing, and already accounted for
+    if (pack->reason == OFPRR_DELETE || pack->table_id != 1 ||
+        !match_eth_dst(&pack->match, &mac)) {
+        return;
+    }
+
+    Server *server = (Server *)client->server;
+    forget_written(client, mac);
+    if (client->hosts.erase(mac)) {
+        server->num_hosts--;
+        if (server->cluster != nullptr) {
+            server->cluster->host_down(client->uid, mac);
+        }
+        god_forget_host(server, mac);
+    }
+    god_function(server);
 }
 
-void handle_port_status(Client *client) {
+void handle_port_status(Client *client, const ofp_header_t *packet) {
     const port_status_t *pack;
 
-    if (client->cur_packet->length <
+    if (packet->length <
         sizeof(ofp_header_t) + sizeof(port_status_t)) {
         fprintf(stderr, "port_status too short\n");
         return;
     }
-    pack = (port_status_t *)client->cur_packet->data;
+    pack = (port_status_t *)packet->data;
 
-    uint32_t port = pack->port.port_id;
+    uint32_t port = ntohl(pack->port.port_id);
     if (port > OFPP_MAX) {
         return;
     }
@@ -621,15 +1677,28 @@ void handle_port_status(Client *client) {
     switch (pack->reason) {
         case PORT_ADD:
             client->ports.insert(port);
+            port_speed(client, port, ntohl(pack->port.cur_speed));
+            god_reflood(client->uid);
+            god_function((Server *)client->server);
             break;
         case PORT_DEL:
-            port_down(client, port);
             client->ports.erase(port);
+            god_reflood(client->uid);
+            port_down(client, port);
+            god_function((Server *)client->server);
             break;
         case PORT_MOD:
             if (pack->port.state & 1) {
                 //port_down(client, port);
             }
+            port_speed(client, port, ntohl(pack->port.cur_speed));
             break;
     }
 }
+
+void handle_barrier_res(Client *client, const ofp_header_t *packet) {
+    if (client->fence_xid && client->fence_xid == packet->xid) {
+        drop_unused_groups(client);
+    }
+    fence_acked(client, packet->xid);
+}
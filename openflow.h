@@ -3,20 +3,41 @@
 
 #include <stdint.h>
 #include <map>
+#include <vector>
 #include "client.h"
 
 extern std::set<uint64_t> seen_hosts;
 extern std::map<uint64_t, Client *> client_table;
 
-enum ofp_group_mod_command { OFPGC_ADD = 0, OFPGC_MODIFY = 1 };
-enum flow_mod_cmd { FM_CMD_ADD = 0, FM_CMD_MODIFY = 1 };
+/* Flood ports per broadcast group; each further chunk has a group of its own */
+#define BCAST_CHUNK_PORTS 256
+
+enum ofp_group_mod_command {
+    OFPGC_ADD = 0,
+    OFPGC_MODIFY = 1,
+    OFPGC_DELETE = 2
+};
+enum flow_mod_cmd {
+    FM_CMD_ADD = 0,
+    FM_CMD_MODIFY = 1,
+    FM_CMD_DELETE_STRICT = 4
+};
 
 void init_connection(Client *);
-void handle_ofp_packet(Client *);
+void handle_ofp_packet(Client *, const ofp_header_t *);
 void add_broadcast_rule(Client *);
 void send_packet_out(Client *, uint32_t, const void *, uint16_t);
-void update_broadcast_group(Client *, const std::set<uint32_t> *, uint16_t);
+void update_broadcast_group(Client *, uint32_t, const std::set<uint32_t> *,
+                            const std::set<uint32_t> *, uint16_t);
+uint32_t add_ecmp_group(Client *, const std::vector<uint32_t> *);
+void delete_group(Client *, uint32_t);
+void send_barrier(Client *, uint32_t);
+void send_echo_request(Client *, uint32_t);
 void add_dest_mac_rule(Client *, const void *mac, uint32_t port_id, uint8_t cmd,
                        uint8_t table_id);
+void add_attached_host_rule(Client *, const void *mac, uint32_t port_id,
+                            uint8_t cmd);
+void add_dest_mac_group_rule(Client *, const void *mac, uint32_t group_id,
+                             uint8_t cmd);
 
 #endif /* OPENFLOW_H_ */
@@ -0,0 +1,204 @@
+#include "pool.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+
+// Size classes are powers of two from 64 bytes to 16KiB
+#define MIN_CLASS_SHIFT 6
+#define NUM_CLASSES 9
+#define LARGE_CLASS 0xffffffff
+
+#define SLAB_SIZE (256 * 1024)
+
+// Free blocks a thread keeps per class, and how many move to the depot at once
+#define CACHE_LIMIT 512
+#define DEPOT_BATCH 128
+
+// Sits in front of every block; the free list link lives in the data after it
+typedef struct {
+    uint32_t cls;
+    uint32_t _pad;
+} block_header_t;
+
+typedef struct free_block {
+    struct free_block* next;
+} free_block_t;
+
+typedef struct {
+    free_block_t* head[NUM_CLASSES];
+    unsigned count[NUM_CLASSES];
+} pool_cache_t;
+
+static thread_local pool_cache_t cache;
+
+static std::mutex depot_lock;
+static free_block_t* depot[NUM_CLASSES];
+
+static unsigned size_class(size_t);
+static void refill(unsigned);
+static void spill(unsigned);
+
+/* Smallest class that holds size bytes, or LARGE_CLASS */
+unsigned size_class(size_t size) {
+    unsigned cls = 0;
+
+    while (cls < NUM_CLASSES && ((size_t)1 << (cls + MIN_CLASS_SHIFT)) < size) {
+        cls++;
+    }
+    return cls < NUM_CLASSES ? cls : LARGE_CLASS;
+}
+
+void* pool_alloc(size_t size) {
+    unsigned cls = size_class(size);
+    block_header_t* hdr;
+    free_block_t* block;
+
+    if (cls == LARGE_CLASS) {
+        if ((hdr = (block_header_t*)malloc(sizeof(*hdr) + size)) == nullptr) {
+            perror("malloc");
+            exit(-1);
+        }
+        hdr->cls = LARGE_CLASS;
+        return hdr + 1;
+    }
+
+    if (cache.head[cls] == nullptr) {
+        refill(cls);
+    }
+    block = cache.head[cls];
+    cache.head[cls] = block->next;
+    cache.count[cls]--;
+
+    hdr = (block_header_t*)block - 1;
+    hdr->cls = cls;
+    return block;
+}
+
+void pool_free(void* ptr) {
+    block_header_t* hdr;
+    free_block_t* block = (free_block_t*)ptr;
+    unsigned cls;
+
+    if (ptr == nullptr) {
+        return;
+    }
+    hdr = (block_header_t*)ptr - 1;
+    cls = hdr->cls;
+    if (cls == LARGE_CLASS) {
+        free(hdr);
+        return;
+    }
+
+    block->next = cache.head[cls];
+    cache.head[cls] = block;
+    if (++cache.count[cls] > CACHE_LIMIT) {
+        spill(cls);
+    }
+}
+
+/* Restock this thread's free list from the depot, or from a new slab */
+void refill(unsigned cls) {
+    size_t block_size = sizeof(block_header_t) +
+                        ((size_t)1 << (cls + MIN_CLASS_SHIFT));
+    free_block_t* block;
+    uint8_t* slab;
+    size_t ndx;
+
+    {
+        std::lock_guard<std::mutex> guard(depot_lock);
+        for (ndx = 0; ndx < DEPOT_BATCH && depot[cls] != nullptr; ndx++) {
+            block = depot[cls];
+            depot[cls] = block->next;
+            block->next = cache.head[cls];
+            cache.head[cls] = block;
+            cache.count[cls]++;
+        }
+    }
+    if (cache.head[cls] != nullptr) {
+        return;
+    }
+
+    if ((slab = (uint8_t*)malloc(SLAB_SIZE)) == nullptr) {
+        perror("malloc");
+        exit(-1);
+    }
+    // Keep a batch; the rest would only be spilled again on the next free
+    std::lock_guard<std::mutex> guard(depot_lock);
+    for (ndx = 0; ndx + block_size <= SLAB_SIZE; ndx += block_size) {
+        block = (free_block_t*)(slab + ndx + sizeof(block_header_t));
+        if (cache.count[cls] < DEPOT_BATCH) {
+            block->next = cache.head[cls];
+            cache.head[cls] = block;
+            cache.count[cls]++;
+        } else {
+            block->next = depot[cls];
+            depot[cls] = block;
+        }
+    }
+}
+
+/* Give a batch of this thread's surplus blocks to the depot */
+void spill(unsigned cls) {
+    free_block_t *first = cache.head[cls], *last = first;
+    unsigned ndx;
+
+    for (ndx = 1; ndx < DEPOT_BATCH; ndx++) {
+        last = last->next;
+    }
+    cache.head[cls] = last->next;
+    cache.count[cls] -= DEPOT_BATCH;
+
+    std::lock_guard<std::mutex> guard(depot_lock);
+    last->next = depot[cls];
+    depot[cls] = first;
+}
+
+MsgBuf::MsgBuf() {
+    data = nullptr;
+    size = 0;
+}
+
+/* A zeroed buffer of size bytes */
+MsgBuf::MsgBuf(uint16_t s) {
+    data = (uint8_t*)pool_alloc(s);
+    size = s;
+    memset(data, 0, s);
+}
+
+/* A copy of len bytes at src, such as a pre-encoded message */
+MsgBuf::MsgBuf(const void* src, uint16_t len) {
+    data = (uint8_t*)pool_alloc(len);
+    size = len;
+    memcpy(data, src, len);
+}
+
+/* A size byte buffer starting with a copy of len bytes; the rest is unset */
+MsgBuf::MsgBuf(const void* src, uint16_t len, uint16_t s) {
+    data = (uint8_t*)pool_alloc(s);
+    size = s;
+    memcpy(data, src, len);
+}
+
+MsgBuf::MsgBuf(MsgBuf&& other) {
+    data = other.data;
+    size = other.size;
+    other.data = nullptr;
+    other.size = 0;
+}
+
+MsgBuf& MsgBuf::operator=(MsgBuf&& other) {
+    if (this != &other) {
+        pool_free(data);
+        data = other.data;
+        size = other.size;
+        other.data = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+MsgBuf::~MsgBuf() {
+    pool_free(data);
+}
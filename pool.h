@@ -0,0 +1,33 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Size-classed message pool. Blocks are carved out of large slabs and kept
+ * on per-thread free lists, so allocating and freeing a message is a couple
+ * of pointer moves. A thread that frees more than it allocates (a reactor
+ * sending messages the owner built) hands the surplus to a shared depot in
+ * batches, where allocating threads pick it back up.
+ */
+void* pool_alloc(size_t);
+void pool_free(void*);
+
+/* An outbound message buffer from the pool, with exactly one owner */
+class MsgBuf {
+   public:
+    MsgBuf();
+    explicit MsgBuf(uint16_t);
+    MsgBuf(const void*, uint16_t);
+    MsgBuf(const void*, uint16_t, uint16_t);
+    MsgBuf(MsgBuf&&);
+    MsgBuf& operator=(MsgBuf&&);
+    MsgBuf(const MsgBuf&) = delete;
+    MsgBuf& operator=(const MsgBuf&) = delete;
+    ~MsgBuf();
+    uint8_t* data;  // nullptr once moved from
+    uint16_t size;
+};
+
+#endif /* POOL_H_ */
@@ -0,0 +1,29 @@
+#include "ratelimit.h"
+
+TokenBucket::TokenBucket() : TokenBucket(0, 0) {
+}
+
+TokenBucket::TokenBucket(uint32_t r, uint32_t b) {
+    rate = r;
+    burst = b;
+    tokens = (uint64_t)b * 1000;
+    last = 0;
+}
+
+/* Take one token at time now_ms; returns 0 if the bucket is empty */
+uint8_t TokenBucket::take(uint64_t now_ms) {
+    uint64_t full = (uint64_t)burst * 1000;
+
+    if (now_ms > last) {
+        tokens += (now_ms - last) * rate;
+        if (tokens > full) {
+            tokens = full;
+        }
+        last = now_ms;
+    }
+    if (tokens < 1000) {
+        return 0;
+    }
+    tokens -= 1000;
+    return 1;
+}
@@ -0,0 +1,24 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#include <stdint.h>
+
+/*
+ * Token bucket: holds up to burst tokens and gains rate tokens per second.
+ * Tokens are kept in thousandths, so refilling on every millisecond tick
+ * loses nothing to rounding at low rates.
+ */
+class TokenBucket {
+   public:
+    TokenBucket();
+    TokenBucket(uint32_t, uint32_t);
+    uint8_t take(uint64_t);
+
+   private:
+    uint64_t tokens;  // thousandths of a token
+    uint64_t last;    // ms of the last refill
+    uint32_t rate;    // tokens per second
+    uint32_t burst;
+};
+
+#endif /* RATELIMIT_H_ */
@@ -0,0 +1,511 @@
+#include "routes.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
+
+// Switches waiting to be looked at, nearest to the destination first
+typedef std::pair<uint32_t, uint32_t> hop_t;  // cost, vertex
+typedef std::priority_queue<hop_t, std::vector<hop_t>, std::greater<hop_t> >
+    hop_queue_t;
+
+#define FILL_BATCH 64  // new destinations filled together, a bit each
+
+static uint8_t supported(const Graph&, const uint32_t*,
+                         const std::set<uint32_t>&, uint32_t);
+static uint32_t nearest(const Graph&, const uint32_t*, uint32_t);
+
+RouteTable::RouteTable() {
+    epoch = 0;
+    stride = 0;
+}
+
+/* Make room in every row for vertices switches, moving the rows if needed */
+void RouteTable::reserve(uint32_t vertices) {
+    uint32_t row, old_stride = stride;
+
+    if (rows.size() < vertices) {
+        rows.resize(vertices, NO_ROW);
+    }
+    if (vertices <= stride) {
+        return;
+    }
+    stride = stride * 2 > vertices ? stride * 2 : vertices;
+
+    std::vector<uint32_t> old_dist, old_next;
+    std::vector<uint64_t> old_ways, old_stamp;
+    old_dist.swap(dist);
+    old_next.swap(next);
+    old_ways.swap(ways);
+    old_stamp.swap(stamp);
+    dist.assign(dests.size() * stride, NO_ROUTE);
+    next.assign(dests.size() * stride, NO_ROUTE);
+    ways.assign(dests.size() * stride, 0);
+    stamp.assign(dests.size() * stride, 0);
+    for (row = 0; row < dests.size(); row++) {
+        std::copy(old_dist.begin() + row * old_stride,
+                  old_dist.begin() + (row + 1) * old_stride,
+                  dist.begin() + row * stride);
+        std::copy(old_next.begin() + row * old_stride,
+                  old_next.begin() + (row + 1) * old_stride,
+                  next.begin() + row * stride);
+        std::copy(old_ways.begin() + row * old_stride,
+                  old_ways.begin() + (row + 1) * old_stride,
+                  ways.begin() + row * stride);
+        std::copy(old_stamp.begin() + row * old_stride,
+                  old_stamp.begin() + (row + 1) * old_stride,
+                  stamp.begin() + row * stride);
+    }
+}
+
+/* Start following dest; its row is computed by the next update */
+void RouteTable::track(uint32_t dest) {
+    uint32_t row;
+
+    reserve(dest + 1);
+    // Reuse the row of a destination no longer followed
+    row = 0;
+    while (row < dests.size() && dests[row] != NO_VERTEX) {
+        row++;
+    }
+    if (row == dests.size()) {
+        dests.push_back(NO_VERTEX);
+        marked.push_back(0);
+        unfilled.push_back(0);
+        dist.resize(dist.size() + stride, NO_ROUTE);
+        next.resize(next.size() + stride, NO_ROUTE);
+        ways.resize(ways.size() + stride, 0);
+        stamp.resize(stamp.size() + stride, 0);
+    }
+    dests[row] = dest;
+    rows[dest] = row;
+    marked[row] = epoch;
+    unfilled[row] = 1;
+}
+
+/*
+ * Breadth-first out from up to FILL_BATCH new destinations at once, one bit
+ * of a word per destination, when every link costs the same unit. Each
+ * level, a switch takes the bits of its neighbors' frontiers it has not seen
+ * yet; the first neighbor, in port order, to offer a bit is that
+ * destination's next hop from it, the same lowest port on a cheapest path
+ * that repairs pick, and any later one offering it on the same level is
+ * another way.
+ */
+void RouteTable::fill(const Graph& graph, const std::vector<uint32_t>& batch,
+                      uint32_t unit, std::vector<route_change_t>* changes) {
+    uint32_t vertices = graph.num_vertices(), vertex, hops, ndx;
+    uint64_t all = batch.size() == 64 ? ~0ULL : (1ULL << batch.size()) - 1;
+    std::vector<uint64_t> seen(vertices, 0), frontier(vertices, 0),
+        reached(vertices, 0);
+    uint64_t any;
+
+    for (ndx = 0; ndx < batch.size(); ndx++) {
+        uint32_t row = batch[ndx], dest = dests[row];
+        std::fill(dist.begin() + row * stride,
+                  dist.begin() + (row + 1) * stride, NO_ROUTE);
+        std::fill(next.begin() + row * stride,
+                  next.begin() + (row + 1) * stride, NO_ROUTE);
+        std::fill(ways.begin() + row * stride,
+                  ways.begin() + (row + 1) * stride, 0);
+        std::fill(stamp.begin() + row * stride,
+                  stamp.begin() + (row + 1) * stride, epoch);
+        dist[row * stride + dest] = 0;
+        seen[dest] |= 1ULL << ndx;
+        frontier[dest] |= 1ULL << ndx;
+        unfilled[row] = 0;
+    }
+
+    for (hops = 1;; hops++) {
+        any = 0;
+        for (vertex = 0; vertex < vertices; vertex++) {
+            uint64_t fresh = 0, bits;
+            uint32_t first[FILL_BATCH];  // by bit: index of its first edge
+            if (seen[vertex] != all) {
+                const std::vector<edge_t>& edges = graph.neighbors(vertex);
+                for (ndx = 0; ndx < edges.size(); ndx++) {
+                    uint64_t offered = frontier[edges[ndx].to] & ~seen[vertex];
+                    for (bits = offered & fresh; bits; bits &= bits - 1) {
+                        unsigned bit = (unsigned)__builtin_ctzll(bits);
+                        uint32_t entry = batch[bit] * stride + vertex;
+                        if (ndx - first[bit] < 64) {
+                            ways[entry] |= 1ULL << (ndx - first[bit]);
+                        }
+                    }
+                    for (bits = offered & ~fresh; bits; bits &= bits - 1) {
+                        unsigned bit = (unsigned)__builtin_ctzll(bits);
+                        uint32_t entry = batch[bit] * stride + vertex;
+                        first[bit] = ndx;
+                        dist[entry] = hops * unit;
+                        next[entry] = edges[ndx].port;
+                        ways[entry] = 1;
+                    }
+                    fresh |= offered;
+                }
+            }
+            for (bits = fresh; bits; bits &= bits - 1) {
+                uint32_t row = batch[(unsigned)__builtin_ctzll(bits)];
+                route_change_t change;
+                change.vertex = vertex;
+                change.dest = dests[row];
+                change.port = next[row * stride + vertex];
+                change.ways = ways[row * stride + vertex];
+                changes->push_back(change);
+            }
+            reached[vertex] = fresh;
+            any |= fresh;
+        }
+        if (any == 0) {
+            break;
+        }
+        for (vertex = 0; vertex < vertices; vertex++) {
+            seen[vertex] |= reached[vertex];
+        }
+        frontier.swap(reached);
+    }
+}
+
+/* Dijkstra out from a new destination, for links of differing costs */
+void RouteTable::fill_weighted(const Graph& graph, uint32_t row,
+                               std::vector<route_change_t>* changes) {
+    uint32_t dest = dests[row];
+    uint32_t* row_dist = &dist[row * stride];
+    uint32_t* row_next = &next[row * stride];
+    uint64_t* row_ways = &ways[row * stride];
+    std::vector<uint32_t> order;
+    std::vector<uint32_t>::iterator it;
+    hop_queue_t queue;
+
+    std::fill(row_dist, row_dist + stride, NO_ROUTE);
+    std::fill(row_next, row_next + stride, NO_ROUTE);
+    std::fill(row_ways, row_ways + stride, 0);
+    std::fill(stamp.begin() + row * stride, stamp.begin() + (row + 1) * stride,
+              epoch);
+
+    queue.push(hop_t(0, dest));
+    while (!queue.empty()) {
+        hop_t hop = queue.top();
+        queue.pop();
+        if (row_dist[hop.second] != NO_ROUTE) {
+            continue;
+        }
+        row_dist[hop.second] = hop.first;
+        order.push_back(hop.second);
+        const std::vector<edge_t>& edges = graph.neighbors(hop.second);
+        std::vector<edge_t>::const_iterator eit;
+        for (eit = edges.begin(); eit != edges.end(); eit++) {
+            if (row_dist[eit->to] == NO_ROUTE) {
+                queue.push(hop_t(hop.first + eit->cost, eit->to));
+            }
+        }
+    }
+
+    for (it = order.begin() + 1; it < order.end(); it++) {
+        route_change_t change;
+        change.vertex = *it;
+        change.dest = dest;
+        change.port = pick_next(graph, row_dist, change.vertex, &change.ways);
+        row_next[change.vertex] = change.port;
+        row_ways[change.vertex] = change.ways;
+        changes->push_back(change);
+    }
+    unfilled[row] = 0;
+}
+
+void RouteTable::untrack(uint32_t dest) {
+    if (tracking(dest)) {
+        dests[rows[dest]] = NO_VERTEX;
+        rows[dest] = NO_ROW;
+    }
+}
+
+uint8_t RouteTable::tracking(uint32_t dest) const {
+    return dest < rows.size() && rows[dest] != NO_ROW;
+}
+
+/*
+ * On the owner: sort out the switches whose links changed since the last
+ * update, taken from the graph, and make room for switches added since,
+ * which start out unreachable
+ */
+void RouteTable::begin_update(const Graph& graph,
+                              std::vector<uint32_t>* touched) {
+    std::sort(touched->begin(), touched->end());
+    touched->erase(std::unique(touched->begin(), touched->end()),
+                   touched->end());
+
+    reserve(graph.num_vertices());
+    epoch++;
+}
+
+/*
+ * Fill the new rows, and repair the rest around the touched switches, of
+ * every row in this part: those whose index is part modulo parts
+ */
+void RouteTable::update_part(const Graph& graph,
+                             const std::vector<uint32_t>& touched,
+                             unsigned part, unsigned parts,
+                             std::vector<route_change_t>* changes) {
+    std::vector<uint32_t> batch;
+    uint32_t row, unit = graph.uniform_cost();
+
+    for (row = part; row < dests.size(); row += parts) {
+        if (dests[row] == NO_VERTEX) {
+            continue;
+        }
+        if (unfilled[row] && unit == 0) {
+            fill_weighted(graph, row, changes);
+        } else if (unfilled[row]) {
+            batch.push_back(row);
+            if (batch.size() == FILL_BATCH) {
+                fill(graph, batch, unit, changes);
+                batch.clear();
+            }
+        } else if (!touched.empty()) {
+            repair(graph, row, touched, changes);
+        }
+    }
+    if (!batch.empty()) {
+        fill(graph, batch, unit, changes);
+    }
+}
+
+/* Something about dest besides its paths changed, such as its hosts */
+void RouteTable::mark(uint32_t dest) {
+    if (tracking(dest)) {
+        marked[rows[dest]] = ++epoch;
+    }
+}
+
+uint32_t RouteTable::next_hop(uint32_t vertex, uint32_t dest) const {
+    if (!tracking(dest) || vertex >= stride) {
+        return NO_ROUTE;
+    }
+    return next[rows[dest] * stride + vertex];
+}
+
+/*
+ * Every port vertex reaches dest over at equal cost, lowest first; graph is
+ * the one the table was last computed over
+ */
+void RouteTable::next_hops(const Graph& graph, uint32_t vertex, uint32_t dest,
+                           std::vector<uint32_t>* ports) const {
+    uint32_t port = next_hop(vertex, dest);
+
+    ports->clear();
+    if (port != NO_ROUTE) {
+        hop_ports(graph, vertex, port, ways[rows[dest] * stride + vertex],
+                  ports);
+    }
+}
+
+// The ports a next hop and its ways stand for
+void RouteTable::hop_ports(const Graph& graph, uint32_t vertex, uint32_t port,
+                           uint64_t hop_ways, std::vector<uint32_t>* ports) {
+    const std::vector<edge_t>& edges = graph.neighbors(vertex);
+    size_t first = 0;
+
+    ports->clear();
+    while (first < edges.size() && edges[first].port != port) {
+        first++;
+    }
+    for (; hop_ways != 0; hop_ways &= hop_ways - 1) {
+        size_t ndx = first + (unsigned)__builtin_ctzll(hop_ways);
+        if (ndx < edges.size()) {
+            ports->push_back(edges[ndx].port);
+        }
+    }
+}
+
+// Has vertex's route to dest, or dest itself, changed after epoch since?
+uint8_t RouteTable::changed_since(uint32_t vertex, uint32_t dest,
+                                  uint64_t since) const {
+    if (!tracking(dest) || vertex >= stride) {
+        return 0;
+    }
+    return stamp[rows[dest] * stride + vertex] > since ||
+           marked[rows[dest]] > since;
+}
+
+void RouteTable::destinations(std::vector<uint32_t>* found) const {
+    std::vector<uint32_t>::const_iterator it;
+
+    for (it = dests.begin(); it != dests.end(); it++) {
+        if (*it != NO_VERTEX) {
+            found->push_back(*it);
+        }
+    }
+}
+
+void RouteTable::repair(const Graph& graph, uint32_t row,
+                        const std::vector<uint32_t>& touched,
+                        std::vector<route_change_t>* changes) {
+    uint32_t dest = dests[row];
+    uint32_t* row_dist = &dist[row * stride];
+    uint32_t* row_next = &next[row * stride];
+    uint64_t* row_ways = &ways[row * stride];
+    uint64_t* row_stamp = &stamp[row * stride];
+    std::set<uint32_t> cut, moved, recheck;
+    std::set<uint32_t>::iterator sit;
+    std::vector<uint32_t>::const_iterator tit;
+    std::vector<edge_t>::const_iterator eit;
+    hop_queue_t queue;
+
+    /*
+     * Cut loose every switch left with no neighbor on a cheapest path. Going
+     * out from the destination, a switch's support is settled before anything
+     * further out relies on it.
+     */
+    for (tit = touched.begin(); tit != touched.end(); tit++) {
+        if (*tit != dest && row_dist[*tit] != NO_ROUTE) {
+            queue.push(hop_t(row_dist[*tit], *tit));
+        }
+    }
+    while (!queue.empty()) {
+        hop_t hop = queue.top();
+        queue.pop();
+        if (cut.count(hop.second) ||
+            supported(graph, row_dist, cut, hop.second)) {
+            continue;
+        }
+        cut.insert(hop.second);
+        const std::vector<edge_t>& edges = graph.neighbors(hop.second);
+        for (eit = edges.begin(); eit != edges.end(); eit++) {
+            if (row_dist[eit->to] == hop.first + eit->cost &&
+                !cut.count(eit->to)) {
+                queue.push(hop_t(hop.first + eit->cost, eit->to));
+            }
+        }
+    }
+
+    /*
+     * Reach the cut switches again from what is left, and let new links pull
+     * their ends closer; either spreads to whatever is behind them.
+     */
+    for (sit = cut.begin(); sit != cut.end(); sit++) {
+        row_dist[*sit] = NO_ROUTE;
+        moved.insert(*sit);
+    }
+    for (sit = cut.begin(); sit != cut.end(); sit++) {
+        uint32_t cost = nearest(graph, row_dist, *sit);
+        if (cost != NO_ROUTE) {
+            queue.push(hop_t(cost, *sit));
+        }
+    }
+    for (tit = touched.begin(); tit != touched.end(); tit++) {
+        uint32_t cost = nearest(graph, row_dist, *tit);
+        if (*tit != dest && cost < row_dist[*tit]) {
+            queue.push(hop_t(cost, *tit));
+        }
+    }
+    while (!queue.empty()) {
+        hop_t hop = queue.top();
+        queue.pop();
+        if (hop.first >= row_dist[hop.second]) {
+            continue;
+        }
+        row_dist[hop.second] = hop.first;
+        moved.insert(hop.second);
+        const std::vector<edge_t>& edges = graph.neighbors(hop.second);
+        for (eit = edges.begin(); eit != edges.end(); eit++) {
+            if (hop.first + eit->cost < row_dist[eit->to]) {
+                queue.push(hop_t(hop.first + eit->cost, eit->to));
+            }
+        }
+    }
+
+    /*
+     * Only a switch that moved, one next to it, or one whose links changed
+     * can have different next hops. The edges of one whose links changed
+     * may have moved under its ways, so it always goes out again.
+     */
+    recheck.insert(touched.begin(), touched.end());
+    for (sit = moved.begin(); sit != moved.end(); sit++) {
+        recheck.insert(*sit);
+        const std::vector<edge_t>& edges = graph.neighbors(*sit);
+        for (eit = edges.begin(); eit != edges.end(); eit++) {
+            recheck.insert(eit->to);
+        }
+    }
+    for (sit = recheck.begin(); sit != recheck.end(); sit++) {
+        route_change_t change;
+        if (*sit == dest) {
+            continue;
+        }
+        change.port = pick_next(graph, row_dist, *sit, &change.ways);
+        if (change.port != row_next[*sit] || change.ways != row_ways[*sit] ||
+            std::binary_search(touched.begin(), touched.end(), *sit)) {
+            row_next[*sit] = change.port;
+            row_ways[*sit] = change.ways;
+            row_stamp[*sit] = epoch;
+            change.vertex = *sit;
+            change.dest = dest;
+            changes->push_back(change);
+        }
+    }
+}
+
+/*
+ * The lowest port on a cheapest path to the destination, and in ways, that
+ * edge and every later one also on one
+ */
+uint32_t RouteTable::pick_next(const Graph& graph, const uint32_t* row_dist,
+                               uint32_t vertex, uint64_t* ways) {
+    uint32_t cost = row_dist[vertex], port = NO_ROUTE;
+    const std::vector<edge_t>& edges = graph.neighbors(vertex);
+    size_t ndx, first = 0;
+
+    *ways = 0;
+    if (cost == NO_ROUTE || cost == 0) {
+        return NO_ROUTE;
+    }
+    for (ndx = 0; ndx < edges.size(); ndx++) {
+        const edge_t& edge = edges[ndx];
+        if (row_dist[edge.to] == NO_ROUTE ||
+            row_dist[edge.to] + edge.cost != cost) {
+            continue;
+        }
+        if (port == NO_ROUTE) {
+            port = edge.port;
+            first = ndx;
+        }
+        if (ndx - first < 64) {
+            *ways |= 1ULL << (ndx - first);
+        }
+    }
+    return port;
+}
+
+// Does vertex still have a neighbor, not itself cut, on a cheapest path?
+uint8_t supported(const Graph& graph, const uint32_t* dist,
+                  const std::set<uint32_t>& cut, uint32_t vertex) {
+    const std::vector<edge_t>& edges = graph.neighbors(vertex);
+    std::vector<edge_t>::const_iterator it;
+
+    for (it = edges.begin(); it != edges.end(); it++) {
+        if (dist[it->to] != NO_ROUTE &&
+            dist[it->to] + it->cost == dist[vertex] && !cut.count(it->to)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Distance through vertex's closest neighbor, or NO_ROUTE if it has none
+uint32_t nearest(const Graph& graph, const uint32_t* dist,
+                 uint32_t vertex) {
+    const std::vector<edge_t>& edges = graph.neighbors(vertex);
+    std::vector<edge_t>::const_iterator it;
+    uint32_t best = NO_ROUTE;
+
+    for (it = edges.begin(); it != edges.end(); it++) {
+        if (dist[it->to] != NO_ROUTE && dist[it->to] + it->cost < best) {
+            best = dist[it->to] + it->cost;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,92 @@
+#ifndef ROUTES_H_
+#define ROUTES_H_
+
+#include <stdint.h>
+#include <vector>
+#include "graph.h"
+
+#define NO_ROUTE 0xffffffff
+#define NO_ROW 0xffffffff
+
+// A switch's next hops toward a destination switch changed
+typedef struct {
+    uint32_t vertex;
+    uint32_t dest;
+    uint32_t port;  // NO_ROUTE once the destination is unreachable from it
+    uint64_t ways;  // equal-cost edges, from port's on; see RouteTable
+} route_change_t;
+
+/*
+ * Cheapest paths to every switch that has hosts, kept up to date as links
+ * come and go and change cost. For each destination there is a path cost and
+ * a next hop per switch; the next hop is the lowest port on a cheapest path,
+ * so it depends only on the costs, never on the order things happened in.
+ * Every host on a destination switch is routed by that switch's next hops.
+ *
+ * Every port on a cheapest path is kept as well, for ECMP: a mask over the
+ * switch's edges in port order, bit 0 being the next hop's edge, so up to 64
+ * ways. It is only meaningful against the graph the table was computed over;
+ * next_hops and hop_ports turn it into ports.
+ *
+ * A change to the graph repairs each destination's tree around the switches
+ * whose links changed: the ones left without a cheapest way on, and
+ * those that had relied on them, are cut loose and re-reached from their
+ * neighbors, and a new link lets its ends, and whatever is behind them, move
+ * closer. Only switches whose cost changed, and their neighbors, are
+ * looked at again for next hops, and only next hops that changed come out.
+ *
+ * The table is one row per destination, one entry per source switch, all in
+ * one array. New rows are filled 64 at a time by a bit-parallel BFS, a bit
+ * per destination, while every link costs the same, and by Dijkstra a row at
+ * a time otherwise; repairs go a row at a time. Each entry is stamped with
+ * the epoch it last changed in, so a switch that missed some changes can be
+ * given just those.
+ *
+ * An update is begun on the owner thread, which takes the changed switches
+ * and sizes the rows, and then run in parts, on any threads, over a graph
+ * that does not change under them. Each part only writes its own rows.
+ * Nothing else may touch the table until every part is done.
+ */
+class RouteTable {
+   public:
+    RouteTable();
+    void begin_update(const Graph&, std::vector<uint32_t>*);
+    void track(uint32_t);
+    void update_part(const Graph&, const std::vector<uint32_t>&, unsigned,
+                     unsigned, std::vector<route_change_t>*);
+    void untrack(uint32_t);
+    uint8_t tracking(uint32_t) const;
+    void mark(uint32_t);
+    uint32_t next_hop(uint32_t, uint32_t) const;
+    void next_hops(const Graph&, uint32_t, uint32_t,
+                   std::vector<uint32_t>*) const;
+    static void hop_ports(const Graph&, uint32_t, uint32_t, uint64_t,
+                          std::vector<uint32_t>*);
+    uint8_t changed_since(uint32_t, uint32_t, uint64_t) const;
+    void destinations(std::vector<uint32_t>*) const;
+    uint64_t epoch;  // bumped with every change to the table
+
+   private:
+    friend class RouteTest;  // test/test_routes.cpp
+
+    void reserve(uint32_t);
+    void fill(const Graph&, const std::vector<uint32_t>&, uint32_t,
+              std::vector<route_change_t>*);
+    void fill_weighted(const Graph&, uint32_t, std::vector<route_change_t>*);
+    void repair(const Graph&, uint32_t, const std::vector<uint32_t>&,
+                std::vector<route_change_t>*);
+    static uint32_t pick_next(const Graph&, const uint32_t*, uint32_t,
+                              uint64_t*);
+
+    std::vector<uint32_t> rows;   // by vertex: its row, or NO_ROW
+    std::vector<uint32_t> dests;  // by row: its destination, or NO_VERTEX
+    uint32_t stride;              // entries per row; at least every vertex
+    std::vector<uint32_t> dist;   // cost to the row's destination, or NO_ROUTE
+    std::vector<uint32_t> next;   // port on a cheapest path, or NO_ROUTE
+    std::vector<uint64_t> ways;   // every edge on one, from next's on
+    std::vector<uint64_t> stamp;  // epoch the next hop last changed in
+    std::vector<uint64_t> marked;  // by row: epoch its hosts last changed in
+    std::vector<uint8_t> unfilled;  // by row: tracked, not computed yet
+};
+
+#endif /* ROUTES_H_ */
@@ -1,12 +1,16 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include "event.h"
 #include "openflow.h"
 
 static uint16_t socket_port(int);
-int main(int argc, const char **);
+static uint8_t load_link_costs(Server *, const char *);
+static void usage(const char *);
+int main(int argc, char **);
 
 uint16_t socket_port(int sock) {
     struct sockaddr_in addr;
@@ -23,19 +27,142 @@ uint16_t socket_port(int sock) {
     return ntohs(addr.sin_port);
 }
 
-int main(int argc, const char *argv[]) {
+/*
+ * Read port costs that override the ones derived from port speed, one per
+ * line as "dpid port cost"; # starts a comment
+ */
+uint8_t load_link_costs(Server *server, const char *path) {
+    unsigned long long dpid;
+    unsigned long port, cost;
+    char line[256];
+    unsigned lineno = 0;
+    FILE *file;
+
+    if ((file = fopen(path, "r")) == nullptr) {
+        perror(path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+        if (sscanf(line, "%lli %lu %lu", &dpid, &port, &cost) != 3 ||
+            cost < 1 || cost > 65535) {
+            fprintf(stderr, "%s:%u: invalid link cost\n", path, lineno);
+            fclose(file);
+            return 0;
+        }
+        server->link_costs[std::make_pair((uint64_t)dpid, (uint32_t)port)] =
+            (uint32_t)cost;
+    }
+    fclose(file);
+    return 1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-u] [-t threads] [-w workers] [-b backlog]\n"
+            "       [-a handshakes] [-i idle_timeout] [-H hard_timeout]\n"
+            "       [-m max_hosts] [-l link_costs]\n"
+            "       [-c cluster_socket -s shard] port\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
     Server server;
-    long port;
+    long port, threads, value, shard = 0;
+    const char *cluster_socket = nullptr;
+    int opt;
 
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s port\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:w:ub:a:i:H:m:l:c:s:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtol(optarg, nullptr, 10);
+                if (threads < 1 || threads > 1024) {
+                    fprintf(stderr, "%s: invalid thread count\n", optarg);
+                    return 1;
+                }
+                server.num_threads = (unsigned)threads;
+                break;
+            case 'w':
+                threads = strtol(optarg, nullptr, 10);
+                if (threads < 1 || threads > 1024) {
+                    fprintf(stderr, "%s: invalid worker count\n", optarg);
+                    return 1;
+                }
+                server.num_route_workers = (unsigned)threads;
+                break;
+            case 'u':
+                server.use_uring = 1;
+                break;
+            case 'b':
+                value = strtol(optarg, nullptr, 10);
+                if (value < 1 || value > 65535) {
+                    fprintf(stderr, "%s: invalid backlog\n", optarg);
+                    return 1;
+                }
+                server.backlog = (int)value;
+                break;
+            case 'a':
+                value = strtol(optarg, nullptr, 10);
+                if (value < 0 || value > 65535) {
+                    fprintf(stderr, "%s: invalid handshake limit\n", optarg);
+                    return 1;
+                }
+                server.max_handshakes = (unsigned)value;
+                break;
+            case 'i':
+            case 'H':
+                value = strtol(optarg, nullptr, 10);
+                if (value < 0 || value > 65535) {
+                    fprintf(stderr, "%s: invalid timeout\n", optarg);
+                    return 1;
+                }
+                if (opt == 'i') {
+                    server.host_idle_timeout = (uint16_t)value;
+                } else {
+                    server.host_hard_timeout = (uint16_t)value;
+                }
+                break;
+            case 'm':
+                value = strtol(optarg, nullptr, 10);
+                if (value < 1) {
+                    fprintf(stderr, "%s: invalid host limit\n", optarg);
+                    return 1;
+                }
+                server.max_hosts = (size_t)value;
+                break;
+            case 'l':
+                if (!load_link_costs(&server, optarg)) {
+                    return 1;
+                }
+                break;
+            case 'c':
+                cluster_socket = optarg;
+                break;
+            case 's':
+                shard = strtol(optarg, nullptr, 10);
+                if (shard < 0 || shard >= MAX_SHARDS) {
+                    fprintf(stderr, "%s: invalid shard\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
 
 #define MAX_PORT 65535
-    port = strtol(argv[1], nullptr, 10);
+    port = strtol(argv[optind], nullptr, 10);
     if (port < 0 || port > MAX_PORT) {
-        fprintf(stderr, "%s: invalid port number\n", argv[1]);
+        fprintf(stderr, "%s: invalid port number\n", argv[optind]);
         return 1;
     }
 
@@ -44,6 +171,10 @@ int main(int argc, const char *argv[]) {
         return 0;
     }
 
+    if (cluster_socket != nullptr) {
+        server.cluster = new Cluster(&server, cluster_socket, (uint32_t)shard);
+    }
+
     server.open((uint16_t)port);
     printf("Listening on port %ld\n", port ? port : socket_port(server.fd));
     server.listen_and_serve();
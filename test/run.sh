@@ -1,4 +1,6 @@
 #!/bin/bash
 cd "$(dirname "${BASH_SOURCE[0]}")"/..
-source test/venv/bin/activate
+if [ -f test/venv/bin/activate ]; then
+    source test/venv/bin/activate
+fi
 py.test -vvvv test/ $@
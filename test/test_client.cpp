@@ -0,0 +1,277 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Built with client.cpp itself, for its limits
+#include "../client.cpp"
+
+// The reactor and server a lone client needs, and a socket to read it from
+typedef struct {
+    Server server;
+    Reactor* reactor;
+    Client* client;
+    int peer;
+} fixture_t;
+
+static void setup(fixture_t* f, int sndbuf) {
+    int fds[2];
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    assert(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+    assert(setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                      sizeof(sndbuf)) == 0);
+    f->reactor = f->server.add_reactor();
+    f->client = new Client(fds[0], f->reactor);
+    f->peer = fds[1];
+}
+
+// An echo request of size bytes whose every byte depends on its xid
+static MsgBuf make_msg(uint32_t xid, uint16_t size) {
+    MsgBuf buf(size);
+    ofp_header_t* hdr = (ofp_header_t*)buf.data;
+    uint16_t ndx;
+
+    hdr->version = 4;
+    hdr->type = 2;
+    hdr->length = htons(size);
+    hdr->xid = htonl(xid);
+    for (ndx = sizeof(ofp_header_t); ndx < size; ndx++) {
+        buf.data[ndx] = (uint8_t)(xid * 7 + ndx);
+    }
+    return buf;
+}
+
+// Read up to max bytes of what the client sent
+static void drain(int peer, std::vector<uint8_t>* out, size_t max) {
+    uint8_t buf[65536];
+    ssize_t got;
+
+    if (max > sizeof(buf)) {
+        max = sizeof(buf);
+    }
+    if ((got = read(peer, buf, max)) > 0) {
+        out->insert(out->end(), buf, buf + got);
+    }
+}
+
+// Split the stream into messages, checking each one is whole, and give xids
+static std::vector<uint32_t> parse(const std::vector<uint8_t>& stream) {
+    std::vector<uint32_t> xids;
+    size_t pos = 0, ndx;
+
+    while (pos < stream.size()) {
+        const ofp_header_t* hdr = (const ofp_header_t*)&stream[pos];
+        uint16_t size = ntohs(hdr->length);
+        uint32_t xid = ntohl(hdr->xid);
+
+        assert(pos + size <= stream.size());
+        assert(hdr->version == 4 && hdr->type == 2);
+        for (ndx = sizeof(ofp_header_t); ndx < size; ndx++) {
+            assert(stream[pos + ndx] == (uint8_t)(xid * 7 + ndx));
+        }
+        xids.push_back(xid);
+        pos += size;
+    }
+    return xids;
+}
+
+/*
+ * A socket that takes a little at a time leaves writes partly sent. Each
+ * flush has to carry on from the middle of that write, and finish it before
+ * a control message that arrives meanwhile jumps the rest of the flow lane.
+ */
+static void test_partial_writev(unsigned seed) {
+    fixture_t f;
+    std::vector<uint8_t> stream;
+    std::vector<uint32_t> xids;
+    uint32_t xid, partial_xid = 0, control_xid = 0x80000000;
+    unsigned partials = 0;
+    size_t ndx;
+
+    srand(seed);
+    setup(&f, 4096);
+    for (xid = 1; xid <= 300; xid++) {
+        f.client->enqueue(
+            Write(make_msg(xid, (uint16_t)(8 + rand() % 3000)), LANE_FLOW));
+    }
+
+    f.client->canwrite = 1;
+    while (f.client->lane_size(LANE_CONTROL) ||
+           f.client->lane_size(LANE_FLOW)) {
+        f.client->flush_write_queue();
+        assert(!f.client->is_closed());
+
+        if (f.client->partial_write() != nullptr) {
+            const Write& w = *f.client->partial_write();
+            assert(w.pos > 0 && w.pos < w.buf.size);
+            partials++;
+            if (control_xid == 0x80000000) {
+                // Comes straight after the write that is partly sent
+                partial_xid = ntohl(((ofp_header_t*)w.buf.data)->xid);
+                f.client->enqueue(Write(make_msg(++control_xid, 64),
+                                        LANE_CONTROL));
+            }
+        }
+        drain(f.peer, &stream, 1 + (size_t)rand() % 6000);
+        f.client->canwrite = 1;
+    }
+    for (;;) {
+        size_t before = stream.size();
+        drain(f.peer, &stream, 65536);
+        if (stream.size() == before) {
+            break;
+        }
+    }
+    close(f.peer);
+    close(f.client->fd);
+
+    xids = parse(stream);
+    assert(partials > 0 && control_xid != 0x80000000);
+    assert(xids.size() == 301);
+    for (ndx = 0, xid = 1; ndx < xids.size(); ndx++) {
+        if (xids[ndx] == control_xid) {
+            assert(ndx > 0 && xids[ndx - 1] == partial_xid);
+            continue;
+        }
+        assert(xids[ndx] == xid++);
+    }
+    printf("seed %u: %u partial writes\n", seed, partials);
+}
+
+// Write what the socket takes, then read up to max bytes of it back
+static void flush(fixture_t* f, std::vector<uint8_t>* stream, size_t max) {
+    f->client->canwrite = 1;
+    f->client->flush_write_queue();
+    drain(f->peer, stream, max);
+}
+
+// Whatever was queued first, control goes out before discovery before flow
+static void test_lane_order(void) {
+    fixture_t f;
+    std::vector<uint8_t> stream;
+    std::vector<uint32_t> xids;
+
+    setup(&f, 65536);
+    f.client->enqueue(Write(make_msg(30, 100), LANE_FLOW));
+    f.client->enqueue(Write(make_msg(20, 100), LANE_DISCOVERY));
+    f.client->enqueue(Write(make_msg(31, 100), LANE_FLOW));
+    f.client->enqueue(Write(make_msg(10, 100), LANE_CONTROL));
+    f.client->enqueue(Write(make_msg(21, 100), LANE_DISCOVERY));
+    flush(&f, &stream, 65536);
+
+    xids = parse(stream);
+    assert(xids.size() == 5);
+    assert(xids[0] == 10 && xids[1] == 20 && xids[2] == 21);
+    assert(xids[3] == 30 && xids[4] == 31);
+    close(f.peer);
+    close(f.client->fd);
+}
+
+// Beacons past the discovery lane's cap are dropped; other lanes go on
+static void test_discovery_cap(void) {
+    fixture_t f;
+    uint32_t xid;
+
+    setup(&f, 4096);
+    for (xid = 0; xid < 2 * DISCOVERY_LANE_CAP / 1000; xid++) {
+        f.client->enqueue(Write(make_msg(xid, 1000), LANE_DISCOVERY));
+        assert(f.client->lane_size(LANE_DISCOVERY) <= DISCOVERY_LANE_CAP);
+    }
+    assert(f.client->lane_writes(LANE_DISCOVERY) ==
+           DISCOVERY_LANE_CAP / 1000);
+    f.client->enqueue(Write(make_msg(xid, 1000), LANE_FLOW));
+    f.client->enqueue(Write(make_msg(xid, 1000), LANE_CONTROL));
+    assert(f.client->lane_writes(LANE_FLOW) == 1);
+    assert(f.client->lane_writes(LANE_CONTROL) == 1);
+    assert(!f.client->is_evicted());
+    close(f.peer);
+    close(f.client->fd);
+}
+
+// A switch that lets OUTPUT_HARD_CAP pile up is shut down, and takes no more
+static void test_hard_cap(void) {
+    fixture_t f;
+    size_t total = 0;
+    uint8_t buf[16];
+    uint32_t xid = 0;
+
+    setup(&f, 4096);
+    while (!f.client->is_evicted()) {
+        f.client->enqueue(Write(make_msg(xid++, 60000), LANE_FLOW));
+        total = f.client->lane_size(LANE_FLOW);
+        assert(total <= OUTPUT_HARD_CAP);
+    }
+    assert(total + 60000 > OUTPUT_HARD_CAP);
+    f.client->enqueue(Write(make_msg(xid, 100), LANE_CONTROL));
+    assert(f.client->lane_size(LANE_CONTROL) == 0);
+    assert(f.client->lane_size(LANE_FLOW) == total);
+
+    // The peer sees the connection end
+    assert(read(f.peer, buf, sizeof(buf)) == 0);
+    close(f.peer);
+    close(f.client->fd);
+}
+
+/*
+ * The flow lane is congested from FLOW_HIGH_WATER until it drains below
+ * FLOW_LOW_WATER, and not before it reaches high water again.
+ */
+static void test_congestion(void) {
+    fixture_t f;
+    std::vector<uint8_t> stream;
+    uint32_t xid = 0;
+    uint8_t was_congested = 0;
+
+    setup(&f, 65536);
+    while (f.client->lane_size(LANE_FLOW) + 10000 < FLOW_HIGH_WATER) {
+        f.client->enqueue(Write(make_msg(xid++, 10000), LANE_FLOW));
+        assert(!f.client->congested);
+    }
+    f.client->enqueue(Write(make_msg(xid++, 10000), LANE_FLOW));
+    assert(f.client->congested);
+
+    while (f.client->lane_size(LANE_FLOW) > 0) {
+        flush(&f, &stream, 20000);
+        if (f.client->lane_size(LANE_FLOW) >= FLOW_LOW_WATER) {
+            assert(f.client->congested);
+        } else {
+            assert(!f.client->congested);
+        }
+    }
+
+    // Filling back up past low water is not enough
+    while (f.client->lane_size(LANE_FLOW) + 10000 < FLOW_HIGH_WATER) {
+        f.client->enqueue(Write(make_msg(xid++, 10000), LANE_FLOW));
+        was_congested |= f.client->congested;
+    }
+    assert(!was_congested);
+    close(f.peer);
+    close(f.client->fd);
+}
+
+int main(void) {
+    unsigned seed;
+
+    for (seed = 1; seed <= 20; seed++) {
+        test_partial_writev(seed);
+    }
+    test_lane_order();
+    test_discovery_cap();
+    test_hard_cap();
+    test_congestion();
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "../cluster.h"
+#include "../event.h"
+#include "../openflow.h"
+
+/*
+ * Shard 1 is a Cluster, turned by hand on this thread in place of its peer
+ * thread and the owner. Shard 0 is the test, on the other end of a real Unix
+ * socket, writing and reading the records itself.
+ */
+class ClusterTest {
+   public:
+    static void connect(Cluster*);
+    static std::vector<cluster_msg_t> pump(Cluster*, uint8_t*);
+    static size_t num_peers(const Cluster*);
+};
+
+#define LOCAL 0x10
+#define REMOTE 0x20
+
+static Server server;
+
+void ClusterTest::connect(Cluster* cluster) {
+    cluster->connect_lower();
+}
+
+/*
+ * One turn of the peer thread's loop, then of the owner: send what is
+ * queued, read what came, drop connections that closed, and apply what was
+ * read. Gives what was applied, in order.
+ */
+std::vector<cluster_msg_t> ClusterTest::pump(Cluster* cluster,
+                                             uint8_t* changed) {
+    std::vector<cluster_msg_t> msgs;
+    size_t ndx;
+
+    cluster->drain_outbox();
+    for (ndx = 0; ndx < cluster->peers.size(); ndx++) {
+        Cluster::peer_t* peer = cluster->peers[ndx];
+        if (!cluster->read_peer(peer)) {
+            peer->dead = 1;
+        } else if (!peer->out.empty() && !cluster->write_peer(peer)) {
+            peer->dead = 1;
+        }
+    }
+    for (ndx = cluster->peers.size(); ndx-- > 0;) {
+        if (cluster->peers[ndx]->dead) {
+            cluster->drop_peer(ndx);
+        }
+    }
+    msgs.swap(cluster->inbox);
+    *changed = 0;
+    for (ndx = 0; ndx < msgs.size(); ndx++) {
+        cluster->apply(msgs[ndx], changed);
+    }
+    return msgs;
+}
+
+size_t ClusterTest::num_peers(const Cluster* cluster) {
+    return cluster->peers.size();
+}
+
+static int listen_at(const std::string& path) {
+    struct sockaddr_un addr;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    assert((sock = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    unlink(path.c_str());
+    assert(bind(sock, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) == 0);
+    assert(listen(sock, 4) == 0);
+    return sock;
+}
+
+static cluster_msg_t make_msg(uint8_t type, uint64_t uid, uint32_t port,
+                              uint64_t other, uint32_t other_port) {
+    cluster_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.uid = uid;
+    msg.port = port;
+    msg.other = other;
+    msg.other_port = other_port;
+    return msg;
+}
+
+static void send_bytes(int fd, const std::vector<cluster_msg_t>& msgs,
+                       size_t from, size_t to) {
+    const uint8_t* bytes = (const uint8_t*)msgs.data();
+
+    assert(write(fd, bytes + from, to - from) == (ssize_t)(to - from));
+}
+
+// Every whole record shard 1 has sent so far
+static std::vector<cluster_msg_t> recv_msgs(int fd) {
+    std::vector<cluster_msg_t> msgs;
+    cluster_msg_t msg;
+
+    while (recv(fd, &msg, sizeof(msg), MSG_DONTWAIT) == sizeof(msg)) {
+        msgs.push_back(msg);
+    }
+    return msgs;
+}
+
+// Shard 0 brings up its switch, linked to ours, with a host on it
+static std::vector<cluster_msg_t> remote_switch(uint64_t mac) {
+    std::vector<cluster_msg_t> msgs;
+
+    msgs.push_back(make_msg(CLUSTER_SWITCH_UP, REMOTE, 0, 0, 0));
+    msgs.push_back(make_msg(CLUSTER_EDGE_UP, REMOTE, 3, LOCAL, 2));
+    msgs.push_back(make_msg(CLUSTER_HOST_UP, REMOTE, 5, mac, 0));
+    return msgs;
+}
+
+int main(void) {
+    char prefix[64];
+    Reactor* reactor = new Reactor(&server);
+    Client* local = new Client(-1, reactor);
+    std::vector<cluster_msg_t> sent, got;
+    Cluster* cluster;
+    uint8_t changed;
+    int listen_fd, fd;
+    size_t ndx;
+
+    snprintf(prefix, sizeof(prefix), "/tmp/test_cluster.%d", (int)getpid());
+    listen_fd = listen_at(std::string(prefix) + ".0");
+
+    // Shard 1 has one switch, with two ports and a host
+    local->uid = LOCAL;
+    local->ports.insert(1);
+    local->ports.insert(2);
+    local->hosts[0xaa] = 1;
+    client_table[LOCAL] = local;
+    server.graph.add_vertex(LOCAL);
+    cluster = new Cluster(&server, prefix, 1);
+    server.cluster = cluster;
+
+    // It connects down to shard 0 and says hello first
+    ClusterTest::connect(cluster);
+    assert(ClusterTest::num_peers(cluster) == 1);
+    assert((fd = accept(listen_fd, nullptr, nullptr)) >= 0);
+    ClusterTest::pump(cluster, &changed);
+    got = recv_msgs(fd);
+    assert(got.size() == 1);
+    assert(got[0].type == CLUSTER_HELLO && got[0].shard == 1);
+
+    // Our hello gets a snapshot of its switch back
+    sent.assign(1, make_msg(CLUSTER_HELLO, 0, 0, 0, 0));
+    send_bytes(fd, sent, 0, sizeof(cluster_msg_t));
+    ClusterTest::pump(cluster, &changed);
+    ClusterTest::pump(cluster, &changed);
+    got = recv_msgs(fd);
+    assert(got.size() == 4);
+    assert(got[0].type == CLUSTER_SWITCH_UP && got[0].uid == LOCAL);
+    assert(got[1].type == CLUSTER_PORT_COST && got[1].port == 1);
+    assert(got[2].type == CLUSTER_PORT_COST && got[2].port == 2);
+    assert(got[3].type == CLUSTER_HOST_UP && got[3].other == 0xaa &&
+           got[3].port == 1);
+    for (ndx = 0; ndx < got.size(); ndx++) {
+        assert(got[ndx].shard == 1);
+    }
+
+    // Records cut anywhere are put back together
+    sent = remote_switch(0xbb);
+    send_bytes(fd, sent, 0, sizeof(cluster_msg_t) / 2);
+    assert(ClusterTest::pump(cluster, &changed).empty());
+    send_bytes(fd, sent, sizeof(cluster_msg_t) / 2,
+               2 * sizeof(cluster_msg_t) + 3);
+    assert(ClusterTest::pump(cluster, &changed).size() == 2);
+    send_bytes(fd, sent, 2 * sizeof(cluster_msg_t) + 3,
+               sent.size() * sizeof(cluster_msg_t));
+    assert(ClusterTest::pump(cluster, &changed).size() == 1);
+    assert(cluster->switches.count(REMOTE) && cluster->switches[REMOTE] == 0);
+    assert(server.graph.has_edge(REMOTE, 3, LOCAL, 2));
+    assert(cluster->hosts[REMOTE][0xbb] == 5);
+
+    // A switch going down takes its links and hosts with it
+    sent.assign(1, make_msg(CLUSTER_SWITCH_DOWN, REMOTE, 0, 0, 0));
+    send_bytes(fd, sent, 0, sizeof(cluster_msg_t));
+    ClusterTest::pump(cluster, &changed);
+    assert(changed);
+    assert(!cluster->switches.count(REMOTE));
+    assert(!cluster->hosts.count(REMOTE));
+    assert(!server.graph.has_any_edge(LOCAL, 2));
+    assert(!server.graph.has_any_edge(REMOTE, 3));
+
+    /*
+     * The last records before shard 0 goes away are applied, and then the
+     * loss of the shard, which takes its switch, links and hosts
+     */
+    sent = remote_switch(0xcc);
+    send_bytes(fd, sent, 0, sent.size() * sizeof(cluster_msg_t));
+    close(fd);
+    got = ClusterTest::pump(cluster, &changed);
+    assert(got.size() == 4);
+    for (ndx = 0; ndx < 3; ndx++) {
+        assert(got[ndx].type == sent[ndx].type && got[ndx].shard == 0);
+    }
+    assert(got[3].type == CLUSTER_PEER_LOST && got[3].shard == 0);
+    assert(changed);
+    assert(ClusterTest::num_peers(cluster) == 0);
+    assert(!cluster->switches.count(REMOTE));
+    assert(!cluster->hosts.count(REMOTE));
+    assert(!server.graph.has_any_edge(LOCAL, 2));
+
+    // Shard 1 comes back to a shard 0 that restarted
+    ClusterTest::connect(cluster);
+    assert(ClusterTest::num_peers(cluster) == 1);
+    assert((fd = accept(listen_fd, nullptr, nullptr)) >= 0);
+    ClusterTest::pump(cluster, &changed);
+    got = recv_msgs(fd);
+    assert(got.size() == 1 && got[0].type == CLUSTER_HELLO);
+
+    close(fd);
+    close(listen_fd);
+    unlink((std::string(prefix) + ".0").c_str());
+    return 0;
+}
@@ -28,9 +28,8 @@ def make_port(name, port_id, addr):
             + name + b'\0' * (16 - len(name)) + b'\0' * 32)
 
 
-@pytest.fixture
-def proc():
-    p = subprocess.Popen([TARGET, '0'], stdout=subprocess.PIPE,
+def controller(args):
+    p = subprocess.Popen([TARGET] + args + ['0'], stdout=subprocess.PIPE,
                          stderr=subprocess.PIPE)
     port_line = p.stdout.readline()
     assert port_line.startswith(b'Listening on port ')
@@ -45,6 +44,17 @@ def proc():
     print(stdout.decode('utf-8'), end='')
 
 
+@pytest.fixture
+def proc():
+    yield from controller([])
+
+
+@pytest.fixture(params=[[], ['-u']], ids=['epoll', 'io_uring'])
+def any_proc(request):
+    """The controller on each of its I/O backends."""
+    yield from controller(request.param)
+
+
 def connect(proc):
     sock = Socket(socket.AF_INET, socket.SOCK_STREAM)
     sock.connect(('localhost', proc.port))
@@ -86,6 +96,57 @@ def test_many_big_echo(proc):
             assert sock.recvall(0xffff) == make_packet(3, payload, xid=xid)
 
 
+def send_split(sock, data, cuts):
+    """Send data in pieces, cut at the given offsets, one read each."""
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    start = 0
+    for cut in cuts + [len(data)]:
+        sock.sendall(data[start:cut])
+        time.sleep(.05)
+        start = cut
+
+
+def test_split_message(any_proc):
+    with connect(any_proc) as sock:
+        payload = os.urandom(1000)
+        send_split(sock, make_packet(2, payload), [500])
+        assert sock.recvall(1008) == make_packet(3, payload)
+
+
+def test_split_header(any_proc):
+    with connect(any_proc) as sock:
+        first = make_packet(2, b'first')
+        second = make_packet(2, b'second', xid=0x5ec0)
+        send_split(sock, first + second, [3, len(first) + 5])
+        assert sock.recvall(len(first)) == make_packet(3, b'first')
+        assert sock.recvall(len(second)) == make_packet(3, b'second',
+                                                        xid=0x5ec0)
+
+
+def test_message_past_buffer_end(any_proc):
+    # The largest message, arriving behind another, does not fit in what is
+    # left of the receive buffer and has to be moved down to finish
+    with connect(any_proc) as sock:
+        small = os.urandom(3000)
+        big = os.urandom(0xffff - 8)
+        data = (make_packet(2, small) + make_packet(2, big, xid=0xb16) +
+                make_packet(2, small, xid=0x5a11))
+        send_split(sock, data, list(range(1000, len(data), 7000)))
+        assert sock.recvall(3008) == make_packet(3, small)
+        assert sock.recvall(0xffff) == make_packet(3, big, xid=0xb16)
+        assert sock.recvall(3008) == make_packet(3, small, xid=0x5a11)
+
+
+def test_length_below_header(any_proc):
+    # A length too short to cover the header is taken as a bare header, and
+    # the stream stays in step
+    with connect(any_proc) as sock:
+        bad = b'\x04\x02\x00\x04' + struct.pack('!I', 0xbad)
+        sock.sendall(bad + make_packet(2, b'after'))
+        assert sock.recvall(8) == make_packet(3, b'', xid=0xbad)
+        assert sock.recvall(13) == make_packet(3, b'after')
+
+
 def test_hello(proc):
     with connect(proc) as sock:
         sock.sendall(make_packet(0, b''))
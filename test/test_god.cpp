@@ -0,0 +1,379 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <vector>
+
+// Built with god.cpp itself, to reach what it keeps to itself
+#include "../god.cpp"
+
+// Laid out as in OpenFlow 1.3; openflow.cpp keeps its structs to itself
+#define FLOW_MOD 14
+#define FLOW_MOD_COMMAND 17   // past the header: cookie, cookie mask, table
+#define FLOW_MOD_IDLE 18
+#define FLOW_MOD_HARD 20
+#define FLOW_MOD_FLAGS 36
+#define SEND_FLOW_REM 1
+#define GROUP_MOD 15
+#define GROUP_MOD_BUCKETS 8   // past the header: command, type, id
+#define BUCKET_ACTION 16      // past a bucket's start: its action
+#define ACTION_GROUP 22
+#define GROUP_ALL 0
+#define GROUP_SELECT 1
+
+#define BCAST_GROUP 0x7f5d8dda  // BCAST_GROUP_ID, in openflow.cpp
+
+#define UID 0x10
+
+static Server server;
+static Reactor* reactor;
+
+// A group mod the client wrote, taken apart
+typedef struct {
+    uint16_t command;
+    uint8_t type;
+    uint32_t group_id;
+    std::vector<uint32_t> ports;   // of its output buckets, in order
+    std::vector<uint32_t> groups;  // it chains to
+} group_mod_msg_t;
+
+static Client* new_client(uint64_t uid) {
+    Client* client;
+
+    if (reactor == nullptr) {
+        reactor = new Reactor(&server);
+    }
+    client = new Client(-1, reactor);
+    client->uid = uid;
+    client_table[uid] = client;
+    return client;
+}
+
+static uint32_t get32(const uint8_t* data) {
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+static uint16_t get16(const uint8_t* data) {
+    uint16_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return ntohs(value);
+}
+
+/*
+ * The group mods the client has written since last asked, in order. Off its
+ * reactor nothing is sent: they wait in its posted writes.
+ */
+static std::vector<group_mod_msg_t> group_mods(Client* client) {
+    std::vector<Write> posted = client->take_posted();
+    std::vector<group_mod_msg_t> mods;
+    size_t ndx, pos;
+
+    for (ndx = 0; ndx < posted.size(); ndx++) {
+        const uint8_t* data = posted[ndx].buf.data;
+        uint16_t size = posted[ndx].buf.size;
+        group_mod_msg_t mod;
+        if (((const ofp_header_t*)data)->type != GROUP_MOD) {
+            continue;
+        }
+        assert(get16(data + 2) == size);
+        data += sizeof(ofp_header_t);
+        size = (uint16_t)(size - sizeof(ofp_header_t));
+        mod.command = get16(data);
+        mod.type = data[2];
+        mod.group_id = get32(data + 4);
+        for (pos = GROUP_MOD_BUCKETS; pos < size; pos += get16(data + pos)) {
+            const uint8_t* action = data + pos + BUCKET_ACTION;
+            if (get16(action) == ACTION_GROUP) {
+                mod.groups.push_back(get32(action + 4));
+            } else {
+                mod.ports.push_back(get32(action + 4));
+            }
+        }
+        assert(pos == size);
+        mods.push_back(mod);
+    }
+    return mods;
+}
+
+// A flow mod the client wrote: its command, timeouts and flags
+typedef struct {
+    uint8_t command;
+    uint16_t idle;
+    uint16_t hard;
+    uint16_t flags;
+} flow_mod_msg_t;
+
+static std::vector<flow_mod_msg_t> flow_mods(Client* client) {
+    std::vector<Write> posted = client->take_posted();
+    std::vector<flow_mod_msg_t> mods;
+    size_t ndx;
+
+    for (ndx = 0; ndx < posted.size(); ndx++) {
+        const uint8_t* data = posted[ndx].buf.data;
+        flow_mod_msg_t mod;
+        if (((const ofp_header_t*)data)->type != FLOW_MOD) {
+            continue;
+        }
+        data += sizeof(ofp_header_t);
+        mod.command = data[FLOW_MOD_COMMAND];
+        mod.idle = get16(data + FLOW_MOD_IDLE);
+        mod.hard = get16(data + FLOW_MOD_HARD);
+        mod.flags = get16(data + FLOW_MOD_FLAGS);
+        mods.push_back(mod);
+    }
+    return mods;
+}
+
+static std::vector<uint32_t> ports_of(uint32_t first, uint32_t second) {
+    std::vector<uint32_t> ports(1, first);
+
+    if (second) {
+        ports.push_back(second);
+    }
+    return ports;
+}
+
+/*
+ * Host rules over the same next hops share one SELECT group, held once by
+ * each. It is only deleted once the last of them has let go, whether it
+ * moved to other ports or was forgotten, and the switch has acked that.
+ */
+static void test_group_refs(void) {
+    Client* client = new_client(UID);
+    std::vector<group_mod_msg_t> mods;
+    uint32_t group;
+
+    update_host_sp(UID, ports_of(1, 2), 0xaa);
+    mods = group_mods(client);
+    assert(mods.size() == 1 && mods[0].command == OFPGC_ADD);
+    assert(mods[0].type == GROUP_SELECT && mods[0].ports == ports_of(1, 2));
+    group = mods[0].group_id;
+    assert(client->written[0xaa] == (ECMP_HOP | group));
+    assert(client->ecmp_refs[group] == 1);
+
+    // A second host shares it; the first again changes nothing
+    update_host_sp(UID, ports_of(1, 2), 0xbb);
+    update_host_sp(UID, ports_of(1, 2), 0xaa);
+    assert(group_mods(client).empty());
+    assert(client->ecmp_refs[group] == 2);
+
+    // One host moves to a single port, and then to a group of its own
+    update_host_sp(UID, ports_of(3, 0), 0xaa);
+    assert(client->written[0xaa] == 3 && client->ecmp_refs[group] == 1);
+    update_host_sp(UID, ports_of(2, 3), 0xaa);
+    mods = group_mods(client);
+    assert(mods.size() == 1 && mods[0].group_id != group);
+    assert(client->ecmp_refs[mods[0].group_id] == 1);
+    drop_unused_groups(client);
+    assert(group_mods(client).empty());
+    assert(client->ecmp_groups.size() == 2);
+
+    // The last host on the first group is forgotten
+    forget_written(client, 0xbb);
+    forget_written(client, 0xbb);
+    assert(client->ecmp_refs[group] == 0);
+    drop_unused_groups(client);
+    mods = group_mods(client);
+    assert(mods.size() == 1 && mods[0].command == OFPGC_DELETE);
+    assert(mods[0].group_id == group);
+    assert(!client->ecmp_refs.count(group));
+    assert(client->ecmp_groups.size() == 1);
+    assert(!client->ecmp_groups.count(ports_of(1, 2)));
+
+    // Those ports again are a new group, not the one deleted
+    update_host_sp(UID, ports_of(1, 2), 0xbb);
+    mods = group_mods(client);
+    assert(mods.size() == 1 && mods[0].command == OFPGC_ADD);
+    assert(mods[0].group_id != group);
+    assert(client->ecmp_refs[mods[0].group_id] == 1);
+}
+
+// Ports from first up to last
+static std::set<uint32_t> port_range(uint32_t first, uint32_t last) {
+    std::set<uint32_t> ports;
+
+    for (; first <= last; first++) {
+        ports.insert(first);
+    }
+    return ports;
+}
+
+/*
+ * Check a broadcast group mod: an ALL group, for the chunk its id says, of
+ * the ports it ought to have in that chunk, chaining to the given chunks
+ */
+static void check_chunk(const group_mod_msg_t& mod, uint16_t command,
+                        uint32_t chunk, const std::set<uint32_t>& flood,
+                        const std::set<uint32_t>& chained) {
+    std::vector<uint32_t> ports, groups;
+    std::set<uint32_t>::const_iterator it;
+
+    assert(mod.command == command && mod.type == GROUP_ALL);
+    assert(mod.group_id == BCAST_GROUP + chunk);
+    for (it = flood.begin(); it != flood.end(); it++) {
+        if (*it / BCAST_CHUNK_PORTS == chunk) {
+            ports.push_back(*it);
+        }
+    }
+    for (it = chained.begin(); it != chained.end(); it++) {
+        groups.push_back(BCAST_GROUP + *it);
+    }
+    assert(mod.ports.size() <= BCAST_CHUNK_PORTS);
+    if (command != OFPGC_DELETE) {
+        assert(mod.ports == ports && mod.groups == groups);
+    }
+}
+
+/*
+ * A switch floods to more ports than one group mod holds: they are split by
+ * port number into chunks of BCAST_CHUNK_PORTS, the broadcast group has the
+ * first and chains to a group of each other one. A chained group is added
+ * before the broadcast group points at it, and deleted only after it no
+ * longer does, and only chunks that changed are sent again.
+ */
+static void test_flood_chunks(void) {
+    Client* client = new_client(UID + 1);
+    std::vector<group_mod_msg_t> mods;
+    std::set<uint32_t> flood = port_range(1, 600), chained;
+
+    update_flood(client, flood);
+    mods = group_mods(client);
+    chained.insert(1);
+    chained.insert(2);
+    assert(mods.size() == 3);
+    check_chunk(mods[0], OFPGC_ADD, 1, flood, std::set<uint32_t>());
+    check_chunk(mods[1], OFPGC_ADD, 2, flood, std::set<uint32_t>());
+    check_chunk(mods[2], OFPGC_ADD, 0, flood, chained);
+    assert(mods[2].ports.size() == BCAST_CHUNK_PORTS - 1);
+    assert(client->has_mst && client->has_bcast_rule);
+
+    // The same ports again are nothing new
+    update_flood(client, flood);
+    assert(group_mods(client).empty());
+
+    // A port in the last chunk goes; only that chunk changes
+    flood.erase(550);
+    update_flood(client, flood);
+    mods = group_mods(client);
+    assert(mods.size() == 1);
+    check_chunk(mods[0], OFPGC_MODIFY, 2, flood, std::set<uint32_t>());
+
+    // The middle chunk empties: unchained, then deleted
+    flood = port_range(1, 255);
+    flood.insert(512);
+    update_flood(client, flood);
+    mods = group_mods(client);
+    chained.erase(1);
+    assert(mods.size() == 3);
+    check_chunk(mods[0], OFPGC_MODIFY, 2, flood, std::set<uint32_t>());
+    check_chunk(mods[1], OFPGC_MODIFY, 0, flood, chained);
+    check_chunk(mods[2], OFPGC_DELETE, 1, flood, std::set<uint32_t>());
+
+    // It fills up again, and is added back before it is chained to
+    flood.insert(300);
+    update_flood(client, flood);
+    mods = group_mods(client);
+    chained.insert(1);
+    assert(mods.size() == 2);
+    check_chunk(mods[0], OFPGC_ADD, 1, flood, std::set<uint32_t>());
+    check_chunk(mods[1], OFPGC_MODIFY, 0, flood, chained);
+
+    // Nothing to flood to at all leaves the broadcast group empty
+    flood.clear();
+    update_flood(client, flood);
+    mods = group_mods(client);
+    assert(mods.size() == 3);
+    check_chunk(mods[0], OFPGC_MODIFY, 0, flood, flood);
+    check_chunk(mods[1], OFPGC_DELETE, 1, flood, flood);
+    check_chunk(mods[2], OFPGC_DELETE, 2, flood, flood);
+    assert(client->bcast_chunks.size() == 1);
+}
+
+/*
+ * Only the rule where the host is attached ages out and reports it; the
+ * rules through other switches never time out. It is sent whole, so it
+ * gets its timeouts even when it replaces a rule toward somewhere else.
+ */
+static void test_host_timeouts(void) {
+    Client* attached = new_client(UID + 2);
+    Client* transit = new_client(UID + 3);
+    std::vector<flow_mod_msg_t> mods;
+
+    server.host_idle_timeout = 30;
+    server.host_hard_timeout = 600;
+    update_host_sp(UID + 3, ports_of(4, 0), 0xcc);
+    mods = flow_mods(transit);
+    assert(mods.size() == 1 && mods[0].command == FM_CMD_ADD);
+    assert(mods[0].idle == 0 && mods[0].hard == 0 && mods[0].flags == 0);
+    update_host_sp(UID + 3, ports_of(5, 0), 0xcc);
+    mods = flow_mods(transit);
+    assert(mods.size() == 1 && mods[0].command == FM_CMD_MODIFY);
+    assert(mods[0].idle == 0 && mods[0].flags == 0);
+
+    // The host was routed through here, and now turns up on port 1
+    update_host_sp(UID + 2, ports_of(2, 0), 0xcc);
+    flow_mods(attached);
+    attached->hosts[0xcc] = 1;
+    update_host_sp(UID + 2, ports_of(1, 0), 0xcc);
+    mods = flow_mods(attached);
+    assert(mods.size() == 1 && mods[0].command == FM_CMD_ADD);
+    assert(mods[0].idle == 30 && mods[0].hard == 600);
+    assert(mods[0].flags == SEND_FLOW_REM);
+}
+
+// Ack every switch's fence, as the switches would
+static void ack_fences(void) {
+    std::map<uint64_t, Client*>::iterator it;
+
+    for (it = client_table.begin(); it != client_table.end(); it++) {
+        fence_acked(it->second, it->second->fence_xid);
+    }
+}
+
+/*
+ * The fabric has converged once every switch has acked the last fence it
+ * was sent: a newer fence on a switch still waiting is one more to wait
+ * for, not two, and the ack of the older one does not count.
+ */
+static void test_convergence(void) {
+    Client* one = new_client(UID + 4);
+    Client* two = new_client(UID + 5);
+    uint64_t start;
+    uint32_t old_xid;
+
+    // What the tests before left batched
+    fence_batch();
+    ack_fences();
+    server.converged_ms = 0;
+
+    start = server.now_ms();
+    batch_add(one);
+    batch_add(two);
+    fence_batch();
+    old_xid = two->fence_xid;
+    fence_acked(one, one->fence_xid);
+    assert(server.converged_ms == 0);
+
+    batch_add(two);
+    fence_batch();
+    assert(two->fence_xid != old_xid);
+    fence_acked(two, old_xid);
+    assert(server.converged_ms == 0);
+    fence_acked(two, two->fence_xid);
+    assert(server.converged_ms >= start);
+    assert(server.converge_time_ms <= server.converged_ms - start);
+}
+
+int main(void) {
+    test_group_refs();
+    test_flood_chunks();
+    test_host_timeouts();
+    test_convergence();
+    return 0;
+}
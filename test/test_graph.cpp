@@ -1,58 +1,198 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <utility>
+#include <vector>
 #include "../graph.h"
 
-static void print_visit(int sw, uint32_t port, void *host) {
-    const char *host_name = (const char *)host;
+typedef std::vector<std::pair<uint64_t, uint32_t> > Walk;
 
-    printf("S%d -> %s: port %d\n", sw, host_name, port);
+typedef struct PrintVisitor {
+    const char *host_name;
+    void operator()(uint64_t sw, uint32_t port) {
+        printf("S%lu -> %s: port %u\n", sw, host_name, port);
+    }
+} PrintVisitor;
+
+typedef struct MstPrinter {
+    void operator()(uint64_t sw, uint32_t port) {
+        if (port == 0xffffffff) {
+            return;
+        }
+        printf("S%lu p%u\n", sw, port);
+    }
+} MstPrinter;
+
+// Collects the switches a walk reaches, in order, with the port of each
+typedef struct WalkCollector {
+    Walk *walk;
+    void operator()(uint64_t sw, uint32_t port) {
+        walk->push_back(std::make_pair(sw, port));
+    }
+} WalkCollector;
+
+static Walk walk_from(const Graph &graph, uint64_t start) {
+    Walk walk;
+    WalkCollector visit = {&walk};
+
+    graph.walk_shortest_path(start, 0, 0, visit);
+    return walk;
 }
 
-static void mst_visit(int sw, uint32_t port, void *_ignore) {
-    if (port == 0xffffffff) {
-        return;
+static uint8_t touched(const Graph &graph, uint32_t vertex) {
+    size_t ndx;
+
+    for (ndx = 0; ndx < graph.touched.size(); ndx++) {
+        if (graph.touched[ndx] == vertex) {
+            return 1;
+        }
     }
-    printf("S%d p%d\n", sw, port);
+    return 0;
 }
 
-int main(void) {
-    void *graph;
-    uint64_t sw, sw1, sw2;
+/* Switches get dense indices in the order they are first seen */
+static void test_interning(void) {
+    Graph graph;
+
+    graph.add_vertex(50);
+    graph.add_edge(30, 1, 50, 1);
+    graph.add_vertex(50);
+    assert(graph.num_vertices() == 2);
+    assert(graph.vertex(50) == 0 && graph.vertex(30) == 1);
+    assert(graph.dpid(0) == 50 && graph.dpid(1) == 30);
+    assert(graph.vertex(40) == NO_VERTEX && graph.edges(40).empty());
+    assert(graph.neighbors(1).size() == 1 && graph.neighbors(1)[0].to == 0);
+    assert(graph.lowest_vertex() == 1);
+    graph.add_vertex(10);
+    assert(graph.vertex(10) == 2 && graph.lowest_vertex() == 2);
+
+    // The routes and the tree both hear of each end of a new link
+    assert(touched(graph, 0) && touched(graph, 1) && !touched(graph, 2));
+    assert(graph.tree_touched.size() == graph.touched.size());
+}
 
-    graph = graph_create();
+/* A walk after links change follows them, not the copy from before */
+static void test_walk_after_removal(void) {
+    Graph graph;
+    Walk walk;
+
+    // A ring: 1 - 2 - 3 - 4 - 1
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(2, 2, 3, 1);
+    graph.add_edge(3, 2, 4, 1);
+    graph.add_edge(1, 2, 4, 2);
+    walk = walk_from(graph, 1);
+    assert(walk.size() == 4);
+    assert(walk[1] == std::make_pair((uint64_t)2, 1U));
+    assert(walk[2] == std::make_pair((uint64_t)4, 2U));
+    assert(walk[3] == std::make_pair((uint64_t)3, 1U));
+
+    // The long way round, each reached on its other port
+    graph.remove_edge(1, 1);
+    walk = walk_from(graph, 1);
+    assert(walk.size() == 4);
+    assert(walk[1] == std::make_pair((uint64_t)4, 2U));
+    assert(walk[2] == std::make_pair((uint64_t)3, 2U));
+    assert(walk[3] == std::make_pair((uint64_t)2, 2U));
+
+    // Cut off, then back again
+    graph.remove_edge(3, 2);
+    walk = walk_from(graph, 1);
+    assert(walk.size() == 2 && walk[1].first == 4);
+    assert(walk_from(graph, 2).size() == 2);
+    graph.add_edge(2, 1, 1, 1);
+    assert(walk_from(graph, 1).size() == 4);
+}
+
+/* Cabling a port to somewhere else moves the link, from both old ends */
+static void test_recable(void) {
+    Graph graph;
+    Walk walk;
+
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(1, 5, 3, 1);
+    graph.add_edge(1, 3, 4, 1);
+    assert(graph.edges(1).size() == 3);
+    assert(graph.edges(1)[0].port == 1 && graph.edges(1)[1].port == 3 &&
+           graph.edges(1)[2].port == 5);
+    assert(walk_from(graph, 1).size() == 4);
+
+    graph.add_edge(1, 3, 2, 2);
+    assert(graph.has_edge(1, 3, 2, 2) && graph.has_edge(2, 2, 1, 3));
+    assert(!graph.has_any_edge(4, 1) && graph.edges(1).size() == 3);
+    assert(graph.edges(2).size() == 2);
+    walk = walk_from(graph, 1);
+    assert(walk.size() == 3);
+    assert(walk[1].first == 2 && walk[2].first == 3);
+
+    // Moving the far end instead
+    graph.add_edge(3, 1, 4, 1);
+    assert(!graph.has_any_edge(1, 5) && graph.edges(1).size() == 2);
+    assert(graph.has_edge(4, 1, 3, 1));
+    assert(walk_from(graph, 1).size() == 2);
+    assert(walk_from(graph, 3).size() == 2);
+
+    // The same link again changes nothing
+    graph.touched.clear();
+    graph.add_edge(1, 1, 2, 1);
+    assert(graph.touched.empty());
+}
+
+int main(void) {
+    Graph graph;
+    uint64_t sw, sw1;
+    uint32_t port;
 
     for (sw = 1; sw <= 5; sw++) {
-        add_vertex(graph, sw);
+        graph.add_vertex(sw);
     }
 
-    add_edge(graph, 1, 1, 2, 1);
-    add_edge(graph, 1, 2, 4, 2);
-    add_edge(graph, 2, 2, 3, 3);
-    add_edge(graph, 2, 3, 4, 1);
-    add_edge(graph, 3, 2, 4, 3);
-    add_edge(graph, 4, 5, 5, 1);
-    add_edge(graph, 4, 5, 5, 1);
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(1, 2, 4, 2);
+    graph.add_edge(2, 2, 3, 3);
+    graph.add_edge(2, 3, 4, 1);
+    graph.add_edge(3, 2, 4, 3);
+    graph.add_edge(4, 5, 5, 1);
+    graph.add_edge(4, 5, 5, 1);
+
+    assert(graph.has_edge(1, 1, 2, 1));
+    assert(graph.has_edge(2, 1, 1, 1));
+    assert(!graph.has_edge(1, 1, 2, 2));
+    assert(graph.edges(4).size() == 4);
 
     for (sw1 = 0; sw1 < 6; sw1++) {
-        for (sw2 = 0; sw1 < 6; sw1++) {
-            if (has_edge(graph, sw1, sw2)) {
-                printf("  %lu -> %lu\n", sw1, sw2);
+        for (port = 0; port < 6; port++) {
+            if (graph.has_any_edge(sw1, port)) {
+                printf("  %lu p%u\n", sw1, port);
             }
         }
     }
 
     /* Walk the shortest path on the graph */
-    walk_shortest_path(graph, 1, 3, (void *)"H1", 0, print_visit);
-    walk_shortest_path(graph, 2, 4, (void *)"H2", 0, print_visit);
-    walk_shortest_path(graph, 3, 1, (void *)"H3", 0, print_visit);
-    walk_shortest_path(graph, 4, 4, (void *)"H4", 0, print_visit);
-    walk_shortest_path(graph, 5, 2, (void *)"H5", 0, print_visit);
+    PrintVisitor h1 = {"H1"}, h2 = {"H2"}, h3 = {"H3"}, h4 = {"H4"},
+                 h5 = {"H5"};
+    graph.walk_shortest_path(1, 3, 0, h1);
+    graph.walk_shortest_path(2, 4, 0, h2);
+    graph.walk_shortest_path(3, 1, 0, h3);
+    graph.walk_shortest_path(4, 4, 0, h4);
+    graph.walk_shortest_path(5, 2, 0, h5);
 
     /* Print the MST */
-    walk_shortest_path(graph, 5, 0xffffffff, NULL, 1, mst_visit);
+    MstPrinter mst;
+    graph.walk_shortest_path(5, 0xffffffff, 1, mst);
+
+    /* Moving a port to another link takes the old one down */
+    graph.add_edge(1, 1, 3, 1);
+    assert(!graph.has_any_edge(2, 1));
+    graph.remove_edge(3, 1);
+    assert(!graph.has_any_edge(1, 1));
 
-    graph_free(graph);
+    MST *tree = graph.make_mst();
+    assert(tree->size() == 5 && (*tree)[4].size() == 4);
+    delete tree;
 
+    test_interning();
+    test_walk_after_removal();
+    test_recable();
     return 0;
 }
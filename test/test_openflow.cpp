@@ -0,0 +1,539 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <vector>
+
+// Built with openflow.cpp itself, to reach its encoders and parsers
+#include "../openflow.cpp"
+
+static Server server;
+static Reactor *reactor;
+
+// A client that has just asked for its tables; nothing it writes is sent
+static Client *new_client(void) {
+    if (reactor == nullptr) {
+        reactor = new Reactor(&server);
+    }
+    return new Client(-1, reactor);
+}
+
+static uint64_t mac_key(uint8_t last) {
+    return 0x0000665544332200 | last;
+}
+
+/*
+ * Append what a switch says of a rule it was sent: the flow mod's match and
+ * instructions after a flow stats header
+ */
+static void add_stats(std::vector<uint8_t> *reply, const MsgBuf &flow_mod) {
+    const flow_mod_t *mod = (const flow_mod_t *)(flow_mod.data +
+                                                 sizeof(ofp_header_t));
+    size_t body = flow_mod.size - sizeof(ofp_header_t) - sizeof(flow_mod_t);
+    size_t start = reply->size();
+    flow_stats_t stats;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.length = htons((uint16_t)(offsetof(flow_stats_t, match) + body));
+    stats.table_id = mod->table_id;
+    stats.priority = mod->priority;
+    reply->resize(start + offsetof(flow_stats_t, match) + body);
+    memcpy(&(*reply)[start], &stats, offsetof(flow_stats_t, match));
+    memcpy(&(*reply)[start + offsetof(flow_stats_t, match)], mod->match, body);
+}
+
+// The table 1 rule add_dest_mac_rule or add_dest_mac_group_rule would send
+static MsgBuf host_rule(uint64_t mac, uint32_t port, uint32_t group) {
+    MsgBuf tmpl = group ? encode_dest_mac_group_rule() : encode_dest_mac_rule();
+
+    tmpl.data[FLOW_MOD_TABLE_OFFSET] = 1;
+    memcpy(tmpl.data + DEST_MAC_OFFSET, &mac, 6);
+    if (group) {
+        put32(tmpl.data + DEST_GROUP_OFFSET, group);
+    } else {
+        put32(tmpl.data + DEST_PORT_OFFSET, port);
+    }
+    return tmpl;
+}
+
+/*
+ * Append a group as the switch describes it. A group desc is laid out like
+ * the group mod that made it, with the length where the command was.
+ */
+static void add_desc(std::vector<uint8_t> *reply, const MsgBuf &group_mod) {
+    size_t body = group_mod.size - sizeof(ofp_header_t);
+    size_t start = reply->size();
+
+    reply->insert(reply->end(), group_mod.data + sizeof(ofp_header_t),
+                  group_mod.data + group_mod.size);
+    put16(&(*reply)[start], (uint16_t)body);
+}
+
+static MsgBuf select_group(uint32_t group_id, std::vector<uint32_t> ports) {
+    return encode_group_mod(OFPGC_ADD, OFPGT_SELECT, group_id, &ports,
+                            nullptr);
+}
+
+// Host rules, the broadcast rule and the table miss come back as written
+static void test_flow_round_trip(void) {
+    Client *client = new_client();
+    std::vector<uint8_t> reply;
+
+    add_stats(&reply, encode_table_miss(0));
+    add_stats(&reply, encode_table_miss(1));
+    add_stats(&reply, host_rule(mac_key(1), 7, 0));
+    add_stats(&reply, host_rule(mac_key(2), 0, 40));
+    add_stats(&reply, encode_broadcast_rule());
+    add_stats(&reply, host_rule(mac_key(3), 0xfffffff0, 0));
+    reconcile_flows(client, reply.data(), reply.size());
+
+    assert(client->written.size() == 3);
+    assert(client->written[mac_key(1)] == 7);
+    assert(client->written[mac_key(2)] == (ECMP_HOP | 40));
+    assert(client->written[mac_key(3)] == 0xfffffff0);
+    assert(client->has_bcast_rule);
+
+    // A table 0 rule for a MAC is not a host rule
+    client = new_client();
+    MsgBuf rule = host_rule(mac_key(4), 7, 0);
+    rule.data[FLOW_MOD_TABLE_OFFSET] = 0;
+    reply.clear();
+    add_stats(&reply, rule);
+    reconcile_flows(client, reply.data(), reply.size());
+    assert(client->written.empty() && !client->has_bcast_rule);
+}
+
+// Broadcast chunks and ECMP groups come back as encode_group_mod wrote them
+static void test_group_round_trip(void) {
+    Client *client = new_client();
+    std::vector<uint8_t> reply;
+    std::set<uint32_t> chunk0, chunk1, chained;
+    std::vector<uint32_t> ports;
+
+    chunk0.insert(1);
+    chunk0.insert(2);
+    chunk1.insert(300);
+    chained.insert(1);
+    add_desc(&reply, encode_group_mod(OFPGC_ADD, OFPGT_ALL, BCAST_GROUP_ID,
+                                      &chunk0, &chained));
+    add_desc(&reply, encode_group_mod(OFPGC_ADD, OFPGT_ALL,
+                                      BCAST_GROUP_ID + 1, &chunk1, nullptr));
+    ports.push_back(3);
+    ports.push_back(1);
+    ports.push_back(2);
+    add_desc(&reply, select_group(5, ports));
+    // The same ports again, in another order: one group is enough
+    std::swap(ports[0], ports[2]);
+    add_desc(&reply, select_group(9, ports));
+    ports.pop_back();
+    add_desc(&reply, select_group(6, ports));
+    reconcile_groups(client, reply.data(), reply.size());
+
+    assert(client->has_mst);
+    assert(client->bcast_chunks[0] == chunk0);
+    assert(client->bcast_chunks[1] == chunk1);
+    assert(client->bcast_chained == chained);
+
+    assert(client->ecmp_groups.size() == 2);
+    std::sort(ports.begin(), ports.end());
+    assert(client->ecmp_groups[ports] == 6);
+    ports.push_back(3);
+    assert(client->ecmp_groups[ports] == 5);
+    assert(client->ecmp_refs.size() == 2 && client->ecmp_refs.count(5));
+    assert(client->ecmp_refs.count(6) && !client->ecmp_refs.count(9));
+    // New groups are numbered past every one the switch has, kept or not
+    assert(client->next_ecmp_group == 10);
+}
+
+// Rules on a kept group count toward it; rules on any other group are gone
+static void test_count_group_refs(void) {
+    Client *client = new_client();
+    std::vector<uint8_t> reply;
+    std::vector<uint32_t> ports;
+
+    ports.push_back(1);
+    ports.push_back(2);
+    add_desc(&reply, select_group(5, ports));
+    add_desc(&reply, select_group(9, ports));
+    reconcile_groups(client, reply.data(), reply.size());
+    reply.clear();
+    add_stats(&reply, host_rule(mac_key(1), 4, 0));
+    add_stats(&reply, host_rule(mac_key(2), 0, 5));
+    add_stats(&reply, host_rule(mac_key(3), 0, 5));
+    add_stats(&reply, host_rule(mac_key(4), 0, 9));
+    add_stats(&reply, host_rule(mac_key(5), 0, 77));
+    reconcile_flows(client, reply.data(), reply.size());
+    count_group_refs(client);
+
+    assert(client->written.size() == 3);
+    assert(client->written[mac_key(1)] == 4);
+    assert(client->written.count(mac_key(2)) &&
+           client->written.count(mac_key(3)));
+    assert(client->ecmp_refs.size() == 1 && client->ecmp_refs[5] == 2);
+}
+
+/*
+ * A reply cut short anywhere gives exactly the entries that are whole, and
+ * a bad length stops the parse without reading past the reply
+ */
+static void test_truncated(void) {
+    std::vector<uint8_t> flows, groups;
+    std::vector<uint32_t> ports;
+    size_t flow_len, group_len, len, ndx;
+    Client *client;
+
+    for (ndx = 1; ndx <= 4; ndx++) {
+        add_stats(&flows, host_rule(mac_key((uint8_t)ndx), 1, 0));
+        ports.clear();
+        ports.push_back((uint32_t)ndx);
+        ports.push_back(10);
+        add_desc(&groups, select_group((uint32_t)ndx, ports));
+    }
+    flow_len = flows.size() / 4;
+    group_len = groups.size() / 4;
+
+    for (len = 0; len <= flows.size(); len++) {
+        // Copied, so anything read past the end is caught by the sanitizers
+        std::vector<uint8_t> cut(flows.begin(), flows.begin() + (long)len);
+        client = new_client();
+        reconcile_flows(client, cut.data(), cut.size());
+        assert(client->written.size() == len / flow_len);
+    }
+    for (len = 0; len <= groups.size(); len++) {
+        std::vector<uint8_t> cut(groups.begin(), groups.begin() + (long)len);
+        client = new_client();
+        reconcile_groups(client, cut.data(), cut.size());
+        assert(client->ecmp_groups.size() == len / group_len);
+    }
+
+    // An entry that claims more than is left ends the reply there
+    put16(&flows[flow_len], (uint16_t)(3 * flow_len + 1));
+    client = new_client();
+    reconcile_flows(client, flows.data(), flows.size());
+    assert(client->written.size() == 1);
+    put16(&groups[group_len], (uint16_t)(3 * group_len + 1));
+    client = new_client();
+    reconcile_groups(client, groups.data(), groups.size());
+    assert(client->ecmp_groups.size() == 1);
+
+    // So does one shorter than its header
+    put16(&flows[flow_len], 4);
+    client = new_client();
+    reconcile_flows(client, flows.data(), flows.size());
+    assert(client->written.size() == 1);
+    put16(&groups[group_len], 0);
+    client = new_client();
+    reconcile_groups(client, groups.data(), groups.size());
+    assert(client->ecmp_groups.size() == 1);
+}
+
+/*
+ * Bad lengths inside an entry lose that entry, and only that one: the next
+ * starts where the entry's own length says. A match that runs past its
+ * entry is the exception; nothing after it is trusted.
+ */
+static void test_bad_insides(void) {
+    const size_t match_at = offsetof(flow_stats_t, match);
+    const size_t instr_at = match_at + sizeof(match_t) + 8;
+    const size_t action_at = instr_at + sizeof(instr_write_t);
+    const size_t bucket_at = sizeof(group_desc_t);
+    std::vector<uint8_t> flows, good_flows, groups, good_groups;
+    std::vector<uint32_t> ports;
+    size_t flow_len, group_len;
+    Client *client;
+
+    add_stats(&good_flows, host_rule(mac_key(1), 1, 0));
+    add_stats(&good_flows, host_rule(mac_key(2), 2, 0));
+    flow_len = good_flows.size() / 2;
+    ports.push_back(1);
+    ports.push_back(2);
+    add_desc(&good_groups, select_group(1, ports));
+    ports.push_back(3);
+    ports.erase(ports.begin());
+    add_desc(&good_groups, select_group(2, ports));
+    group_len = sizeof(group_desc_t) + 2 * (sizeof(bucket_t) +
+                                            sizeof(action_output_t));
+
+    // A match that runs past the rule
+    flows = good_flows;
+    put16(&flows[match_at + offsetof(match_t, length)], 0xfff0);
+    client = new_client();
+    reconcile_flows(client, flows.data(), flows.size());
+    assert(client->written.empty());
+
+    // A match too short to hold the address
+    flows = good_flows;
+    put16(&flows[match_at + offsetof(match_t, length)], 12);
+    client = new_client();
+    reconcile_flows(client, flows.data(), flows.size());
+    assert(client->written.size() == 1 && client->written.count(mac_key(2)));
+
+    // An instruction of no length, and one past the end of the rule
+    flows = good_flows;
+    put16(&flows[instr_at + offsetof(instr_write_t, length)], 0);
+    put16(&flows[flow_len + instr_at + offsetof(instr_write_t, length)],
+          0x100);
+    client = new_client();
+    reconcile_flows(client, flows.data(), flows.size());
+    assert(client->written.empty());
+
+    // An action of no length
+    flows = good_flows;
+    put16(&flows[action_at + offsetof(action_output_t, length)], 0);
+    client = new_client();
+    reconcile_flows(client, flows.data(), flows.size());
+    assert(client->written.size() == 1 && client->written.count(mac_key(2)));
+
+    // A bucket too short for its action, and one past the end of the group:
+    // the switch is left to drop them, and the other group is kept
+    groups = good_groups;
+    put16(&groups[bucket_at], sizeof(bucket_t));
+    client = new_client();
+    reconcile_groups(client, groups.data(), groups.size());
+    assert(client->ecmp_groups.size() == 1 && client->ecmp_refs.count(2));
+    groups = good_groups;
+    put16(&groups[bucket_at + sizeof(bucket_t) + sizeof(action_output_t)],
+          0x200);
+    client = new_client();
+    reconcile_groups(client, groups.data(), groups.size());
+    assert(client->ecmp_groups.size() == 1 && client->ecmp_refs.count(2));
+
+    // A group of no buckets at all
+    groups = good_groups;
+    put16(&groups[0], sizeof(group_desc_t));
+    groups.erase(groups.begin() + sizeof(group_desc_t),
+                 groups.begin() + (long)group_len);
+    client = new_client();
+    reconcile_groups(client, groups.data(), groups.size());
+    assert(client->ecmp_groups.size() == 1 && client->ecmp_refs.count(2));
+    assert(client->next_ecmp_group == 3);
+}
+
+// Hand a PACKET_IN for a frame to dst to the forwarding, as if from port 3
+static void packet_in(Client *client, uint64_t dst, uint32_t buffer_id) {
+    uint8_t frame[64];
+    packet_in_t pack;
+    int ndx;
+
+    memset(&pack, 0, sizeof(pack));
+    memset(frame, 0, sizeof(frame));
+    pack.buffer_id = htonl(buffer_id);
+    pack.total_len = htons(sizeof(frame));
+    for (ndx = 0; ndx < 6; ndx++) {
+        frame[ndx] = (uint8_t)(dst >> (40 - 8 * ndx));
+    }
+    forward_packet_in(client, &pack, 3, frame, sizeof(frame));
+}
+
+// The PACKET_OUT sent for it: its buffer, and where its one action sends it
+static void check_packet_out(const Write &w, uint32_t buffer_id,
+                             uint16_t action_type, uint32_t target) {
+    const ofp_header_t *hdr = (const ofp_header_t *)w.buf.data;
+    const packet_out_t *out = (const packet_out_t *)hdr->data;
+    const action_output_t *action = out->actions;
+
+    assert(hdr->type == OFPT_PACKET_OUT && ntohs(hdr->length) == w.buf.size);
+    assert(ntohl(out->buffer_id) == buffer_id && ntohl(out->in_port) == 3);
+    if (action_type == OFPAT_OUTPUT) {
+        assert(ntohs(out->actions_len) == sizeof(action_output_t));
+        assert(ntohs(action->type) == OFPAT_OUTPUT);
+        assert(ntohl(action->port) == target);
+    } else {
+        assert(ntohs(out->actions_len) == sizeof(action_group_t));
+        assert(ntohs(action->type) == OFPAT_GROUP);
+        assert(ntohl(((const action_group_t *)action)->group_id) == target);
+    }
+}
+
+/*
+ * A packet the switch buffered is always answered: sent on, or released by
+ * a PACKET_OUT with no actions when it has nowhere to go but back
+ */
+static void test_forward_packet_in(void) {
+    Client *client = new_client();
+    std::vector<Write> posted;  // what it writes off its reactor waits there
+    const ofp_header_t *hdr;
+    const packet_out_t *out;
+
+    client->written[mac_key(1)] = 4;
+    client->written[mac_key(2)] = 3;
+    client->written[mac_key(3)] = ECMP_HOP | 40;
+    client->has_mst = 1;
+
+    packet_in(client, mac_key(1), 42);
+    posted = client->take_posted();
+    assert(posted.size() == 1);
+    check_packet_out(posted.back(), 42, OFPAT_OUTPUT, 4);
+    packet_in(client, mac_key(3), OFP_NO_BUFFER);
+    posted = client->take_posted();
+    assert(posted.size() == 1);
+    check_packet_out(posted.back(), OFP_NO_BUFFER, OFPAT_GROUP, 40);
+    assert(posted.back().buf.size == sizeof(ofp_header_t) +
+                                         sizeof(packet_out_t) +
+                                         sizeof(action_group_t) + 64);
+    packet_in(client, mac_key(9), 43);
+    posted = client->take_posted();
+    assert(posted.size() == 1);
+    check_packet_out(posted.back(), 43, OFPAT_GROUP, BCAST_GROUP_ID);
+
+    // Back where it came from: not sent, and the buffer let go
+    packet_in(client, mac_key(2), OFP_NO_BUFFER);
+    assert(client->take_posted().empty());
+    packet_in(client, mac_key(2), 44);
+    posted = client->take_posted();
+    assert(posted.size() == 1);
+    hdr = (const ofp_header_t *)posted.back().buf.data;
+    out = (const packet_out_t *)hdr->data;
+    assert(hdr->type == OFPT_PACKET_OUT);
+    assert(ntohs(hdr->length) == sizeof(ofp_header_t) + sizeof(packet_out_t));
+    assert(ntohl(out->buffer_id) == 44 && out->actions_len == 0);
+
+    // Unknown, with no broadcast group to flood it on yet
+    client->has_mst = 0;
+    packet_in(client, mac_key(9), OFP_NO_BUFFER);
+    assert(client->take_posted().empty());
+    packet_in(client, mac_key(9), 45);
+    posted = client->take_posted();
+    assert(posted.size() == 1);
+    hdr = (const ofp_header_t *)posted.back().buf.data;
+    out = (const packet_out_t *)hdr->data;
+    assert(ntohl(out->buffer_id) == 45 && out->actions_len == 0);
+}
+
+// A PACKET_IN from port, as its reactor has it: the length in host order
+static MsgBuf packet_in_from(uint32_t port) {
+    uint16_t length = (uint16_t)(sizeof(ofp_header_t) + sizeof(packet_in_t) +
+                                 8 + 2 + 14);
+    MsgBuf buf = make_packet(OFPT_PACKET_IN, length, 0);
+    ofp_header_t *hdr = (ofp_header_t *)buf.data;
+    packet_in_t *pack = (packet_in_t *)hdr->data;
+
+    hdr->length = length;
+    pack->buffer_id = htonl(OFP_NO_BUFFER);
+    pack->match.type = htons(OFPMT_OXM);
+    pack->match.length = htons(12);
+    put32(pack->match.oxm_fields, ((uint32_t)OFPXMC_OPENFLOW_BASIC << 16) |
+                                      (OFPXMT_OFB_IN_PORT << 9) | 4);
+    put32(pack->match.oxm_fields + 4, port);
+    return buf;
+}
+
+/*
+ * A port over its limit is shed on its own, without spending the switch's
+ * tokens, so the other ports get what it leaves; the switch's limit holds
+ * them all together. Tokens come back as the clock runs, so allow for that.
+ */
+static void test_packet_in_limits(void) {
+    Client *client = new_client();
+    unsigned admitted[8], port, ndx, total = 0;
+    uint64_t start = server.now_ms(), slack;
+
+    client->packet_in_limit = TokenBucket(PACKET_IN_RATE, PACKET_IN_BURST);
+    for (port = 1; port < 8; port++) {
+        MsgBuf buf = packet_in_from(port);
+        admitted[port] = 0;
+        for (ndx = 0; ndx < 3 * PORT_PACKET_IN_BURST; ndx++) {
+            admitted[port] +=
+                admit_packet_in(client, (const ofp_header_t *)buf.data);
+        }
+        total += admitted[port];
+    }
+    slack = server.now_ms() - start + 1;
+
+    assert(admitted[1] >= PORT_PACKET_IN_BURST);
+    assert(admitted[1] <= PORT_PACKET_IN_BURST + slack);
+    for (port = 2; port <= PACKET_IN_BURST / PORT_PACKET_IN_BURST; port++) {
+        assert(admitted[port] >= PORT_PACKET_IN_BURST);
+    }
+    assert(total >= PACKET_IN_BURST && total <= PACKET_IN_BURST + slack);
+    assert(client->packet_ins_admitted == total);
+    assert(client->packet_ins_shed > 0);
+    assert(client->packet_ins_shed + client->packet_ins_port_shed + total ==
+           7 * 3 * PORT_PACKET_IN_BURST);
+}
+
+/*
+ * Only the table miss goes through the PACKET_IN meter, a meter of our own
+ * rather than the switch's controller meter, which the beacons would go
+ * through as well. A switch that errors it gets the table miss unmetered.
+ */
+static void test_table_miss_meter(void) {
+    Client *client = new_client();
+    std::vector<Write> posted;
+    MsgBuf plain = encode_table_miss(0);
+    const uint8_t *miss, *instr;
+    std::vector<uint8_t> error(sizeof(ofp_header_t) + sizeof(ofp_error_t));
+    ofp_header_t *err = (ofp_header_t *)error.data();
+
+    setup_packet_in_meter(client);
+    setup_table_miss(client, 1);
+    posted = client->take_posted();
+    assert(posted.size() == 2);
+    const meter_mod_t *meter_mod =
+        (const meter_mod_t *)(posted[0].buf.data + sizeof(ofp_header_t));
+    assert(ntohl(meter_mod->meter_id) == PACKET_IN_METER);
+
+    miss = posted[1].buf.data;
+    assert(posted[1].buf.size == plain.size + sizeof(instr_meter_t));
+    instr = miss + sizeof(ofp_header_t) + sizeof(flow_mod_t) + sizeof(match_t);
+    const instr_meter_t *meter = (const instr_meter_t *)instr;
+    assert(ntohs(meter->type) == OFPIT_METER);
+    assert(ntohl(meter->meter_id) == PACKET_IN_METER);
+    assert(memcmp(instr + sizeof(instr_meter_t),
+                  plain.data + (instr - miss),
+                  plain.size - (size_t)(instr - miss)) == 0);
+
+    // No meters: the meter mod's error is let be, the miss's sends it plain
+    err->xid = PACKET_IN_METER_XID;
+    handle_error(client, err);
+    assert(client->take_posted().empty());
+    err->xid = METERED_MISS_XID;
+    handle_error(client, err);
+    posted = client->take_posted();
+    assert(posted.size() == 1 && posted[0].buf.size == plain.size);
+    assert(memcmp(posted[0].buf.data, plain.data, plain.size) == 0);
+}
+
+/*
+ * PACKET_INs on a switch's auxiliary connections are charged to the same
+ * buckets as those on its main connection, whichever reactor they come on
+ */
+static void test_aux_packet_in_limits(void) {
+    Client *main_conn = new_client(), *aux = new_client();
+    MsgBuf buf = packet_in_from(1);
+    unsigned ndx, admitted = 0;
+
+    main_conn->uid = aux->uid = 0x77;
+    main_conn->packet_in_limit = TokenBucket(PACKET_IN_RATE, PACKET_IN_BURST);
+    client_table[main_conn->uid] = main_conn;
+    aux->handshake_done = 1;
+    bind_auxiliary(aux, 1);
+    assert(aux->main_conn == main_conn);
+
+    for (ndx = 0; ndx < PORT_PACKET_IN_BURST; ndx++) {
+        admitted += admit_packet_in(main_conn, (const ofp_header_t *)buf.data);
+        admitted += admit_packet_in(aux, (const ofp_header_t *)buf.data);
+    }
+    assert(admitted < PORT_PACKET_IN_BURST + PORT_PACKET_IN_BURST / 2);
+    assert(main_conn->packet_ins_admitted == admitted);
+    assert(main_conn->packet_ins_port_shed == 2 * PORT_PACKET_IN_BURST -
+                                                  admitted);
+    assert(aux->packet_ins_admitted == 0 && aux->port_limits.empty());
+    client_table.erase(main_conn->uid);
+}
+
+int main(void) {
+    test_flow_round_trip();
+    test_group_round_trip();
+    test_count_group_refs();
+    test_truncated();
+    test_bad_insides();
+    test_forward_packet_in();
+    test_packet_in_limits();
+    test_table_miss_meter();
+    test_aux_packet_in_limits();
+    return 0;
+}
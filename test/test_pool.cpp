@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Built with pool.cpp itself, to see its classes, caches and depot
+#include "../pool.cpp"
+
+static unsigned block_class(const void* ptr) {
+    return ((const block_header_t*)ptr - 1)->cls;
+}
+
+static size_t depot_count(unsigned cls) {
+    std::lock_guard<std::mutex> guard(depot_lock);
+    const free_block_t* block;
+    size_t count = 0;
+
+    for (block = depot[cls]; block != nullptr; block = block->next) {
+        count++;
+    }
+    return count;
+}
+
+// A new slab leaves the thread a batch, not so many the next free spills
+static void test_refill(void) {
+    void* block = pool_alloc(100);
+    size_t per_slab = SLAB_SIZE / (sizeof(block_header_t) + 128);
+
+    assert(cache.count[1] == DEPOT_BATCH - 1);
+    assert(depot_count(1) == per_slab - DEPOT_BATCH);
+    pool_free(block);
+    assert(cache.count[1] == DEPOT_BATCH);
+    assert(cache.head[1] == block);
+}
+
+// Each size gets the smallest power of two from 64 bytes that holds it
+static void test_size_classes(void) {
+    unsigned cls;
+    size_t size;
+
+    assert(size_class(0) == 0);
+    assert(size_class(1) == 0);
+    assert(size_class(64) == 0);
+    for (cls = 1; cls < NUM_CLASSES; cls++) {
+        size_t top = (size_t)1 << (cls + MIN_CLASS_SHIFT);
+        assert(size_class(top / 2 + 1) == cls);
+        assert(size_class(top) == cls);
+    }
+    assert(size_class(16384) == NUM_CLASSES - 1);
+    assert(size_class(16385) == LARGE_CLASS);
+    assert(size_class(65535) == LARGE_CLASS);
+
+    // Blocks are tagged with their class, and hold all that was asked for
+    for (size = 1; size <= 65535; size = size * 3 + 1) {
+        uint8_t* ptr = (uint8_t*)pool_alloc(size);
+        assert(block_class(ptr) == size_class(size));
+        memset(ptr, 0xa5, size);
+        pool_free(ptr);
+    }
+}
+
+// A freed block is the next one handed out of its class, and only its class
+static void test_reuse(void) {
+    void *small = pool_alloc(100), *big = pool_alloc(1000), *again;
+
+    pool_free(small);
+    again = pool_alloc(1000);
+    assert(again != small);
+    pool_free(again);
+    again = pool_alloc(128);
+    assert(again == small);
+    pool_free(again);
+    pool_free(big);
+}
+
+// On a thread of its own: take a block, and see what is left in the cache
+static void alloc_elsewhere(unsigned cls, void** taken, unsigned* left) {
+    *taken = pool_alloc(200);
+    *left = cache.count[cls];
+}
+
+/*
+ * A thread that frees more than it keeps spills the surplus to the depot,
+ * in batches, and another thread's allocations are served from there.
+ */
+static void test_spill(void) {
+    const unsigned cls = 2;
+    std::vector<void*> blocks;
+    std::set<void*> spilled;
+    size_t ndx, before = depot_count(cls);
+    unsigned other_count = 0;
+    void* taken = nullptr;
+
+    for (ndx = 0; ndx < 4 * CACHE_LIMIT; ndx++) {
+        blocks.push_back(pool_alloc(200));
+    }
+    for (ndx = 0; ndx < blocks.size(); ndx++) {
+        pool_free(blocks[ndx]);
+        assert(cache.count[cls] <= CACHE_LIMIT);
+    }
+    assert(depot_count(cls) >= before + blocks.size() - CACHE_LIMIT);
+    {
+        std::lock_guard<std::mutex> guard(depot_lock);
+        const free_block_t* block;
+        for (block = depot[cls]; block != nullptr; block = block->next) {
+            spilled.insert((void*)block);
+        }
+    }
+
+    std::thread other(alloc_elsewhere, cls, &taken, &other_count);
+    other.join();
+    assert(spilled.count(taken));
+    assert(other_count == DEPOT_BATCH - 1);
+    pool_free(taken);
+}
+
+// A MsgBuf has one owner; moving it hands the block over
+static void test_msgbuf(void) {
+    static_assert(!std::is_copy_constructible<MsgBuf>::value, "copyable");
+    static_assert(!std::is_copy_assignable<MsgBuf>::value, "copyable");
+    static_assert(std::is_move_constructible<MsgBuf>::value, "not movable");
+
+    MsgBuf a((uint16_t)300), empty;
+    uint8_t* block = a.data;
+    uint8_t* replaced;
+    uint16_t ndx;
+
+    for (ndx = 0; ndx < 300; ndx++) {
+        assert(a.data[ndx] == 0);
+    }
+    assert(empty.data == nullptr && empty.size == 0);
+
+    MsgBuf b(std::move(a));
+    assert(a.data == nullptr && a.size == 0);
+    assert(b.data == block && b.size == 300);
+
+    // Assigning over a buffer gives its old block back to the pool
+    MsgBuf c("abc", 3);
+    replaced = c.data;
+    c = std::move(b);
+    assert(c.data == block && c.size == 300);
+    assert(b.data == nullptr && b.size == 0);
+    assert(pool_alloc(3) == replaced);
+    pool_free(replaced);
+
+    MsgBuf d("hdr", 3, 2000);
+    assert(d.size == 2000 && memcmp(d.data, "hdr", 3) == 0);
+    assert(block_class(d.data) == size_class(2000));
+}
+
+int main(void) {
+    test_refill();
+    test_size_classes();
+    test_reuse();
+    test_spill();
+    test_msgbuf();
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <assert.h>
+#include <stdint.h>
+#include "../ratelimit.h"
+
+// Take every token there is at time now
+static unsigned drain(TokenBucket *bucket, uint64_t now) {
+    unsigned taken = 0;
+
+    while (bucket->take(now)) {
+        taken++;
+    }
+    return taken;
+}
+
+// A new bucket is full: burst tokens at once, then none until it refills
+static void test_burst(void) {
+    TokenBucket bucket(100, 20), none;
+
+    assert(drain(&bucket, 5000) == 20);
+    assert(drain(&bucket, 5000) == 0);
+    assert(drain(&none, 5000) == 0);
+}
+
+// Refilled at rate per second, a millisecond at a time, up to burst only
+static void test_refill(void) {
+    TokenBucket bucket(100, 20);
+
+    assert(drain(&bucket, 1000) == 20);
+    assert(drain(&bucket, 1009) == 0);
+    assert(drain(&bucket, 1010) == 1);
+    assert(drain(&bucket, 1060) == 5);
+    assert(drain(&bucket, 1260) == 20);
+    assert(drain(&bucket, 100000) == 20);
+}
+
+// The part of a token a tick brings is kept, at however slow a rate
+static void test_slow_rate(void) {
+    TokenBucket bucket(3, 5);
+    unsigned taken = 0;
+    uint64_t now;
+
+    assert(drain(&bucket, 0) == 5);
+    for (now = 1; now <= 10000; now++) {
+        taken += drain(&bucket, now);
+    }
+    assert(taken == 30);
+}
+
+// A clock that steps back brings no tokens, nor does coming forward again
+static void test_clock_back(void) {
+    TokenBucket bucket(100, 20);
+
+    assert(drain(&bucket, 1000) == 20);
+    assert(drain(&bucket, 500) == 0);
+    assert(drain(&bucket, 1000) == 0);
+    assert(drain(&bucket, 1010) == 1);
+}
+
+int main(void) {
+    test_burst();
+    test_refill();
+    test_slow_rate();
+    test_clock_back();
+    return 0;
+}
@@ -0,0 +1,770 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Built with routes.cpp itself, to look inside the table
+#include "../routes.cpp"
+
+#define SWITCHES 12
+#define PORTS 6
+
+typedef std::map<std::pair<uint32_t, uint32_t>, route_change_t> change_map_t;
+
+class RouteTest {
+   public:
+    static std::vector<route_change_t> update(RouteTable*, Graph*, unsigned);
+    static uint32_t dist_of(const RouteTable&, uint32_t, uint32_t);
+    static uint64_t ways_of(const RouteTable&, uint32_t, uint32_t);
+    static void check_fresh(const RouteTable&, const Graph&);
+    static void check_changes(const RouteTable&, const Graph&,
+                              const RouteTable&, const Graph&,
+                              const std::vector<route_change_t>&);
+    static void test_row_reuse(void);
+};
+
+/*
+ * One update the way the owner runs it, over the links changed since the
+ * last, split into parts run one after another
+ */
+std::vector<route_change_t> RouteTest::update(RouteTable* routes,
+                                              Graph* graph, unsigned parts) {
+    std::vector<route_change_t> changes;
+    std::vector<uint32_t> touched;
+    unsigned part;
+
+    touched.swap(graph->touched);
+    routes->begin_update(*graph, &touched);
+    for (part = 0; part < parts; part++) {
+        routes->update_part(*graph, touched, part, parts, &changes);
+    }
+    return changes;
+}
+
+uint32_t RouteTest::dist_of(const RouteTable& routes, uint32_t vertex,
+                            uint32_t dest) {
+    return routes.dist[routes.rows[dest] * routes.stride + vertex];
+}
+
+uint64_t RouteTest::ways_of(const RouteTable& routes, uint32_t vertex,
+                            uint32_t dest) {
+    return routes.ways[routes.rows[dest] * routes.stride + vertex];
+}
+
+// Every row is what a table filled from scratch over the same graph holds
+void RouteTest::check_fresh(const RouteTable& routes, const Graph& graph) {
+    RouteTable fresh;
+    Graph copy = graph;
+    std::vector<uint32_t> dests;
+    uint32_t vertex;
+    size_t ndx;
+
+    routes.destinations(&dests);
+    for (ndx = 0; ndx < dests.size(); ndx++) {
+        fresh.track(dests[ndx]);
+    }
+    copy.touched.clear();
+    update(&fresh, &copy, 1);
+
+    for (ndx = 0; ndx < dests.size(); ndx++) {
+        for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+            assert(dist_of(routes, vertex, dests[ndx]) ==
+                   dist_of(fresh, vertex, dests[ndx]));
+            assert(routes.next_hop(vertex, dests[ndx]) ==
+                   fresh.next_hop(vertex, dests[ndx]));
+            assert(ways_of(routes, vertex, dests[ndx]) ==
+                   ways_of(fresh, vertex, dests[ndx]));
+        }
+    }
+}
+
+/*
+ * Every switch whose ports toward a destination differ from before came out
+ * as a change, even if only the edges under its ways moved, and every change
+ * that came out is what the table holds now
+ */
+void RouteTest::check_changes(const RouteTable& before,
+                              const Graph& old_graph, const RouteTable& after,
+                              const Graph& graph,
+                              const std::vector<route_change_t>& changes) {
+    change_map_t last;
+    change_map_t::iterator it;
+    std::vector<uint32_t> dests, old_ports, ports;
+    uint32_t vertex;
+    size_t ndx;
+
+    for (ndx = 0; ndx < changes.size(); ndx++) {
+        last[std::make_pair(changes[ndx].vertex, changes[ndx].dest)] =
+            changes[ndx];
+    }
+    for (it = last.begin(); it != last.end(); it++) {
+        assert(after.next_hop(it->second.vertex, it->second.dest) ==
+               it->second.port);
+        assert(ways_of(after, it->second.vertex, it->second.dest) ==
+               it->second.ways);
+    }
+
+    after.destinations(&dests);
+    for (ndx = 0; ndx < dests.size(); ndx++) {
+        if (!before.tracking(dests[ndx])) {
+            continue;
+        }
+        for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+            before.next_hops(old_graph, vertex, dests[ndx], &old_ports);
+            after.next_hops(graph, vertex, dests[ndx], &ports);
+            if (old_ports != ports) {
+                assert(last.count(std::make_pair(vertex, dests[ndx])));
+            }
+        }
+    }
+}
+
+/*
+ * Links come and go, and ports are cabled to somewhere else, at random. After
+ * each change the repaired table must be what filling it afresh gives.
+ */
+static void test_churn(unsigned seed) {
+    RouteTable routes;
+    Graph graph;
+    std::vector<route_change_t> changes;
+    unsigned step, links = 0;
+    uint64_t sw;
+
+    srand(seed);
+    for (sw = 1; sw <= SWITCHES; sw++) {
+        graph.add_vertex(sw);
+    }
+    routes.track(graph.vertex(1));
+    routes.track(graph.vertex(5));
+    routes.track(graph.vertex(SWITCHES));
+    RouteTest::update(&routes, &graph, 1);
+    RouteTest::check_fresh(routes, graph);
+
+    for (step = 0; step < 400; step++) {
+        RouteTable before = routes;
+        Graph old_graph = graph;
+        uint64_t from = 1 + (uint64_t)rand() % SWITCHES;
+        uint64_t to = 1 + (uint64_t)rand() % SWITCHES;
+        uint32_t fport = 1 + (uint32_t)rand() % PORTS;
+        uint32_t tport = 1 + (uint32_t)rand() % PORTS;
+
+        // A few changes at once now and then, as between two updates
+        do {
+            if (rand() % 3 == 0) {
+                graph.remove_edge(from, fport);
+            } else if (from != to) {
+                graph.add_edge(from, fport, to, tport);
+                links++;
+            }
+            from = 1 + (uint64_t)rand() % SWITCHES;
+            fport = 1 + (uint32_t)rand() % PORTS;
+        } while (rand() % 4 == 0);
+
+        changes = RouteTest::update(&routes, &graph, 1 + step % 3);
+        RouteTest::check_fresh(routes, graph);
+        RouteTest::check_changes(before, old_graph, routes, graph, changes);
+    }
+    printf("seed %u: %u links added\n", seed, links);
+}
+
+/* Moving a cable to a nearer switch, then back, moves the next hop with it */
+static void test_recable(void) {
+    RouteTable routes;
+    Graph graph;
+    uint32_t dest;
+
+    // A line, 1 - 2 - 3 - 4, toward 4
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(2, 2, 3, 1);
+    graph.add_edge(3, 2, 4, 1);
+    dest = graph.vertex(4);
+    routes.track(dest);
+    RouteTest::update(&routes, &graph, 1);
+    assert(routes.next_hop(graph.vertex(1), dest) == 1);
+    assert(RouteTest::dist_of(routes, graph.vertex(1), dest) ==
+           3 * DEFAULT_PORT_COST);
+
+    // 1's port goes straight to 4; 2 is left to reach it through 3
+    graph.add_edge(1, 1, 4, 2);
+    RouteTest::update(&routes, &graph, 1);
+    RouteTest::check_fresh(routes, graph);
+    assert(routes.next_hop(graph.vertex(1), dest) == 1);
+    assert(RouteTest::dist_of(routes, graph.vertex(1), dest) ==
+           DEFAULT_PORT_COST);
+    assert(routes.next_hop(graph.vertex(2), dest) == 2);
+
+    // Then to 2 again, on a port 2 had not used
+    graph.add_edge(1, 1, 2, 3);
+    RouteTest::update(&routes, &graph, 1);
+    RouteTest::check_fresh(routes, graph);
+    assert(!graph.has_any_edge(4, 2) && !graph.has_any_edge(2, 1));
+    assert(RouteTest::dist_of(routes, graph.vertex(1), dest) ==
+           3 * DEFAULT_PORT_COST);
+}
+
+/*
+ * Each update is a new epoch, and stamps only the entries it changed, so a
+ * switch last brought up to date some epochs ago sees every change since
+ * then and none from before
+ */
+static void test_epochs(void) {
+    RouteTable routes;
+    Graph graph;
+    uint32_t dest, one, two, three;
+    uint64_t filled, cut;
+
+    // 1 - 2 - 3, and 4 on 3, toward 4
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(2, 2, 3, 1);
+    graph.add_edge(3, 2, 4, 1);
+    one = graph.vertex(1);
+    two = graph.vertex(2);
+    three = graph.vertex(3);
+    dest = graph.vertex(4);
+    routes.track(dest);
+    RouteTest::update(&routes, &graph, 1);
+    filled = routes.epoch;
+    assert(routes.changed_since(one, dest, filled - 1));
+    assert(!routes.changed_since(one, dest, filled));
+
+    /*
+     * A second link from 2 to 3 changes 2's ways. 3's links changed too, so
+     * it goes out again; 1's did not, and nor did its route.
+     */
+    graph.add_edge(2, 3, 3, 3);
+    RouteTest::update(&routes, &graph, 1);
+    cut = routes.epoch;
+    assert(cut == filled + 1);
+    assert(routes.changed_since(two, dest, filled));
+    assert(routes.changed_since(three, dest, filled));
+    assert(!routes.changed_since(one, dest, filled));
+
+    // An update that changes nothing still moves on
+    RouteTest::update(&routes, &graph, 1);
+    assert(routes.epoch == cut + 1);
+    assert(!routes.changed_since(two, dest, cut));
+    assert(routes.changed_since(two, dest, filled));
+
+    // A change of hosts there is news to every switch, once
+    routes.mark(dest);
+    assert(routes.changed_since(one, dest, cut + 1));
+    assert(routes.changed_since(three, dest, cut + 1));
+    assert(!routes.changed_since(one, dest, routes.epoch));
+
+    // Marking or asking about a switch not followed does nothing
+    cut = routes.epoch;
+    routes.mark(one);
+    assert(routes.epoch == cut);
+    assert(!routes.changed_since(two, one, 0));
+    assert(!routes.changed_since(SWITCHES * 2, dest, 0));
+}
+
+/*
+ * A destination no longer followed gives its row to the next one, which is
+ * filled afresh rather than left with the old one's paths
+ */
+void RouteTest::test_row_reuse(void) {
+    RouteTable routes;
+    Graph graph;
+    std::vector<uint32_t> dests;
+    uint32_t one, two, three, row;
+    uint64_t untracked;
+
+    // A line, 1 - 2 - 3
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(2, 2, 3, 1);
+    one = graph.vertex(1);
+    two = graph.vertex(2);
+    three = graph.vertex(3);
+    routes.track(one);
+    routes.track(three);
+    update(&routes, &graph, 1);
+    row = routes.rows[three];
+    assert(routes.next_hop(two, three) == 2);
+
+    routes.untrack(three);
+    routes.untrack(three);
+    untracked = routes.epoch;
+    assert(!routes.tracking(three));
+    assert(routes.next_hop(two, three) == NO_ROUTE);
+    routes.destinations(&dests);
+    assert(dests.size() == 1 && dests[0] == one);
+
+    routes.track(two);
+    assert(routes.rows[two] == row && routes.dests.size() == 2);
+    update(&routes, &graph, 1);
+    check_fresh(routes, graph);
+    assert(routes.next_hop(one, two) == 1 && routes.next_hop(three, two) == 1);
+    assert(routes.next_hop(two, two) == NO_ROUTE);
+    assert(dist_of(routes, two, two) == 0);
+    assert(routes.changed_since(two, two, untracked));
+
+    // Room for switches added after, without losing what is there
+    for (row = 4; row <= 4 * SWITCHES; row++) {
+        graph.add_edge(row - 1, 3, row, 2);
+    }
+    update(&routes, &graph, 1);
+    check_fresh(routes, graph);
+    assert(routes.stride >= graph.num_vertices());
+    assert(routes.next_hop(graph.vertex(4 * SWITCHES), one) == 2);
+}
+
+/* The cost through a switch's closest neighbor with a way on, if any */
+static void test_nearest(void) {
+    Graph graph;
+    std::vector<uint32_t> dist;
+    uint32_t one, two, three, four;
+
+    // 1 links to 2 and 3; 4 is off on its own
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(1, 2, 3, 1);
+    graph.add_vertex(4);
+    one = graph.vertex(1);
+    two = graph.vertex(2);
+    three = graph.vertex(3);
+    four = graph.vertex(4);
+    dist.assign(graph.num_vertices(), NO_ROUTE);
+
+    assert(nearest(graph, &dist[0], one) == NO_ROUTE);
+    assert(nearest(graph, &dist[0], four) == NO_ROUTE);
+    dist[three] = 50;
+    assert(nearest(graph, &dist[0], one) == 50 + DEFAULT_PORT_COST);
+    dist[two] = 70;
+    assert(nearest(graph, &dist[0], one) == 50 + DEFAULT_PORT_COST);
+    dist[two] = 20;
+    assert(nearest(graph, &dist[0], one) == 20 + DEFAULT_PORT_COST);
+
+    // Its own cost does not count
+    dist[one] = 0;
+    assert(nearest(graph, &dist[0], one) == 20 + DEFAULT_PORT_COST);
+    assert(nearest(graph, &dist[0], two) == DEFAULT_PORT_COST);
+}
+
+/*
+ * What a row should hold given its costs: the lowest port to a neighbor on
+ * a cheapest path, and a way for each edge from it on that also is
+ */
+static void hops_from(const Graph& graph, uint32_t dest,
+                      const std::vector<uint32_t>& dist,
+                      std::vector<uint32_t>* next,
+                      std::vector<uint64_t>* ways) {
+    uint32_t vertex;
+    size_t ndx, first;
+
+    next->assign(graph.num_vertices(), NO_ROUTE);
+    ways->assign(graph.num_vertices(), 0);
+    for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+        const std::vector<edge_t>& edges = graph.neighbors(vertex);
+        if (dist[vertex] == NO_ROUTE || vertex == dest) {
+            continue;
+        }
+        for (ndx = 0, first = edges.size(); ndx < edges.size(); ndx++) {
+            if (dist[edges[ndx].to] == NO_ROUTE ||
+                dist[edges[ndx].to] + edges[ndx].cost != dist[vertex]) {
+                continue;
+            }
+            if (first == edges.size()) {
+                first = ndx;
+                (*next)[vertex] = edges[ndx].port;
+            }
+            (*ways)[vertex] |= 1ULL << (ndx - first);
+        }
+    }
+}
+
+// A plain BFS out from dest, for what fill should give
+static void bfs(const Graph& graph, uint32_t dest, uint32_t unit,
+                std::vector<uint32_t>* dist, std::vector<uint32_t>* next,
+                std::vector<uint64_t>* ways) {
+    std::vector<uint32_t> queue(1, dest);
+    size_t head, ndx;
+
+    dist->assign(graph.num_vertices(), NO_ROUTE);
+    (*dist)[dest] = 0;
+    for (head = 0; head < queue.size(); head++) {
+        const std::vector<edge_t>& edges = graph.neighbors(queue[head]);
+        for (ndx = 0; ndx < edges.size(); ndx++) {
+            if ((*dist)[edges[ndx].to] == NO_ROUTE) {
+                (*dist)[edges[ndx].to] = (*dist)[queue[head]] + unit;
+                queue.push_back(edges[ndx].to);
+            }
+        }
+    }
+    hops_from(graph, dest, *dist, next, ways);
+}
+
+// Costs to dest by relaxing every edge until none gets cheaper
+static void bellman_ford(const Graph& graph, uint32_t dest,
+                         std::vector<uint32_t>* dist,
+                         std::vector<uint32_t>* next,
+                         std::vector<uint64_t>* ways) {
+    uint32_t vertex;
+    uint8_t changed;
+    size_t ndx;
+
+    dist->assign(graph.num_vertices(), NO_ROUTE);
+    (*dist)[dest] = 0;
+    do {
+        changed = 0;
+        for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+            const std::vector<edge_t>& edges = graph.neighbors(vertex);
+            for (ndx = 0; ndx < edges.size(); ndx++) {
+                uint32_t far = (*dist)[edges[ndx].to];
+                uint32_t cost = far + edges[ndx].cost;
+                if (far != NO_ROUTE && cost < (*dist)[vertex]) {
+                    (*dist)[vertex] = cost;
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+    hops_from(graph, dest, *dist, next, ways);
+}
+
+/*
+ * Two islands of random links and a few lone switches, every one of them a
+ * destination: more than a batch of 64, and a last batch partly full. Each
+ * row fill gives must be what a BFS of its own gives, and each switch that
+ * can reach a destination comes out as a change, once.
+ */
+static void test_fill(unsigned seed, unsigned parts) {
+    RouteTable routes;
+    Graph graph;
+    std::vector<route_change_t> changes;
+    std::vector<uint32_t> dist, next;
+    std::vector<uint64_t> ways;
+    std::map<std::pair<uint32_t, uint32_t>, size_t> seen;
+    uint32_t dest, vertex;
+    size_t ndx, reachable = 0;
+    uint64_t sw;
+
+    srand(seed);
+    for (sw = 0; sw < 150; sw++) {
+        graph.add_vertex(sw);
+    }
+    for (ndx = 0; ndx < 300; ndx++) {
+        uint64_t base = rand() % 2 ? 0 : 80, from, to;
+        from = base + (uint64_t)rand() % (base ? 60 : 80);
+        to = base + (uint64_t)rand() % (base ? 60 : 80);
+        if (from != to) {
+            graph.add_edge(from, 1 + (uint32_t)rand() % 8, to,
+                           1 + (uint32_t)rand() % 8);
+        }
+    }
+    for (dest = 0; dest < graph.num_vertices(); dest++) {
+        routes.track(dest);
+    }
+    changes = RouteTest::update(&routes, &graph, parts);
+
+    for (dest = 0; dest < graph.num_vertices(); dest++) {
+        bfs(graph, dest, DEFAULT_PORT_COST, &dist, &next, &ways);
+        for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+            assert(RouteTest::dist_of(routes, vertex, dest) == dist[vertex]);
+            assert(routes.next_hop(vertex, dest) == next[vertex]);
+            assert(RouteTest::ways_of(routes, vertex, dest) == ways[vertex]);
+            reachable += next[vertex] != NO_ROUTE;
+        }
+        // The islands do not reach each other, nor the lone switches
+        assert(dest >= 140 || dist[dest < 80 ? 80 : 0] == NO_ROUTE);
+        assert(dest == 145 || dist[145] == NO_ROUTE);
+    }
+
+    assert(changes.size() == reachable);
+    for (ndx = 0; ndx < changes.size(); ndx++) {
+        std::pair<uint32_t, uint32_t> key(changes[ndx].vertex,
+                                          changes[ndx].dest);
+        assert(!seen.count(key));
+        seen[key] = ndx;
+        assert(changes[ndx].port ==
+               routes.next_hop(changes[ndx].vertex, changes[ndx].dest));
+    }
+    printf("seed %u, %u parts: %zu routes\n", seed, parts, reachable);
+}
+
+// Every row of routes holds the cheapest paths Bellman-Ford finds
+static void check_cheapest(const RouteTable& routes, const Graph& graph) {
+    std::vector<uint32_t> dests, dist, next;
+    std::vector<uint64_t> ways;
+    uint32_t vertex;
+    size_t ndx;
+
+    routes.destinations(&dests);
+    for (ndx = 0; ndx < dests.size(); ndx++) {
+        bellman_ford(graph, dests[ndx], &dist, &next, &ways);
+        for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+            assert(RouteTest::dist_of(routes, vertex, dests[ndx]) ==
+                   dist[vertex]);
+            assert(routes.next_hop(vertex, dests[ndx]) == next[vertex]);
+            assert(RouteTest::ways_of(routes, vertex, dests[ndx]) ==
+                   ways[vertex]);
+        }
+    }
+}
+
+/*
+ * Ports of three speeds, cabled at random: new rows are filled by Dijkstra,
+ * and repaired as links and costs change, and both must find the cheapest
+ * paths, not the fewest hops
+ */
+static void test_weighted(unsigned seed) {
+    static const uint32_t costs[] = {1, DEFAULT_PORT_COST, 100};
+    RouteTable routes;
+    Graph graph;
+    unsigned step, dearer = 0;
+    uint64_t sw;
+
+    srand(seed);
+    for (sw = 1; sw <= 2 * SWITCHES; sw++) {
+        graph.add_vertex(sw);
+    }
+    for (step = 0; step < 60; step++) {
+        uint64_t from = 1 + (uint64_t)rand() % (2 * SWITCHES);
+        uint64_t to = 1 + (uint64_t)rand() % (2 * SWITCHES);
+        uint32_t port = 1 + (uint32_t)rand() % PORTS;
+        graph.set_port_cost(from, port, costs[rand() % 3]);
+        if (from != to) {
+            graph.add_edge(from, port, to, 1 + (uint32_t)rand() % PORTS);
+        }
+    }
+    assert(graph.uniform_cost() == 0);
+    for (sw = 1; sw <= 2 * SWITCHES; sw += 3) {
+        routes.track(graph.vertex(sw));
+    }
+    RouteTest::update(&routes, &graph, 2);
+    check_cheapest(routes, graph);
+
+    for (step = 0; step < 200; step++) {
+        uint64_t from = 1 + (uint64_t)rand() % (2 * SWITCHES);
+        uint64_t to = 1 + (uint64_t)rand() % (2 * SWITCHES);
+        uint32_t port = 1 + (uint32_t)rand() % PORTS;
+        switch (rand() % 3) {
+            case 0:
+                graph.remove_edge(from, port);
+                break;
+            case 1:
+                dearer += graph.set_port_cost(from, port, costs[rand() % 3]);
+                break;
+            default:
+                if (from != to) {
+                    graph.add_edge(from, port, to,
+                                   1 + (uint32_t)rand() % PORTS);
+                }
+                break;
+        }
+        RouteTest::update(&routes, &graph, 1 + step % 2);
+        check_cheapest(routes, graph);
+        RouteTest::check_fresh(routes, graph);
+    }
+    printf("seed %u: %u link costs changed\n", seed, dearer);
+}
+
+/*
+ * A link costs what its dearer end does. Once the last link of an odd cost
+ * goes, whether it is taken away, cabled elsewhere or made cheaper, every
+ * link costs the same again and new rows go back to the BFS.
+ */
+static void test_uniform_again(void) {
+    RouteTable routes;
+    Graph graph;
+    std::vector<uint32_t> dist, next;
+    std::vector<uint64_t> ways;
+    uint32_t one, four, vertex;
+
+    // A square, 1 - 2 - 3 - 4 - 1, with 1's link to 4 slow at one end
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(2, 2, 3, 1);
+    graph.add_edge(3, 2, 4, 1);
+    graph.add_edge(4, 2, 1, 2);
+    assert(graph.uniform_cost() == DEFAULT_PORT_COST);
+    assert(graph.set_port_cost(4, 2, 100));
+    assert(!graph.set_port_cost(4, 2, 100));
+    assert(graph.uniform_cost() == 0);
+    assert(graph.edges(1)[1].cost == 100);
+    one = graph.vertex(1);
+    four = graph.vertex(4);
+    routes.track(four);
+    RouteTest::update(&routes, &graph, 1);
+    assert(routes.next_hop(one, four) == 1);
+    assert(RouteTest::dist_of(routes, one, four) == 3 * DEFAULT_PORT_COST);
+
+    // Taken away: its edges were the last at that cost
+    graph.remove_edge(1, 2);
+    assert(graph.uniform_cost() == DEFAULT_PORT_COST);
+    graph.add_edge(1, 2, 4, 2);
+    assert(graph.uniform_cost() == 0);
+
+    // Cabled elsewhere: 4's slow port goes to 2 instead
+    graph.add_edge(4, 2, 2, 3);
+    assert(graph.uniform_cost() == 0);
+    graph.add_edge(1, 2, 4, 3);
+    graph.add_edge(2, 3, 3, 3);
+    assert(graph.uniform_cost() == DEFAULT_PORT_COST);
+
+    // Made cheaper: set to what it was
+    graph.set_port_cost(1, 2, 100);
+    assert(graph.uniform_cost() == 0);
+    graph.set_port_cost(1, 2, DEFAULT_PORT_COST);
+    assert(graph.uniform_cost() == DEFAULT_PORT_COST);
+
+    // New rows are a BFS again, and the old one is brought up to date
+    routes.track(one);
+    RouteTest::update(&routes, &graph, 1);
+    check_cheapest(routes, graph);
+    bfs(graph, one, DEFAULT_PORT_COST, &dist, &next, &ways);
+    for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+        assert(RouteTest::dist_of(routes, vertex, one) == dist[vertex]);
+    }
+    assert(routes.next_hop(one, four) == 2);
+
+    // Every link at the same cost, whatever it is, is a BFS in that unit
+    graph.set_port_cost(1, 1, 20);
+    graph.set_port_cost(1, 2, 20);
+    graph.set_port_cost(2, 2, 20);
+    graph.set_port_cost(2, 3, 20);
+    graph.set_port_cost(4, 1, 20);
+    assert(graph.uniform_cost() == 20);
+    routes.untrack(one);
+    routes.track(one);
+    RouteTest::update(&routes, &graph, 1);
+    check_cheapest(routes, graph);
+    assert(RouteTest::dist_of(routes, graph.vertex(3), one) == 40);
+}
+
+/*
+ * Seventy links side by side: the ways hold the first 64 of them, bit 63 as
+ * well, whether the row was filled or repaired, and leave the rest out
+ */
+static void test_wide_ways(void) {
+    RouteTable routes;
+    Graph graph;
+    std::vector<uint32_t> ports;
+    uint32_t one, dest, port;
+
+    // 1 has 70 links to 2, which leads on to 3
+    for (port = 1; port <= 70; port++) {
+        graph.add_edge(1, port, 2, 100 + port);
+    }
+    graph.add_edge(2, 1, 3, 1);
+    one = graph.vertex(1);
+    dest = graph.vertex(3);
+    routes.track(dest);
+    RouteTest::update(&routes, &graph, 1);
+    assert(routes.next_hop(one, dest) == 1);
+    assert(RouteTest::ways_of(routes, one, dest) == ~0ULL);
+    routes.next_hops(graph, one, dest, &ports);
+    assert(ports.size() == 64 && ports[0] == 1 && ports[63] == 64);
+
+    // The first goes; the next 64 take its place
+    graph.remove_edge(1, 1);
+    RouteTest::update(&routes, &graph, 1);
+    RouteTest::check_fresh(routes, graph);
+    routes.next_hops(graph, one, dest, &ports);
+    assert(ports.size() == 64 && ports[0] == 2 && ports[63] == 65);
+
+    // Down to nine
+    for (port = 2; port <= 61; port++) {
+        graph.remove_edge(1, port);
+    }
+    RouteTest::update(&routes, &graph, 1);
+    RouteTest::check_fresh(routes, graph);
+    assert(RouteTest::ways_of(routes, one, dest) == (1ULL << 9) - 1);
+    routes.next_hops(graph, one, dest, &ports);
+    assert(ports.size() == 9 && ports[0] == 62 && ports[8] == 70);
+
+    // A port the switch does not have stands for nothing
+    RouteTable::hop_ports(graph, one, 1, 1, &ports);
+    assert(ports.empty());
+}
+
+typedef struct {
+    uint64_t from, to;
+    uint32_t from_port, to_port;
+} link_t;
+
+/*
+ * The same links give the same ports out of every switch whatever order
+ * they came in and the switches were met in, whether each one was repaired
+ * in as it came or the table was filled once they were all there
+ */
+static void test_order(unsigned seed) {
+    std::vector<link_t> links;
+    std::vector<uint32_t> used(SWITCHES + 1, 0), ports_a, ports_b;
+    RouteTable a, b;
+    Graph graph_a, graph_b;
+    uint64_t src, dest;
+    size_t ndx;
+
+    srand(seed);
+    while (links.size() < 3 * SWITCHES) {
+        link_t link;
+        link.from = 1 + (uint64_t)rand() % SWITCHES;
+        link.to = 1 + (uint64_t)rand() % SWITCHES;
+        if (link.from != link.to) {
+            link.from_port = ++used[link.from];
+            link.to_port = ++used[link.to];
+            links.push_back(link);
+        }
+    }
+
+    for (src = 1; src <= SWITCHES; src++) {
+        graph_a.add_vertex(src);
+    }
+    for (dest = 1; dest <= SWITCHES; dest += 2) {
+        a.track(graph_a.vertex(dest));
+    }
+    for (ndx = 0; ndx < links.size(); ndx++) {
+        graph_a.add_edge(links[ndx].from, links[ndx].from_port, links[ndx].to,
+                         links[ndx].to_port);
+        RouteTest::update(&a, &graph_a, 1);
+    }
+
+    // Backwards, from the other end
+    for (ndx = links.size(); ndx-- > 0;) {
+        graph_b.add_edge(links[ndx].to, links[ndx].to_port, links[ndx].from,
+                         links[ndx].from_port);
+    }
+    for (src = SWITCHES; src >= 1; src--) {
+        graph_b.add_vertex(src);
+    }
+    for (dest = 1; dest <= SWITCHES; dest += 2) {
+        b.track(graph_b.vertex(dest));
+    }
+    RouteTest::update(&b, &graph_b, 1);
+
+    for (dest = 1; dest <= SWITCHES; dest += 2) {
+        for (src = 1; src <= SWITCHES; src++) {
+            a.next_hops(graph_a, graph_a.vertex(src), graph_a.vertex(dest),
+                        &ports_a);
+            b.next_hops(graph_b, graph_b.vertex(src), graph_b.vertex(dest),
+                        &ports_b);
+            assert(ports_a == ports_b);
+        }
+    }
+}
+
+int main(void) {
+    unsigned seed;
+
+    for (seed = 1; seed <= 20; seed++) {
+        test_churn(seed);
+    }
+    for (seed = 1; seed <= 5; seed++) {
+        test_fill(seed, seed % 3 + 1);
+    }
+    for (seed = 1; seed <= 10; seed++) {
+        test_weighted(seed);
+    }
+    for (seed = 1; seed <= 20; seed++) {
+        test_order(seed);
+    }
+    test_recable();
+    test_uniform_again();
+    test_wide_ways();
+    test_epochs();
+    RouteTest::test_row_reuse();
+    test_nearest();
+    return 0;
+}
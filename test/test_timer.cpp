@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "../timer.h"
+
+// Span of level 0 and the three 64-slot levels above it, in ticks
+#define WHEEL_SPAN ((uint64_t)1 << 26)
+
+typedef struct {
+    uint64_t when;
+    timer_id_t id;
+    uint8_t fired;
+    uint8_t cancelled;
+} test_timer_t;
+
+static std::vector<test_timer_t> timers;
+static uint64_t prev_now, now, last_fired;
+
+static void fire(void *arg) {
+    test_timer_t *timer = &timers[(size_t)arg];
+
+    // Not early, not late, and in order
+    assert(!timer->fired && !timer->cancelled);
+    assert(timer->when > prev_now && timer->when <= now);
+    assert(timer->when >= last_fired);
+    timer->fired = 1;
+    last_fired = timer->when;
+}
+
+static void never(void *arg) {
+    assert(0);
+}
+
+static uint64_t random_delta(void) {
+    switch (rand() % 5) {
+        case 0:
+            return 1 + (uint64_t)rand() % 256;
+        case 1:
+            return 1 + (uint64_t)rand() % (1 << 14);
+        case 2:
+            return 1 + (uint64_t)rand() % (1 << 20);
+        case 3:
+            return 1 + (uint64_t)rand() % WHEEL_SPAN;
+        default:
+            // Past the top level: parked at the horizon and placed again
+            return WHEEL_SPAN + (uint64_t)rand() % (3 * WHEEL_SPAN);
+    }
+}
+
+static void advance(TimerWheel *wheel, uint64_t to) {
+    prev_now = now;
+    now = to;
+    wheel->advance(now);
+}
+
+// Nothing may be due sooner than the wheel says to wake
+static void check_timeout(const TimerWheel &wheel) {
+    int timeout = wheel.next_timeout(now);
+    std::vector<test_timer_t>::const_iterator it;
+
+    if (wheel.pending == 0) {
+        assert(timeout == -1);
+        return;
+    }
+    for (it = timers.begin(); it != timers.end(); it++) {
+        if (!it->fired && !it->cancelled) {
+            assert(it->when >= now + (uint64_t)timeout);
+        }
+    }
+}
+
+// A timer cascaded down into level 0 can still be cancelled
+static void test_cancel_after_cascade(void) {
+    TimerWheel wheel;
+    timer_id_t near, far;
+
+    wheel.start(0);
+    near = wheel.schedule(1000, never, nullptr);
+    far = wheel.schedule(WHEEL_SPAN + 5000, never, nullptr);
+    wheel.advance(768);
+    assert(wheel.cancel(near) == 1);
+    assert(wheel.cancel(near) == 0);
+    wheel.advance(WHEEL_SPAN);
+    assert(wheel.cancel(far) == 1);
+    wheel.advance(3 * WHEEL_SPAN);
+    assert(wheel.pending == 0);
+    assert(wheel.next_timeout(3 * WHEEL_SPAN) == -1);
+}
+
+// Random timers at every level fire exactly once, in order, on their tick
+static void test_random(unsigned seed) {
+    TimerWheel wheel;
+    size_t ndx, live = 0;
+    int round;
+
+    srand(seed);
+    timers.clear();
+    prev_now = now = last_fired = 1000;
+    wheel.start(now + 1);
+
+    for (round = 0; round < 2000; round++) {
+        int adds = rand() % 8;
+
+        while (adds-- > 0) {
+            test_timer_t timer;
+            timer.when = now + random_delta();
+            timer.fired = 0;
+            timer.cancelled = 0;
+            timer.id = 0;
+            timers.push_back(timer);
+            ndx = timers.size() - 1;
+            timers[ndx].id = wheel.schedule(timers[ndx].when, fire,
+                                            (void *)ndx);
+        }
+
+        // Cancel a few, wherever they have cascaded to by now
+        if (!timers.empty() && rand() % 3 == 0) {
+            ndx = (size_t)rand() % timers.size();
+            if (timers[ndx].fired || timers[ndx].cancelled) {
+                assert(wheel.cancel(timers[ndx].id) == 0);
+            } else {
+                assert(wheel.cancel(timers[ndx].id) == 1);
+                timers[ndx].cancelled = 1;
+            }
+        }
+
+        check_timeout(wheel);
+        // Mostly short steps, with the odd jump over whole levels
+        if (rand() % 50 == 0) {
+            advance(&wheel, now + (uint64_t)rand() % WHEEL_SPAN);
+        } else {
+            advance(&wheel, now + (uint64_t)rand() % 20000);
+        }
+    }
+
+    advance(&wheel, now + 5 * WHEEL_SPAN);
+    for (ndx = 0; ndx < timers.size(); ndx++) {
+        assert(timers[ndx].fired != timers[ndx].cancelled);
+        live += timers[ndx].fired;
+    }
+    assert(wheel.pending == 0);
+    printf("seed %u: %lu timers, %lu fired\n", seed,
+           (unsigned long)timers.size(), (unsigned long)live);
+}
+
+int main(void) {
+    unsigned seed;
+
+    test_cancel_after_cascade();
+    for (seed = 1; seed <= 10; seed++) {
+        test_random(seed);
+    }
+    return 0;
+}
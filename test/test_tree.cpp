@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include "../graph.h"
+#include "../tree.h"
+
+#define SWITCHES 12
+#define PORTS 6
+
+/*
+ * The tree's links as the switches at both ends have them: every switch the
+ * root reaches has one link up, and nothing else is on the tree
+ */
+static void check_shape(const BroadcastTree& tree, const Graph& graph) {
+    std::vector<uint8_t> reached(graph.num_vertices(), 0);
+    std::vector<uint32_t> queue;
+    uint32_t vertex;
+    size_t head, ndx, reachable = 0, on_tree = 0;
+
+    queue.push_back(graph.lowest_vertex());
+    reached[queue[0]] = 1;
+    for (head = 0; head < queue.size(); head++) {
+        const std::vector<edge_t>& edges = graph.neighbors(queue[head]);
+        for (ndx = 0; ndx < edges.size(); ndx++) {
+            if (!reached[edges[ndx].to]) {
+                reached[edges[ndx].to] = 1;
+                queue.push_back(edges[ndx].to);
+            }
+        }
+    }
+
+    for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+        const std::vector<edge_t>& edges = graph.neighbors(vertex);
+        const std::set<uint32_t>& ports = tree.ports(vertex);
+        std::set<uint32_t>::const_iterator it;
+        reachable += reached[vertex];
+        if (!reached[vertex] || queue.size() == 1) {
+            assert(ports.empty());
+            continue;
+        }
+        assert(!ports.empty());
+        for (it = ports.begin(); it != ports.end(); it++) {
+            // The far end has the link on the tree too
+            ndx = 0;
+            while (ndx < edges.size() && edges[ndx].port != *it) {
+                ndx++;
+            }
+            assert(ndx < edges.size());
+            assert(tree.ports(edges[ndx].to).count(edges[ndx].to_port));
+            on_tree++;
+        }
+    }
+    assert(on_tree == 2 * (reachable - 1));
+}
+
+// The tree a switch that only now saw the whole graph would build
+static void check_fresh(const BroadcastTree& tree, const Graph& graph) {
+    BroadcastTree fresh;
+    std::vector<uint32_t> changed;
+    Graph copy = graph;
+    uint32_t vertex;
+
+    fresh.update(&copy, &changed);
+    for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+        assert(tree.ports(vertex) == fresh.ports(vertex));
+    }
+}
+
+/*
+ * Links come and go at random, and now and then a switch with a lower dpid,
+ * a new root. Whatever has moved, the tree must be the one built from
+ * scratch, and every switch whose ports on it changed must be told.
+ */
+static void test_churn(unsigned seed) {
+    BroadcastTree tree;
+    Graph graph;
+    std::vector<uint32_t> changed;
+    std::vector<std::set<uint32_t> > before;
+    unsigned step, roots = 0;
+    uint32_t vertex;
+    uint64_t sw, lowest = SWITCHES + 1;
+
+    srand(seed);
+    for (sw = SWITCHES * 2; sw > SWITCHES; sw--) {
+        graph.add_vertex(sw);
+    }
+    tree.update(&graph, &changed);
+    check_shape(tree, graph);
+
+    for (step = 0; step < 300; step++) {
+        uint64_t from = SWITCHES + 1 + (uint64_t)rand() % SWITCHES;
+        uint64_t to = SWITCHES + 1 + (uint64_t)rand() % SWITCHES;
+        uint32_t port = 1 + (uint32_t)rand() % PORTS;
+
+        before.clear();
+        for (vertex = 0; vertex < graph.num_vertices(); vertex++) {
+            before.push_back(tree.ports(vertex));
+        }
+        if (step % 40 == 39) {
+            // Linked in, or off on its own
+            graph.add_vertex(--lowest);
+            if (rand() % 2) {
+                graph.add_edge(lowest, 1, from, port);
+            }
+            roots++;
+        } else if (rand() % 3 == 0) {
+            graph.remove_edge(from, port);
+        } else if (from != to) {
+            graph.add_edge(from, port, to, 1 + (uint32_t)rand() % PORTS);
+        }
+
+        tree.update(&graph, &changed);
+        check_shape(tree, graph);
+        check_fresh(tree, graph);
+        for (vertex = 0; vertex < before.size(); vertex++) {
+            if (before[vertex] != tree.ports(vertex)) {
+                assert(std::binary_search(changed.begin(), changed.end(),
+                                          vertex));
+            }
+        }
+    }
+    printf("seed %u: %u new roots\n", seed, roots);
+}
+
+/*
+ * One switch moves onto the very link another moves off: the link stays on
+ * the tree at both ends
+ */
+static void test_swap(void) {
+    BroadcastTree tree;
+    Graph graph;
+    std::vector<uint32_t> changed;
+    std::set<uint32_t> ports, up;
+    uint32_t one, two, three;
+
+    // A ring, 1 - 2 - 3 - 4 - 5 - 1; 3 is on the tree by 2
+    graph.add_edge(1, 1, 2, 1);
+    graph.add_edge(2, 2, 3, 1);
+    graph.add_edge(3, 2, 4, 1);
+    graph.add_edge(4, 2, 5, 1);
+    graph.add_edge(5, 2, 1, 2);
+    one = graph.vertex(1);
+    two = graph.vertex(2);
+    three = graph.vertex(3);
+    tree.update(&graph, &changed);
+    check_shape(tree, graph);
+    ports.insert(1);
+    ports.insert(2);
+    up.insert(2);
+    assert(tree.ports(two) == ports);
+
+    // 2 loses its link to 1, and is on the tree by 3 instead
+    graph.remove_edge(1, 1);
+    tree.update(&graph, &changed);
+    check_shape(tree, graph);
+    check_fresh(tree, graph);
+    assert(tree.ports(two) == up);
+    assert(tree.ports(three) == ports);
+    assert(std::binary_search(changed.begin(), changed.end(), one));
+    assert(std::binary_search(changed.begin(), changed.end(), two));
+    assert(std::binary_search(changed.begin(), changed.end(), three));
+}
+
+int main(void) {
+    unsigned seed;
+
+    for (seed = 1; seed <= 20; seed++) {
+        test_churn(seed);
+    }
+    test_swap();
+    return 0;
+}
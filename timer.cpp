@@ -0,0 +1,247 @@
+#include "timer.h"
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define LEVEL0_BITS 8
+#define LEVEL_BITS 6
+#define NUM_LEVELS 4
+#define LEVEL0_SIZE (1 << LEVEL0_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL0_MASK (LEVEL0_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define NUM_SLOTS (LEVEL0_SIZE + (NUM_LEVELS - 1) * LEVEL_SIZE)
+
+// Timers further out than this are parked at the horizon and re-placed
+#define MAX_DELTA ((1ULL << (LEVEL0_BITS + (NUM_LEVELS - 1) * LEVEL_BITS)) - 1)
+
+// Pseudo-slot holding the batch that is currently being expired
+#define EXPIRING_SLOT NUM_SLOTS
+#define NO_SLOT 0xffffffff
+#define NIL 0xffffffff
+
+Event::Event(event_handler_t h, void* a, uint64_t w) {
+    handler = h;
+    arg = a;
+    when = w;
+}
+
+TimerWheel::TimerWheel() {
+    pending = 0;
+    cur = 0;
+    memset(level0_used, 0, sizeof(level0_used));
+    slots.assign(NUM_SLOTS + 1, NIL);
+}
+
+/* Set the wheel's clock. Must be called before anything is scheduled. */
+void TimerWheel::start(uint64_t now) {
+    cur = now;
+}
+
+/* Schedule handler(arg) to fire at absolute time `when` (in ms) */
+timer_id_t TimerWheel::schedule(uint64_t when, event_handler_t handler,
+                                void* arg) {
+    uint32_t ndx;
+
+    if (!free_timers.empty()) {
+        ndx = free_timers.back();
+        free_timers.pop_back();
+    } else {
+        ndx = (uint32_t)timers.size();
+        timers.push_back(wheel_timer_t());
+        timers[ndx].generation = 1;
+    }
+
+    timers[ndx].handler = handler;
+    timers[ndx].arg = arg;
+    timers[ndx].when = when;
+    place(ndx);
+    pending++;
+
+    return ((uint64_t)timers[ndx].generation << 32) | ndx;
+}
+
+/* Return 1 if the timer was pending and will no longer fire */
+uint8_t TimerWheel::cancel(timer_id_t id) {
+    uint32_t ndx = (uint32_t)id;
+    uint32_t generation = (uint32_t)(id >> 32);
+
+    if (ndx >= timers.size() || timers[ndx].generation != generation ||
+        timers[ndx].slot == NO_SLOT) {
+        return 0;
+    }
+    unlink(ndx);
+    release(ndx);
+    return 1;
+}
+
+/* Milliseconds until the wheel next needs to advance, as an epoll timeout */
+int TimerWheel::next_timeout(uint64_t now) const {
+    unsigned ndx = (unsigned)(cur & LEVEL0_MASK);
+    uint64_t next;
+
+    if (pending == 0) {
+        return -1;
+    }
+
+    // Wake for the first busy level 0 slot, or for the next cascade. A
+    // cascade due on cur itself has not run yet and may bring anything down.
+    next = ndx == 0 ? cur : (cur | LEVEL0_MASK) + 1;
+    while (ndx != 0 && ndx < LEVEL0_SIZE) {
+        uint64_t word = level0_used[ndx / 64] >> (ndx % 64);
+        if (word) {
+            next = cur - (cur & LEVEL0_MASK) + ndx +
+                   (unsigned)__builtin_ctzll(word);
+            break;
+        }
+        ndx = (ndx / 64 + 1) * 64;
+    }
+
+    if (next <= now) {
+        return 0;
+    } else if (next - now > INT_MAX) {
+        return INT_MAX;
+    }
+    return (int)(next - now);
+}
+
+/* Expire every timer due at or before `now` */
+void TimerWheel::advance(uint64_t now) {
+    while (cur <= now) {
+        if (pending == 0) {
+            cur = now + 1;
+            break;
+        }
+        if ((cur & LEVEL0_MASK) != 0 && !level0_used[0] && !level0_used[1] &&
+            !level0_used[2] && !level0_used[3]) {
+            // Nothing in level 0, skip straight to the next cascade
+            cur = (cur | LEVEL0_MASK) + 1;
+            if (cur > now + 1) {
+                cur = now + 1;
+            }
+            continue;
+        }
+        tick();
+    }
+}
+
+void TimerWheel::tick() {
+    unsigned ndx = (unsigned)(cur & LEVEL0_MASK);
+    uint32_t timer;
+
+    if (ndx == 0) {
+        unsigned level, shift = LEVEL0_BITS;
+        for (level = 1; level < NUM_LEVELS; level++) {
+            unsigned lndx = (unsigned)((cur >> shift) & LEVEL_MASK);
+            cascade(level, lndx);
+            if (lndx != 0) {
+                break;
+            }
+            shift += LEVEL_BITS;
+        }
+    }
+
+    /*
+     * Move this tick's batch aside and advance the clock first, so handlers
+     * that reschedule themselves land on a later tick, and handlers that
+     * cancel a timer from the same batch still find it.
+     */
+    timer = slots[ndx];
+    slots[ndx] = NIL;
+    level0_used[ndx / 64] &= ~(1ULL << (ndx % 64));
+    slots[EXPIRING_SLOT] = timer;
+    for (; timer != NIL; timer = timers[timer].next) {
+        timers[timer].slot = EXPIRING_SLOT;
+    }
+    cur++;
+
+    while ((timer = slots[EXPIRING_SLOT]) != NIL) {
+        event_handler_t handler = timers[timer].handler;
+        void* arg = timers[timer].arg;
+
+        unlink(timer);
+        release(timer);
+        handler(arg);
+    }
+}
+
+/* Re-place every timer in a higher-level slot, now that it is closer */
+void TimerWheel::cascade(unsigned level, unsigned ndx) {
+    uint32_t slot = LEVEL0_SIZE + (level - 1) * LEVEL_SIZE + ndx;
+    uint32_t timer = slots[slot];
+
+    slots[slot] = NIL;
+    while (timer != NIL) {
+        uint32_t next = timers[timer].next;
+        place(timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::place(uint32_t timer) {
+    uint64_t when = timers[timer].when;
+    uint64_t delta;
+    uint32_t slot;
+
+    if (when < cur) {
+        when = cur;
+    }
+    delta = when - cur;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        when = cur + MAX_DELTA;
+    }
+
+    if (delta < LEVEL0_SIZE) {
+        slot = (uint32_t)(when & LEVEL0_MASK);
+        level0_used[slot / 64] |= 1ULL << (slot % 64);
+    } else {
+        unsigned level = 1, shift = LEVEL0_BITS;
+        while (delta >= (1ULL << (shift + LEVEL_BITS))) {
+            level++;
+            shift += LEVEL_BITS;
+        }
+        slot = LEVEL0_SIZE + (level - 1) * LEVEL_SIZE +
+               (uint32_t)((when >> shift) & LEVEL_MASK);
+    }
+    link(timer, slot);
+}
+
+void TimerWheel::link(uint32_t timer, uint32_t slot) {
+    timers[timer].slot = slot;
+    timers[timer].prev = NIL;
+    timers[timer].next = slots[slot];
+    if (slots[slot] != NIL) {
+        timers[slots[slot]].prev = timer;
+    }
+    slots[slot] = timer;
+}
+
+void TimerWheel::unlink(uint32_t timer) {
+    uint32_t slot = timers[timer].slot;
+    uint32_t prev = timers[timer].prev;
+    uint32_t next = timers[timer].next;
+
+    if (prev != NIL) {
+        timers[prev].next = next;
+    } else {
+        slots[slot] = next;
+    }
+    if (next != NIL) {
+        timers[next].prev = prev;
+    }
+    if (slot < LEVEL0_SIZE && slots[slot] == NIL) {
+        level0_used[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    timers[timer].slot = NO_SLOT;
+}
+
+/* Return a timer to the free list; bumping the generation kills old ids */
+void TimerWheel::release(uint32_t timer) {
+    if (++timers[timer].generation == 0) {
+        timers[timer].generation = 1;
+    }
+    free_timers.push_back(timer);
+    pending--;
+}
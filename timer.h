@@ -0,0 +1,63 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+typedef void (*event_handler_t)(void* arg);
+
+// Handle returned by TimerWheel::schedule; 0 is never a valid timer
+typedef uint64_t timer_id_t;
+
+// Time-based event
+class Event {
+   public:
+    event_handler_t handler;
+    void* arg;
+    uint64_t when;
+    Event(event_handler_t, void*, uint64_t);
+};
+
+/*
+ * Hierarchical timing wheel with 1ms ticks (Varghese & Lauck, as in the
+ * classic Linux timer base). Level 0 has one slot per tick for the next
+ * 256ms; each higher level covers 64 times the span of the one below and is
+ * cascaded down as time reaches it. Insert and cancel are O(1), and every
+ * timer due on a tick is expired as one batch.
+ */
+class TimerWheel {
+   public:
+    TimerWheel();
+    void start(uint64_t);
+    timer_id_t schedule(uint64_t, event_handler_t, void*);
+    uint8_t cancel(timer_id_t);
+    int next_timeout(uint64_t) const;
+    void advance(uint64_t);
+    size_t pending;
+
+   private:
+    typedef struct {
+        event_handler_t handler;
+        void* arg;
+        uint64_t when;
+        uint32_t generation;
+        uint32_t slot;
+        uint32_t prev;
+        uint32_t next;
+    } wheel_timer_t;
+
+    void link(uint32_t, uint32_t);
+    void unlink(uint32_t);
+    void place(uint32_t);
+    void cascade(unsigned, unsigned);
+    void tick(void);
+    void release(uint32_t);
+    std::vector<wheel_timer_t> timers;
+    std::vector<uint32_t> free_timers;
+    std::vector<uint32_t> slots;  // head timer of each slot's list
+    uint64_t level0_used[4];      // bitmap of non-empty level 0 slots
+    uint64_t cur;                 // next tick to expire
+};
+
+#endif /* TIMER_H_ */
@@ -0,0 +1,94 @@
+#include "tree.h"
+#include <stdint.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+
+BroadcastTree::BroadcastTree() {
+    root = NO_VERTEX;
+}
+
+/*
+ * Catch up with the links changed since the last update. Gives the switches
+ * whose links changed or whose ports on the tree did, in order.
+ */
+void BroadcastTree::update(Graph* graph, std::vector<uint32_t>* changed) {
+    std::vector<uint32_t> touched;
+    std::vector<route_change_t> moved;
+    std::vector<route_change_t>::const_iterator it;
+    uint32_t vertex, lowest = graph->lowest_vertex();
+    edge_t none;
+
+    none.port = NO_ROUTE;
+    touched.swap(graph->tree_touched);
+    table.begin_update(*graph, &touched);
+    up.resize(graph->num_vertices(), none);
+    links.resize(graph->num_vertices());
+    *changed = touched;
+
+    if (lowest != root) {
+        // A new root: everything moves, from no tree at all
+        for (vertex = 0; vertex < up.size(); vertex++) {
+            unlink(vertex, changed);
+        }
+        if (root != NO_VERTEX) {
+            table.untrack(root);
+        }
+        root = lowest;
+        table.track(root);
+    }
+    table.update_part(*graph, touched, 0, 1, &moved);
+
+    // Every old link first, so one a switch moves onto is not lost to the
+    // switch that moved off it
+    for (it = moved.begin(); it != moved.end(); it++) {
+        unlink(it->vertex, changed);
+    }
+    for (it = moved.begin(); it != moved.end(); it++) {
+        if (it->port != NO_ROUTE) {
+            link(*graph, it->vertex, it->port, changed);
+        }
+    }
+
+    std::sort(changed->begin(), changed->end());
+    changed->erase(std::unique(changed->begin(), changed->end()),
+                   changed->end());
+}
+
+// A switch's ports on the tree
+const std::set<uint32_t>& BroadcastTree::ports(uint32_t vertex) const {
+    static const std::set<uint32_t> none;
+
+    return vertex < links.size() ? links[vertex] : none;
+}
+
+void BroadcastTree::link(const Graph& graph, uint32_t vertex, uint32_t port,
+                         std::vector<uint32_t>* changed) {
+    const std::vector<edge_t>& edges = graph.neighbors(vertex);
+    std::vector<edge_t>::const_iterator it = edges.begin();
+
+    while (it != edges.end() && it->port != port) {
+        it++;
+    }
+    if (it == edges.end()) {
+        return;
+    }
+    up[vertex] = *it;
+    links[vertex].insert(it->port);
+    links[it->to].insert(it->to_port);
+    changed->push_back(vertex);
+    changed->push_back(it->to);
+}
+
+void BroadcastTree::unlink(uint32_t vertex, std::vector<uint32_t>* changed) {
+    edge_t* edge = &up[vertex];
+
+    if (edge->port == NO_ROUTE) {
+        return;
+    }
+    links[vertex].erase(edge->port);
+    links[edge->to].erase(edge->to_port);
+    changed->push_back(vertex);
+    changed->push_back(edge->to);
+    edge->port = NO_ROUTE;
+}
@@ -0,0 +1,37 @@
+#ifndef TREE_H_
+#define TREE_H_
+
+#include <stdint.h>
+#include <set>
+#include <vector>
+#include "graph.h"
+#include "routes.h"
+
+/*
+ * The spanning tree broadcasts go down: each switch's link on its cheapest
+ * path to the root, the switch with the lowest dpid, picked the way the
+ * route table picks next hops. That depends only on the graph, so every
+ * shard has the same tree, and the route table's repairs keep it up to
+ * date: a change to some links only moves the switches around them. Only a
+ * new lowest dpid, a new root, moves the whole tree.
+ *
+ * Switches the root does not reach are on no link of the tree; they only
+ * flood to their own hosts.
+ */
+class BroadcastTree {
+   public:
+    BroadcastTree();
+    void update(Graph*, std::vector<uint32_t>*);
+    const std::set<uint32_t>& ports(uint32_t) const;
+
+   private:
+    void link(const Graph&, uint32_t, uint32_t, std::vector<uint32_t>*);
+    void unlink(uint32_t, std::vector<uint32_t>*);
+
+    RouteTable table;  // just the root's row
+    uint32_t root;     // vertex, or NO_VERTEX before there are any
+    std::vector<edge_t> up;  // by vertex: its link toward the root, if any
+    std::vector<std::set<uint32_t> > links;  // by vertex: its ports on the tree
+};
+
+#endif /* TREE_H_ */
@@ -0,0 +1,295 @@
+#include "uring.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdio>
+
+#define BUF_GROUP 0
+
+Uring::Uring() {
+    fd = -1;
+    to_submit = 0;
+    sq_ring = nullptr;
+    sq_ring_size = 0;
+    sq_entries = 0;
+    sqes = nullptr;
+    buf_ring = nullptr;
+    bufs = nullptr;
+    buf_count = 0;
+    buf_size = 0;
+    buf_tail = 0;
+}
+
+/*
+ * Create the ring and its receive buffers (count must be a power of two).
+ * Return 0, or a negative errno if this kernel cannot run our backend.
+ */
+int Uring::setup(unsigned entries, unsigned count, unsigned size) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    uint8_t *sq_ptr, *cq_ptr;
+    unsigned ndx;
+
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        return fail(-ENOSYS);
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    sq_ptr = (uint8_t*)mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        return fail(-errno);
+    }
+    sq_ring = sq_ptr;
+    cq_ptr = sq_ptr;
+    sq_entries = p.sq_entries;
+    sqes = (struct io_uring_sqe*)mmap(
+        nullptr, sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = nullptr;
+        return fail(-errno);
+    }
+
+    sq_head = (uint32_t*)(sq_ptr + p.sq_off.head);
+    sq_tail = (uint32_t*)(sq_ptr + p.sq_off.tail);
+    sq_mask = *(uint32_t*)(sq_ptr + p.sq_off.ring_mask);
+    sq_array = (uint32_t*)(sq_ptr + p.sq_off.array);
+    cq_head = (uint32_t*)(cq_ptr + p.cq_off.head);
+    cq_tail = (uint32_t*)(cq_ptr + p.cq_off.tail);
+    cq_mask = *(uint32_t*)(cq_ptr + p.cq_off.ring_mask);
+    cqes = cq_ptr + p.cq_off.cqes;
+
+    /* Provided buffer ring for multishot receives */
+    buf_count = count;
+    buf_size = size;
+    buf_ring = (struct io_uring_buf_ring*)mmap(
+        nullptr, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        buf_ring = nullptr;
+        return fail(-errno);
+    }
+    if ((bufs = (uint8_t*)malloc((size_t)count * size)) == nullptr) {
+        perror("malloc");
+        exit(-1);
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = BUF_GROUP;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg,
+                1) < 0) {
+        return fail(-errno);
+    }
+    for (ndx = 0; ndx < count; ndx++) {
+        recycle(ndx << IORING_CQE_BUFFER_SHIFT);
+    }
+
+    return 0;
+}
+
+/* Undo as much of a setup as got done, and return err */
+int Uring::fail(int err) {
+    free(bufs);
+    bufs = nullptr;
+    if (buf_ring != nullptr) {
+        munmap(buf_ring, buf_count * sizeof(struct io_uring_buf));
+        buf_ring = nullptr;
+    }
+    if (sqes != nullptr) {
+        munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+        sqes = nullptr;
+    }
+    if (sq_ring != nullptr) {
+        munmap(sq_ring, sq_ring_size);
+        sq_ring = nullptr;
+    }
+    close(fd);
+    fd = -1;
+    return err;
+}
+
+struct io_uring_sqe* Uring::get_sqe() {
+    struct io_uring_sqe* sqe;
+    uint32_t tail = *sq_tail;
+
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask) {
+        /* Submission queue full, hand what we have to the kernel */
+        submit();
+    }
+
+    sqe = &sqes[tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[tail & sq_mask] = tail & sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+    return sqe;
+}
+
+/* Multishot POLLIN on fd (used for the reactor's eventfd) */
+void Uring::prep_poll(int pfd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = pfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+/* Multishot accept: one completion per new connection */
+void Uring::prep_accept(int lfd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = lfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = user_data;
+}
+
+/* Multishot receive into buffers picked from the provided buffer ring */
+void Uring::prep_recv(int sfd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = user_data;
+}
+
+/* Send everything msg points to; msg must stay valid until it completes */
+void Uring::prep_sendmsg(int sfd, const struct msghdr* msg,
+                         uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sfd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+/* Cancel everything outstanding on fd, and submit now, before it closes */
+void Uring::prep_cancel(int cfd) {
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = cfd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = URING_CANCEL;
+    submit();
+}
+
+int Uring::enter(unsigned submit_count, unsigned min_complete, unsigned flags,
+                 const void* arg, size_t argsz) {
+    int ret = (int)syscall(__NR_io_uring_enter, fd, submit_count, min_complete,
+                           flags, arg, argsz);
+    return ret < 0 ? -errno : ret;
+}
+
+void Uring::submit() {
+    int ret;
+
+    while (to_submit > 0) {
+        if ((ret = enter(to_submit, 0, 0, nullptr, 0)) < 0) {
+            if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) {
+                continue;
+            }
+            errno = -ret;
+            perror("io_uring_enter");
+            exit(-1);
+        }
+        to_submit -= (unsigned)ret;
+    }
+}
+
+/* Submit everything queued and wait for a completion, or timeout_ms */
+void Uring::wait(int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    int ret;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    ret = enter(to_submit, 1, flags, timeout_ms >= 0 ? &arg : nullptr,
+                timeout_ms >= 0 ? sizeof(arg) : 0);
+    if (ret < 0) {
+        if (ret == -ETIME || ret == -EINTR || ret == -EAGAIN ||
+            ret == -EBUSY) {
+            return;
+        }
+        errno = -ret;
+        perror("io_uring_enter");
+        exit(-1);
+    }
+    to_submit -= (unsigned)ret;
+}
+
+/* Pop the next completion. Return 0 if there is none. */
+uint8_t Uring::next_completion(uint64_t* user_data, int32_t* res,
+                               uint32_t* flags) {
+    uint32_t head = *cq_head;
+    struct io_uring_cqe* cqe;
+
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    cqe = &((struct io_uring_cqe*)cqes)[head & cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    *flags = cqe->flags;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Buffer a receive completion landed in, from its completion flags */
+uint8_t* Uring::buffer(uint32_t cqe_flags) {
+    return bufs + (size_t)(cqe_flags >> IORING_CQE_BUFFER_SHIFT) * buf_size;
+}
+
+/* Give a receive buffer back to the kernel, from its completion flags */
+void Uring::recycle(uint32_t cqe_flags) {
+    uint16_t bid = (uint16_t)(cqe_flags >> IORING_CQE_BUFFER_SHIFT);
+    struct io_uring_buf* buf;
+
+    /*
+     * Index the ring by hand: compiled as C++, the empty struct in the
+     * header's __DECLARE_FLEX_ARRAY takes a byte and pushes bufs[] off by 8.
+     */
+    buf = (struct io_uring_buf*)(void*)buf_ring + (buf_tail & (buf_count - 1));
+
+    buf->addr = (uint64_t)(uintptr_t)(bufs + (size_t)bid * buf_size);
+    buf->len = buf_size;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
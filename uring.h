@@ -0,0 +1,71 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct io_uring_sqe;
+struct io_uring_buf_ring;
+struct msghdr;
+
+// What a completion is for, kept in the low bits of its user_data
+enum uring_op {
+    URING_WAKE = 1,
+    URING_ACCEPT = 2,
+    URING_RECV = 3,
+    URING_SEND = 4,
+    URING_CANCEL = 5,
+    URING_DATAGRAM = 6
+};
+#define URING_OP_MASK 7
+
+/*
+ * Minimal io_uring wrapper, talking to the kernel directly rather than
+ * through liburing. Each reactor owns one ring plus one provided-buffer ring
+ * that multishot receives pick their buffers from.
+ */
+class Uring {
+   public:
+    Uring();
+    int setup(unsigned, unsigned, unsigned);
+    void prep_poll(int, uint64_t);
+    void prep_accept(int, uint64_t);
+    void prep_recv(int, uint64_t);
+    void prep_sendmsg(int, const struct msghdr*, uint64_t);
+    void prep_cancel(int);
+    void submit(void);
+    void wait(int);
+    uint8_t next_completion(uint64_t*, int32_t*, uint32_t*);
+    uint8_t* buffer(uint32_t);
+    void recycle(uint32_t);
+
+   private:
+    struct io_uring_sqe* get_sqe(void);
+    int enter(unsigned, unsigned, unsigned, const void*, size_t);
+    int fail(int);
+    int fd;
+    unsigned to_submit;
+    // Submission and completion queue rings, mapped together
+    uint8_t* sq_ring;
+    size_t sq_ring_size;
+    // Submission queue
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_entries;
+    // Completion queue
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    void* cqes;
+    // Provided receive buffers
+    struct io_uring_buf_ring* buf_ring;
+    uint8_t* bufs;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_tail;
+};
+
+#endif /* URING_H_ */
@@ -0,0 +1,42 @@
+#include "workers.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "timer.h"
+
+WorkerPool::WorkerPool() {
+    size = 0;
+}
+
+void WorkerPool::start(unsigned count) {
+    unsigned ndx;
+
+    for (ndx = 0; ndx < count; ndx++) {
+        std::thread(&WorkerPool::work, this).detach();
+    }
+    size = count;
+}
+
+/* Thread-safe: queue handler(arg) for the next free worker */
+void WorkerPool::run(event_handler_t handler, void* arg) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(Event(handler, arg, 0));
+    }
+    ready.notify_one();
+}
+
+void WorkerPool::work() {
+    for (;;) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (tasks.empty()) {
+            ready.wait(guard);
+        }
+        Event task = tasks.front();
+        tasks.pop_front();
+        guard.unlock();
+
+        task.handler(task.arg);
+    }
+}
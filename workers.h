@@ -0,0 +1,28 @@
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include "timer.h"
+
+/*
+ * Threads for CPU-bound work that should not hold up a reactor. A task runs
+ * on whichever worker is free; it hands its results back by posting to a
+ * reactor, like any other thread.
+ */
+class WorkerPool {
+   public:
+    WorkerPool();
+    void start(unsigned);
+    void run(event_handler_t, void*);
+    unsigned size;  // number of workers
+
+   private:
+    void work(void);
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Event> tasks;
+};
+
+#endif /* WORKERS_H_ */